@@ -0,0 +1,113 @@
+/**
+ * @file bench.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Times a converter over an input file and reports its throughput.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ *
+ * The command is run with the input file on stdin and stdout and stderr
+ * sent to /dev/null. The best wall-clock time over the iterations is reported as
+ * MB/s of input and records/s, along with the largest peak RSS seen.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void);
+static int run(const char *input, char **cmd, double *seconds, long *rss_kb);
+
+int main(int ac, char **av) {
+    const char *label = NULL;
+    long iterations = 3;
+    long records = 0;
+    int i = 1;
+    for (; i < ac && strcmp(av[i], "--") != 0; i++) {
+        if (strcmp(av[i], "-i") == 0 && i + 1 < ac) {
+            iterations = atol(av[++i]);
+        } else if (strcmp(av[i], "-l") == 0 && i + 1 < ac) {
+            label = av[++i];
+        } else if (strcmp(av[i], "-n") == 0 && i + 1 < ac) {
+            records = atol(av[++i]);
+        } else {
+            break;
+        }
+    }
+    if (i + 2 >= ac || strcmp(av[i], "--") != 0) {
+        fprintf(stderr, "Usage: %s [-i iterations] [-l label] [-n records] -- input command [args]\n", av[0]);
+        fprintf(stderr, "-i ..... Number of runs, the fastest is reported, default 3\n");
+        fprintf(stderr, "-l ..... Label for the result line, default the command\n");
+        fprintf(stderr, "-n ..... Number of records in the input, for records/s\n");
+        return 1;
+    }
+    const char *input = av[i + 1];
+    char **cmd = &av[i + 2];
+    struct stat st;
+    if (stat(input, &st) != 0) {
+        fprintf(stderr, "Unable to open file \"%s\"\n", input);
+        return 1;
+    }
+    double best = 0;
+    long peak = 0;
+    for (long n = 0; n < iterations || n == 0; n++) {
+        double seconds;
+        long rss;
+        if (run(input, cmd, &seconds, &rss) != 0) {
+            fprintf(stderr, "%s exited with an error on \"%s\"\n", cmd[0], input);
+            return 1;
+        }
+        if (n == 0 || seconds < best) {
+            best = seconds;
+        }
+        if (rss > peak) {
+            peak = rss;
+        }
+    }
+    if (best <= 0) {
+        best = 1e-9;
+    }
+    printf("%-32s %8.3f s %9.1f MB/s %11.0f rec/s %9ld KB\n", label ? label : cmd[0], best,
+        st.st_size / best / 1e6, records / best, peak);
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char *input, char **cmd, double *seconds, long *rss_kb) {
+    struct rusage ru;
+    int status;
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int in = open(input, O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0 || dup2(in, STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0 || dup2(out, STDERR_FILENO) < 0) {
+            _exit(127);
+        }
+        execvp(cmd[0], cmd);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        return -1;
+    }
+    *seconds = now() - start;
+    *rss_kb = ru.ru_maxrss;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
@@ -0,0 +1,296 @@
+/**
+ * @file ldgen.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Generates synthetic LD or JSONL corpora for benchmarking.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ *
+ * The same kind, record count and seed produce the same records in either
+ * format, so one corpus can be timed through ld2json and json2ld.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ld.h"
+
+#define max_depth 64
+#define ld_line_len 72
+
+typedef enum format {
+    format_ld,
+    format_json
+} format;
+
+typedef struct kind {
+    const char *name;
+    const char *description;
+    void (*record)(void);
+} kind;
+
+static format fmt = format_ld;
+static uint64_t seed = 1;
+static int depth = 0;
+static bool had_member[max_depth];
+static char in_array[max_depth];
+
+static void begin(const char *key, char type);
+static void end(char type);
+static void json_string(const char *s);
+static void member(const char *key);
+static int next(int n);
+static void numeric(const char *key, const char *text);
+static void record_deep(void);
+static void record_numeric(void);
+static void record_small(void);
+static void record_strings(void);
+static void record_wide(void);
+static void scalar(const char *key, char type, const char *text);
+static void words(char *buf, size_t len);
+
+static const kind kinds[] = {
+    { "small", "many small flat records", record_small },
+    { "deep", "nested objects and arrays 24 levels deep", record_deep },
+    { "strings", "long strings spread over many LD lines", record_strings },
+    { "numeric", "records made mostly of numbers", record_numeric },
+    { "wide", "objects with hundreds of members", record_wide },
+};
+
+int main(int ac, char **av) {
+    const kind *k = &kinds[0];
+    long records = 10000;
+    for (int i = 1; i < ac; i++) {
+        if (strcmp(av[i], "-f") == 0 && i + 1 < ac) {
+            i++;
+            if (strcmp(av[i], "ld") == 0) {
+                fmt = format_ld;
+            } else if (strcmp(av[i], "json") == 0) {
+                fmt = format_json;
+            } else {
+                fprintf(stderr, "Unknown format \"%s\"\n", av[i]);
+                return 1;
+            }
+        } else if (strcmp(av[i], "-k") == 0 && i + 1 < ac) {
+            i++;
+            k = NULL;
+            for (size_t j = 0; j < sizeof(kinds) / sizeof(kinds[0]); j++) {
+                if (strcmp(av[i], kinds[j].name) == 0) {
+                    k = &kinds[j];
+                }
+            }
+            if (k == NULL) {
+                fprintf(stderr, "Unknown kind \"%s\"\n", av[i]);
+                return 1;
+            }
+        } else if (strcmp(av[i], "-n") == 0 && i + 1 < ac) {
+            records = atol(av[++i]);
+        } else if (strcmp(av[i], "-s") == 0 && i + 1 < ac) {
+            seed = strtoull(av[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [-f ld|json] [-k kind] [-n records] [-s seed]\n", av[0]);
+            fprintf(stderr, "-f ..... Output format, default ld\n");
+            fprintf(stderr, "-k ..... Kind of records, default small:\n");
+            for (size_t j = 0; j < sizeof(kinds) / sizeof(kinds[0]); j++) {
+                fprintf(stderr, "           %-8s %s\n", kinds[j].name, kinds[j].description);
+            }
+            fprintf(stderr, "-n ..... Number of records, default 10000\n");
+            fprintf(stderr, "-s ..... Random seed, default 1\n");
+            return strcmp(av[i], "-h") == 0 ? 0 : 1;
+        }
+    }
+    for (long i = 0; i < records; i++) {
+        k->record();
+    }
+    return fflush(stdout) == 0 ? 0 : 1;
+}
+
+static void begin(const char *key, char type) {
+    if (fmt == format_ld) {
+        printf("%*s%s%c%s\n", depth * 2, "", key_prefix, type, key);
+    } else {
+        member(key);
+        putchar(type);
+    }
+    depth++;
+    had_member[depth] = false;
+    in_array[depth] = type == key_start_array;
+}
+
+static void end(char type) {
+    depth--;
+    if (fmt == format_ld) {
+        printf("%*s%s%c\n", depth * 2, "", key_prefix, type);
+    } else {
+        putchar(type);
+        if (depth == 0) {
+            putchar('\n');
+        }
+    }
+}
+
+static void json_string(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            putchar('\\');
+        }
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+static void member(const char *key) {
+    if (depth > 0) {
+        if (had_member[depth]) {
+            putchar(',');
+        }
+        had_member[depth] = true;
+        if (!in_array[depth]) {
+            json_string(key);
+            putchar(':');
+        }
+    }
+}
+
+/**
+ * @brief xorshift64* step, reduced to 0..n-1.
+ */
+static int next(int n) {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (int)((seed * 2685821657736338717ull) >> 33) % n;
+}
+
+static void numeric(const char *key, const char *text) {
+    scalar(key, key_number, text);
+}
+
+static void record_deep(void) {
+    char key[32];
+    char text[16];
+    int levels = 24;
+    begin("", key_start_obj);
+    for (int i = 0; i < levels; i++) {
+        snprintf(key, sizeof(key), "level%d", i);
+        if (i % 2 == 0) {
+            begin(key, key_start_obj);
+            snprintf(text, sizeof(text), "%d", i);
+            numeric("depth", text);
+        } else {
+            begin(key, key_start_array);
+            scalar("", key_boolean, next(2) ? "true" : "false");
+        }
+    }
+    for (int i = levels - 1; i >= 0; i--) {
+        end(i % 2 == 0 ? key_end_obj : key_end_array);
+    }
+    end(key_end_obj);
+}
+
+static void record_numeric(void) {
+    char key[16];
+    char text[64];
+    begin("", key_start_obj);
+    for (int i = 0; i < 16; i++) {
+        snprintf(key, sizeof(key), "m%d", i);
+        switch (next(3)) {
+            case 0:
+                snprintf(text, sizeof(text), "%d", next(2000000) - 1000000);
+                break;
+            case 1:
+                snprintf(text, sizeof(text), "%d.%03d", next(100000), next(1000));
+                break;
+            default:
+                snprintf(text, sizeof(text), "%d.%de%d", next(10), next(1000000), next(40) - 20);
+                break;
+        }
+        numeric(key, text);
+    }
+    begin("samples", key_start_array);
+    for (int i = 0; i < 32; i++) {
+        snprintf(text, sizeof(text), "%d.%02d", next(1000), next(100));
+        numeric("", text);
+    }
+    end(key_end_array);
+    end(key_end_obj);
+}
+
+static void record_small(void) {
+    char text[64];
+    begin("", key_start_obj);
+    snprintf(text, sizeof(text), "user%d", next(1000000));
+    scalar("name", key_string, text);
+    snprintf(text, sizeof(text), "%d", next(100));
+    numeric("age", text);
+    scalar("active", key_boolean, next(2) ? "true" : "false");
+    scalar("manager", key_null, "null");
+    end(key_end_obj);
+}
+
+static void record_strings(void) {
+    char text[16384];
+    begin("", key_start_obj);
+    for (int i = 0; i < 4; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "text%d", i);
+        words(text, 1024 + next(sizeof(text) - 1024));
+        scalar(key, key_string, text);
+    }
+    end(key_end_obj);
+}
+
+static void record_wide(void) {
+    char key[16];
+    char text[32];
+    begin("", key_start_obj);
+    for (int i = 0; i < 300; i++) {
+        snprintf(key, sizeof(key), "field%d", i);
+        if (i % 3 == 0) {
+            snprintf(text, sizeof(text), "%d", next(100000));
+            numeric(key, text);
+        } else {
+            snprintf(text, sizeof(text), "value %d", next(100000));
+            scalar(key, key_string, text);
+        }
+    }
+    end(key_end_obj);
+}
+
+static void scalar(const char *key, char type, const char *text) {
+    if (fmt == format_json) {
+        member(key);
+        if (type == key_string) {
+            json_string(text);
+        } else {
+            fputs(text, stdout);
+        }
+        return;
+    }
+    printf("%*s%s%c%s\n", depth * 2, "", key_prefix, type, key);
+    size_t len = strlen(text);
+    for (size_t i = 0; i < len; i += ld_line_len) {
+        printf("%*s%.*s\n", depth * 2, "", ld_line_len, text + i);
+    }
+}
+
+/**
+ * @brief Fill a buffer with lower-case words separated by single spaces.
+ */
+static void words(char *buf, size_t len) {
+    size_t i = 0;
+    while (i + 1 < len) {
+        int n = 2 + next(8);
+        for (int j = 0; j < n && i + 1 < len; j++) {
+            buf[i++] = 'a' + next(26);
+        }
+        if (i + 2 < len) {
+            buf[i++] = ' ';
+        }
+    }
+    buf[i] = '\0';
+}
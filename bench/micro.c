@@ -0,0 +1,324 @@
+/**
+ * @file micro.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Times the parser's hot functions one at a time over an LD file.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ *
+ * The whole file is loaded first, and the strings and numbers in it are
+ * collected, so each case times only the function it is named for. A case
+ * is run over all of its data once per pass; the fastest pass is reported
+ * as MB/s of the data it was given and nanoseconds per item.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../ld.h"
+#include "../lines.h"
+#include "../number.h"
+#include "../output.h"
+
+#define min_pass_seconds 0.2
+#define wrap_width 80
+#define wrap_indent 4
+
+/**
+ * @brief A piece of the loaded file.
+ */
+typedef struct span {
+    const char *s;
+    size_t len;
+} span;
+
+/**
+ * @brief Spans collected from the file, for the cases that time one kind
+ * of value.
+ */
+typedef struct spans {
+    span *items;
+    size_t count;
+    size_t cap;
+    size_t bytes;
+} spans;
+
+typedef struct micro_case {
+    const char *name;
+    const char *description;
+    size_t (*run)(size_t *items);
+} micro_case;
+
+static char *text = NULL;
+static size_t text_len = 0;
+static spans strings;
+static spans numbers;
+static number *parsed = NULL;
+static output out;
+static line_index line_ix;
+static ld_parser *parser = NULL;
+static volatile uint64_t sink;
+
+static bool collect(void);
+static bool load(const char *path);
+static double now(void);
+static bool push(spans *sp, const char *s, size_t len);
+static size_t run_escape(size_t *items);
+static size_t run_ld_out(size_t *items);
+static size_t run_lines(size_t *items);
+static size_t run_numbers(size_t *items);
+static size_t run_parse(size_t *items);
+static size_t run_wrap(size_t *items);
+
+static const micro_case cases[] = {
+    { "lines", "split the file into lines and spot key and blank lines (lines_scan)", run_lines },
+    { "parse", "parse every record, keys and values, with no callbacks (ld_parser_next)", run_parse },
+    { "numbers", "check and convert each number value (number_parse)", run_numbers },
+    { "escape", "write each string line with JSON escapes (output_escaped)", run_escape },
+    { "wrap", "write each string line wrapped for LD output (output_wrapped)", run_wrap },
+    { "ld_out", "write each value back as an LD key line and value, as json2ld does", run_ld_out },
+};
+
+int main(int ac, char **av) {
+    long passes = 5;
+    const char *only = NULL;
+    const char *path = NULL;
+    for (int i = 1; i < ac; i++) {
+        if (strcmp(av[i], "-c") == 0 && i + 1 < ac) {
+            only = av[++i];
+        } else if (strcmp(av[i], "-i") == 0 && i + 1 < ac) {
+            passes = atol(av[++i]);
+        } else if (strcmp(av[i], "-h") == 0 || path != NULL) {
+            path = NULL;
+            break;
+        } else {
+            path = av[i];
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "Usage: %s [-c case] [-i passes] file.ld\n", av[0]);
+        fprintf(stderr, "-c ..... Run only this case\n");
+        fprintf(stderr, "-i ..... Least number of passes, the fastest is reported, default 5\n");
+        fprintf(stderr, "Cases:\n");
+        for (size_t c = 0; c < sizeof(cases) / sizeof(*cases); c++) {
+            fprintf(stderr, "%-8s %s\n", cases[c].name, cases[c].description);
+        }
+        return 1;
+    }
+    if (!load(path) || !collect()) {
+        return 1;
+    }
+    static const ld_callbacks none = { NULL, NULL, NULL };
+    if ((parser = ld_parser_new(&none, NULL)) == NULL) {
+        return 1;
+    }
+    output_open(&out, -1, 0);
+    bool found = false;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(*cases); c++) {
+        if (only != NULL && strcmp(only, cases[c].name) != 0) {
+            continue;
+        }
+        found = true;
+        double best = 0;
+        double total = 0;
+        size_t bytes = 0;
+        size_t items = 0;
+        // Passes go on past the minimum until enough time has been spent
+        // for the fastest one to be trusted.
+        for (long n = 0; n < passes || total < min_pass_seconds; n++) {
+            double start = now();
+            bytes = cases[c].run(&items);
+            double seconds = now() - start;
+            total += seconds;
+            if (n == 0 || seconds < best) {
+                best = seconds;
+            }
+        }
+        if (best <= 0) {
+            best = 1e-9;
+        }
+        printf("%-8s %9.1f MB/s %9.1f ns/item %10zu items\n", cases[c].name, bytes / best / 1e6,
+            items > 0 ? best * 1e9 / items : 0, items);
+    }
+    if (!found) {
+        fprintf(stderr, "Unknown case \"%s\"\n", only);
+        return 1;
+    }
+    output_close(&out);
+    ld_parser_free(parser);
+    lines_free(&line_ix);
+    free(parsed);
+    free(strings.items);
+    free(numbers.items);
+    free(text);
+    return 0;
+}
+
+/**
+ * @brief Collect the data lines of the file: the first line of each number
+ * value, and every line of the other values as strings.
+ */
+static bool collect(void) {
+    line_index ix;
+    memset(&ix, 0, sizeof(ix));
+    if (!lines_scan(&ix, text, text_len)) {
+        return false;
+    }
+    char type = '\0';
+    bool first = false;
+    for (size_t i = 0; i < ix.count; i++) {
+        const line_info *l = &ix.lines[i];
+        if (l->key) {
+            type = l->type;
+            first = true;
+        } else if (!l->blank && type == key_number && first) {
+            if (!push(&numbers, l->s + l->indent, l->len - l->indent)) {
+                return false;
+            }
+            first = false;
+        } else if (!l->blank && type == key_string) {
+            if (!push(&strings, l->s, l->len)) {
+                return false;
+            }
+        }
+    }
+    lines_free(&ix);
+    parsed = calloc(numbers.count + 1, sizeof(*parsed));
+    if (parsed == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return false;
+    }
+    for (size_t i = 0; i < numbers.count; i++) {
+        number_parse(numbers.items[i].s, numbers.items[i].len, &parsed[i]);
+    }
+    return true;
+}
+
+static bool load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open file \"%s\"\n", path);
+        return false;
+    }
+    size_t cap = 1 << 20;
+    text = malloc(cap);
+    while (text != NULL) {
+        text_len += fread(text + text_len, 1, cap - text_len, f);
+        if (text_len < cap) {
+            break;
+        }
+        cap *= 2;
+        char *t = realloc(text, cap);
+        if (t == NULL) {
+            free(text);
+        }
+        text = t;
+    }
+    fclose(f);
+    if (text == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return false;
+    }
+    return true;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool push(spans *sp, const char *s, size_t len) {
+    if (sp->count == sp->cap) {
+        size_t cap = sp->cap ? sp->cap * 2 : 1024;
+        span *n = realloc(sp->items, cap * sizeof(*n));
+        if (n == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return false;
+        }
+        sp->items = n;
+        sp->cap = cap;
+    }
+    sp->items[sp->count].s = s;
+    sp->items[sp->count].len = len;
+    sp->count++;
+    sp->bytes += len;
+    return true;
+}
+
+static size_t run_escape(size_t *items) {
+    for (size_t i = 0; i < strings.count; i++) {
+        out.len = 0;
+        output_escaped(&out, strings.items[i].s, strings.items[i].len);
+        sink += out.len;
+    }
+    *items = strings.count;
+    return strings.bytes;
+}
+
+static size_t run_ld_out(size_t *items) {
+    for (size_t i = 0; i < strings.count; i++) {
+        out.len = 0;
+        output_key(&out, wrap_indent, key_string, "key");
+        output_wrapped(&out, strings.items[i].s, strings.items[i].len, wrap_width, wrap_indent);
+        output_char(&out, '\n');
+        sink += out.len;
+    }
+    for (size_t i = 0; i < numbers.count; i++) {
+        out.len = 0;
+        output_key(&out, wrap_indent, key_number, "key");
+        output_spaces(&out, wrap_indent);
+        if (parsed[i].real) {
+            output_double(&out, parsed[i].d);
+        } else {
+            output_int(&out, parsed[i].i);
+        }
+        output_char(&out, '\n');
+        sink += out.len;
+    }
+    *items = strings.count + numbers.count;
+    return strings.bytes + numbers.bytes;
+}
+
+static size_t run_lines(size_t *items) {
+    lines_scan(&line_ix, text, text_len);
+    sink += line_ix.count;
+    *items = line_ix.count;
+    return text_len;
+}
+
+static size_t run_numbers(size_t *items) {
+    number n;
+    for (size_t i = 0; i < numbers.count; i++) {
+        number_parse(numbers.items[i].s, numbers.items[i].len, &n);
+        sink += n.i;
+    }
+    *items = numbers.count;
+    return numbers.bytes;
+}
+
+static size_t run_parse(size_t *items) {
+    size_t records = 0;
+    ld_parser_open_buffer(parser, text, text_len, 1);
+    ld_status st;
+    while ((st = ld_parser_next(parser)) != ld_eof && st != ld_error) {
+        records++;
+    }
+    sink += records;
+    *items = records;
+    return text_len;
+}
+
+static size_t run_wrap(size_t *items) {
+    for (size_t i = 0; i < strings.count; i++) {
+        out.len = 0;
+        output_wrapped(&out, strings.items[i].s, strings.items[i].len, wrap_width, wrap_indent);
+        sink += out.len;
+    }
+    *items = strings.count;
+    return strings.bytes;
+}
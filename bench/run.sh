@@ -0,0 +1,121 @@
+#!/bin/sh
+#
+# run.sh
+#
+# Runs the benchmarks for ld2json and json2ld. Started by make bench,
+# bench-micro, bench-baseline and bench-gate from the top of the tree.
+#
+# Usage: run.sh [matrix | micro | baseline | gate]
+#   matrix
+#       Times every tool and mode over every corpus. The default.
+#   micro
+#       Times the parser's hot functions over every corpus with bench/micro.
+#   baseline
+#       Saves the MB/s of each gate case to bench/baseline.
+#   gate
+#       Times the gate cases again and compares them with bench/baseline.
+#       Exits with status 1 if any case is more than BENCH_TOLERANCE
+#       percent slower.
+#
+# Variables:
+#   BENCH_SCALE
+#       Multiplies the number of records in each corpus. Defaults to 1.
+#   BENCH_ITERATIONS
+#       Runs of each case; the fastest is reported. Defaults to 3.
+#   BENCH_JOBS
+#       Thread count for the -j cases. Defaults to 4.
+#   BENCH_TOLERANCE
+#       Slowdown, in percent, that the gate lets through. Defaults to 10.
+#
+
+set -e
+
+bench=bench
+corpus=$bench/corpus
+baseline=$bench/baseline
+mode=${1:-matrix}
+scale=${BENCH_SCALE:-1}
+iterations=${BENCH_ITERATIONS:-3}
+jobs=${BENCH_JOBS:-4}
+tolerance=${BENCH_TOLERANCE:-10}
+
+# Prints the MB/s of one gate case, named kind:tool:option.
+gate_case() {
+    kind=$1
+    tool=$2
+    option=$3
+    file=$corpus/$kind-$records.ld
+    [ $tool = json2ld ] && file=$corpus/$kind-$records.jsonl
+    $bench/bench -i $iterations -n $records -- $file ./$tool $option | awk '{ print $(NF - 5) }'
+}
+
+case $mode in
+    matrix|micro|baseline|gate)
+        ;;
+    *)
+        echo "Unknown mode \"$mode\"" >&2
+        exit 1
+        ;;
+esac
+if [ $mode = gate ] && [ ! -f $baseline ]; then
+    echo "No $baseline to compare with; make bench-baseline first" >&2
+    exit 1
+fi
+[ $mode = baseline ] && : > $baseline
+failed=0
+mkdir -p $corpus
+for spec in small:200000 deep:4000 strings:2000 numeric:50000 wide:5000; do
+    kind=${spec%%:*}
+    records=$((${spec#*:} * scale))
+    base=$corpus/$kind-$records
+    [ -f $base.ld ] || $bench/ldgen -k $kind -n $records > $base.ld
+    [ -f $base.jsonl ] || $bench/ldgen -k $kind -n $records -f json > $base.jsonl
+    case $mode in
+        matrix)
+            echo "== $kind: $records records"
+            for option in "" "-d" "-p" "-n" "-j $jobs"; do
+                $bench/bench -i $iterations -n $records -l "ld2json $option" -- $base.ld ./ld2json $option
+            done
+            for option in "" "-d" "-j $jobs"; do
+                $bench/bench -i $iterations -n $records -l "json2ld $option" -- $base.jsonl ./json2ld $option
+            done
+            ;;
+        micro)
+            echo "== $kind: $records records"
+            $bench/micro $base.ld
+            ;;
+        baseline|gate)
+            # The single-threaded cases, which vary least from run to run.
+            for test in ld2json: ld2json:-n ld2json:-d json2ld:; do
+                tool=${test%%:*}
+                option=${test#*:}
+                name=$kind-$records:$test
+                speed=$(gate_case $kind $tool "$option")
+                if [ $mode = baseline ]; then
+                    echo "$name $speed" >> $baseline
+                    printf '%-32s %9s MB/s\n' $name $speed
+                    continue
+                fi
+                was=$(awk -v name=$name '$1 == name { print $2 }' $baseline)
+                if [ -z "$was" ]; then
+                    printf '%-32s %9s MB/s  not in %s\n' $name $speed $baseline
+                    continue
+                fi
+                verdict=$(awk -v now=$speed -v was=$was -v tolerance=$tolerance 'BEGIN {
+                    change = (now - was) * 100 / was
+                    printf "%+7.1f%% %s", change, change < -tolerance ? "SLOWER" : "ok"
+                }')
+                printf '%-32s %9s MB/s %9s before %s\n' $name $speed $was "$verdict"
+                case $verdict in
+                    *SLOWER)
+                        failed=1
+                        ;;
+                esac
+            done
+            ;;
+    esac
+done
+if [ $failed -ne 0 ]; then
+    echo "Throughput fell by more than $tolerance% in at least one case" >&2
+    exit 1
+fi
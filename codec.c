@@ -0,0 +1,684 @@
+/**
+ * @file codec.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief zstd and gzip streams that compress or decompress on a thread of
+ * their own, and plain streams read ahead or written behind the caller.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#include <zstd.h>
+
+#include "codec.h"
+#include "uring.h"
+
+#define codec_block_len (1024 * 1024)
+#define codec_slots 4
+
+typedef struct codec_block {
+    char *data;
+    size_t len;
+    size_t done;            // ring writer: bytes of the block written so far
+    int64_t offset;         // ring: file offset of the block, or -1
+    bool busy;              // ring: a request for the block is in flight
+} codec_block;
+
+/**
+ * @brief The producer fills blocks and hands them over; the consumer takes
+ * them in order and gives them back empty. For a reader the thread is the
+ * producer, for a writer the caller is.
+ */
+struct codec {
+    codec_kind kind;
+    bool writer;
+    int fd;
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    codec_block blocks[codec_slots];
+    size_t filled;          // blocks handed over by the producer
+    size_t taken;           // blocks given back by the consumer
+    size_t pos;             // reader: position in the block being read
+    codec_block *fill;      // writer: block being filled by the caller
+    bool finished;          // the producer has handed over its last block
+    bool stopped;           // the consumer wants no more blocks
+    bool error;
+    char *head;
+    size_t head_len;
+    ZSTD_DCtx *zd;
+    ZSTD_CCtx *zc;
+    z_stream zs;
+    bool zs_ready;
+    uring *ring;            // copying through io_uring rather than a thread
+    bool seekable;          // ring: requests carry file offsets and may overlap
+    int64_t offset;         // ring: file offset of the next block
+    size_t inflight;
+};
+
+static codec *codec_new(int fd, codec_kind kind, bool writer);
+static bool compress_block(codec *c, const char *s, size_t len, bool end, char *dst);
+static void *copy_in(void *arg);
+static void *decode(void *arg);
+static bool decode_step(codec *c, const char **s, size_t *len, codec_block *b, bool *more, bool *ended);
+static void *encode(void *arg);
+static void fail(codec *c);
+static bool failed(codec *c);
+static void finish(codec *c);
+static void hand_over(codec *c);
+static codec_block *next_free(codec *c);
+static codec_block *next_full(codec *c);
+static void release(codec *c);
+static bool ring_complete(codec *c);
+static void ring_fill(codec *c);
+static void ring_hand_over(codec *c);
+static codec_block *ring_next_free(codec *c);
+static bool ring_open(codec *c);
+static bool ring_submit(codec *c, codec_block *b);
+static bool write_fd(int fd, const char *s, size_t len);
+
+codec_kind codec_detect(const char *s, size_t len) {
+    const unsigned char *u = (const unsigned char *)s;
+    if (len >= 4 && u[0] == 0x28 && u[1] == 0xb5 && u[2] == 0x2f && u[3] == 0xfd) {
+        return codec_zstd;
+    }
+    if (len >= 2 && u[0] == 0x1f && u[1] == 0x8b) {
+        return codec_gzip;
+    }
+    return codec_none;
+}
+
+codec *codec_reader_new(int fd, codec_kind kind, const char *head, size_t head_len) {
+    codec *c = codec_new(fd, kind, false);
+    if (c == NULL) {
+        return NULL;
+    }
+    if (head_len > 0) {
+        c->head = malloc(head_len);
+        if (c->head == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            codec_close(c);
+            return NULL;
+        }
+        memcpy(c->head, head, head_len);
+        c->head_len = head_len;
+    }
+    if (kind == codec_copy) {
+        if (ring_open(c)) {
+            ring_fill(c);
+            return c;
+        }
+        if (pthread_create(&c->thread, NULL, copy_in, c) != 0) {
+            fprintf(stderr, "Unable to start reading input\n");
+            codec_close(c);
+            return NULL;
+        }
+        c->running = true;
+        return c;
+    }
+    if (kind == codec_zstd) {
+        c->zd = ZSTD_createDCtx();
+    } else {
+        // 15 + 32 takes either a gzip or a zlib header.
+        c->zs_ready = inflateInit2(&c->zs, 15 + 32) == Z_OK;
+    }
+    if ((kind == codec_zstd ? c->zd == NULL : !c->zs_ready) || pthread_create(&c->thread, NULL, decode, c) != 0) {
+        fprintf(stderr, "Unable to start decompression\n");
+        codec_close(c);
+        return NULL;
+    }
+    c->running = true;
+    return c;
+}
+
+ssize_t codec_read(codec *c, char *buf, size_t len) {
+    codec_block *b;
+    if (c->ring != NULL) {
+        b = &c->blocks[c->taken % codec_slots];
+        while (b->busy && ring_complete(c));
+        if (c->error) {
+            return -1;
+        }
+        if (b->len == 0) {
+            return 0;
+        }
+    } else if ((b = next_full(c)) == NULL) {
+        return failed(c) ? -1 : 0;
+    }
+    size_t n = b->len - c->pos < len ? b->len - c->pos : len;
+    memcpy(buf, b->data + c->pos, n);
+    c->pos += n;
+    if (c->pos == b->len) {
+        c->pos = 0;
+        b->len = 0;
+        if (c->ring != NULL) {
+            c->taken++;
+            ring_fill(c);
+        } else {
+            release(c);
+        }
+    }
+    return n;
+}
+
+codec *codec_writer_new(int fd, codec_kind kind) {
+    codec *c = codec_new(fd, kind, true);
+    if (c == NULL) {
+        return NULL;
+    }
+    if (kind == codec_copy && ring_open(c)) {
+        return c;
+    }
+    if (kind == codec_copy) {
+        // Written straight out by encode().
+    } else if (kind == codec_zstd) {
+        c->zc = ZSTD_createCCtx();
+    } else {
+        // 15 + 16 writes a gzip header rather than a zlib one.
+        c->zs_ready = deflateInit2(&c->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    bool ready = kind == codec_copy || (kind == codec_zstd ? c->zc != NULL : c->zs_ready);
+    if (!ready || pthread_create(&c->thread, NULL, encode, c) != 0) {
+        fprintf(stderr, "Unable to start compression\n");
+        codec_close(c);
+        return NULL;
+    }
+    c->running = true;
+    return c;
+}
+
+bool codec_write(codec *c, const char *s, size_t len) {
+    while (len > 0) {
+        if (c->fill == NULL && (c->fill = c->ring != NULL ? ring_next_free(c) : next_free(c)) == NULL) {
+            return false;
+        }
+        size_t n = codec_block_len - c->fill->len < len ? codec_block_len - c->fill->len : len;
+        memcpy(c->fill->data + c->fill->len, s, n);
+        c->fill->len += n;
+        s += n;
+        len -= n;
+        if (c->fill->len == codec_block_len) {
+            if (c->ring != NULL) {
+                ring_hand_over(c);
+            } else {
+                hand_over(c);
+            }
+            c->fill = NULL;
+        }
+    }
+    return c->ring != NULL ? !c->error : !failed(c);
+}
+
+bool codec_close(codec *c) {
+    if (c == NULL) {
+        return true;
+    }
+    if (c->ring != NULL) {
+        if (c->writer && c->fill != NULL && c->fill->len > 0) {
+            ring_hand_over(c);
+        }
+        // Buffers cannot go while the kernel may still be using them.
+        while (c->inflight > 0 && ring_complete(c));
+        if (c->writer && c->seekable && lseek(c->fd, c->offset, SEEK_SET) < 0) {
+            c->error = true;
+        }
+        uring_free(c->ring);
+    } else if (c->running && c->writer) {
+        if (c->fill != NULL && c->fill->len > 0) {
+            hand_over(c);
+        }
+        finish(c);
+        pthread_join(c->thread, NULL);
+    } else if (c->running) {
+        pthread_mutex_lock(&c->lock);
+        c->stopped = true;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->thread, NULL);
+    }
+    bool ok = !c->error;
+    for (int i = 0; i < codec_slots; i++) {
+        free(c->blocks[i].data);
+    }
+    free(c->head);
+    ZSTD_freeDCtx(c->zd);
+    ZSTD_freeCCtx(c->zc);
+    if (c->zs_ready && c->writer) {
+        deflateEnd(&c->zs);
+    } else if (c->zs_ready) {
+        inflateEnd(&c->zs);
+    }
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    free(c);
+    return ok;
+}
+
+static codec *codec_new(int fd, codec_kind kind, bool writer) {
+    codec *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return NULL;
+    }
+    c->kind = kind;
+    c->writer = writer;
+    c->fd = fd;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    for (int i = 0; i < codec_slots; i++) {
+        c->blocks[i].data = malloc(codec_block_len);
+        if (c->blocks[i].data == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            codec_close(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+/**
+ * @brief Compress a block and write whatever the compressor gives back.
+ * With end set, the stream is finished instead.
+ */
+static bool compress_block(codec *c, const char *s, size_t len, bool end, char *dst) {
+    if (c->kind == codec_copy) {
+        return end || write_fd(c->fd, s, len);
+    }
+    if (c->kind == codec_zstd) {
+        ZSTD_inBuffer in = { s, len, 0 };
+        size_t r;
+        do {
+            ZSTD_outBuffer out = { dst, codec_block_len, 0 };
+            r = ZSTD_compressStream2(c->zc, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(r)) {
+                fprintf(stderr, "Error compressing output: %s\n", ZSTD_getErrorName(r));
+                return false;
+            }
+            if (!write_fd(c->fd, dst, out.pos)) {
+                return false;
+            }
+        } while (end ? r != 0 : in.pos < in.size);
+        return true;
+    }
+    int r;
+    c->zs.next_in = (unsigned char *)s;
+    c->zs.avail_in = len;
+    do {
+        c->zs.next_out = (unsigned char *)dst;
+        c->zs.avail_out = codec_block_len;
+        r = deflate(&c->zs, end ? Z_FINISH : Z_NO_FLUSH);
+        if (r == Z_STREAM_ERROR) {
+            fprintf(stderr, "Error compressing output\n");
+            return false;
+        }
+        if (!write_fd(c->fd, dst, codec_block_len - c->zs.avail_out)) {
+            return false;
+        }
+    } while (end ? r != Z_STREAM_END : c->zs.avail_in > 0 || c->zs.avail_out == 0);
+    return true;
+}
+
+/**
+ * @brief Read a plain stream ahead of the caller.
+ */
+static void *copy_in(void *arg) {
+    codec *c = arg;
+    codec_block *b;
+    bool ok = true;
+    while ((b = next_free(c)) != NULL) {
+        ssize_t r;
+        do {
+            r = read(c->fd, b->data, codec_block_len);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0) {
+            fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+            ok = false;
+            break;
+        }
+        if (r == 0) {
+            break;
+        }
+        b->len = r;
+        hand_over(c);
+    }
+    if (!ok) {
+        fail(c);
+    }
+    finish(c);
+    return arg;
+}
+
+static void *decode(void *arg) {
+    codec *c = arg;
+    char *src = malloc(codec_block_len);
+    const char *s = c->head;
+    size_t len = c->head_len;
+    codec_block *b = NULL;
+    bool more = false;
+    bool ended = false;
+    bool ok = src != NULL;
+    if (!ok) {
+        fprintf(stderr, "Memory allocation error\n");
+    }
+    while (ok) {
+        if (len == 0 && !more) {
+            ssize_t r;
+            do {
+                r = read(c->fd, src, codec_block_len);
+            } while (r < 0 && errno == EINTR);
+            if (r < 0) {
+                fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+                ok = false;
+                break;
+            }
+            if (r == 0) {
+                if (!ended) {
+                    fprintf(stderr, "Error decompressing input: unexpected end of input\n");
+                    ok = false;
+                }
+                break;
+            }
+            s = src;
+            len = r;
+        }
+        if (b == NULL && (b = next_free(c)) == NULL) {
+            break;
+        }
+        ok = decode_step(c, &s, &len, b, &more, &ended);
+        if (b->len == codec_block_len) {
+            hand_over(c);
+            b = NULL;
+        }
+    }
+    if (b != NULL && b->len > 0) {
+        hand_over(c);
+    }
+    if (!ok) {
+        fail(c);
+    }
+    finish(c);
+    free(src);
+    return arg;
+}
+
+/**
+ * @brief Decompress as much of the input as fits into the free space of a
+ * block.
+ * @param more Set if the decompressor may have output left without more
+ * input.
+ * @param ended Set if the input so far ends at the end of a frame.
+ */
+static bool decode_step(codec *c, const char **s, size_t *len, codec_block *b, bool *more, bool *ended) {
+    size_t room = codec_block_len - b->len;
+    if (c->kind == codec_zstd) {
+        ZSTD_inBuffer in = { *s, *len, 0 };
+        ZSTD_outBuffer out = { b->data + b->len, room, 0 };
+        size_t r = ZSTD_decompressStream(c->zd, &out, &in);
+        if (ZSTD_isError(r)) {
+            fprintf(stderr, "Error decompressing input: %s\n", ZSTD_getErrorName(r));
+            return false;
+        }
+        *s += in.pos;
+        *len -= in.pos;
+        b->len += out.pos;
+        *ended = r == 0;
+        *more = r != 0 && out.pos == room;
+        return true;
+    }
+    c->zs.next_in = (unsigned char *)*s;
+    c->zs.avail_in = *len;
+    c->zs.next_out = (unsigned char *)b->data + b->len;
+    c->zs.avail_out = room;
+    int r = inflate(&c->zs, Z_NO_FLUSH);
+    if (r == Z_BUF_ERROR && *len == 0) {
+        // Nothing was left to flush after a full block.
+        r = Z_OK;
+    }
+    if (r != Z_OK && r != Z_STREAM_END) {
+        fprintf(stderr, "Error decompressing input: %s\n", c->zs.msg != NULL ? c->zs.msg : "invalid data");
+        return false;
+    }
+    *s += *len - c->zs.avail_in;
+    *len = c->zs.avail_in;
+    b->len += room - c->zs.avail_out;
+    *ended = r == Z_STREAM_END;
+    *more = r != Z_STREAM_END && c->zs.avail_out == 0;
+    // gzip files may hold several members one after the other.
+    if (r == Z_STREAM_END) {
+        inflateReset(&c->zs);
+    }
+    return true;
+}
+
+static void *encode(void *arg) {
+    codec *c = arg;
+    char *dst = malloc(codec_block_len);
+    codec_block *b;
+    bool ok = dst != NULL;
+    if (!ok) {
+        fprintf(stderr, "Memory allocation error\n");
+    }
+    while (ok && (b = next_full(c)) != NULL) {
+        ok = compress_block(c, b->data, b->len, false, dst);
+        b->len = 0;
+        release(c);
+    }
+    if (ok) {
+        ok = compress_block(c, NULL, 0, true, dst);
+    }
+    if (!ok) {
+        fail(c);
+    }
+    free(dst);
+    return arg;
+}
+
+static void fail(codec *c) {
+    pthread_mutex_lock(&c->lock);
+    c->error = true;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static bool failed(codec *c) {
+    pthread_mutex_lock(&c->lock);
+    bool error = c->error;
+    pthread_mutex_unlock(&c->lock);
+    return error;
+}
+
+static void finish(codec *c) {
+    pthread_mutex_lock(&c->lock);
+    c->finished = true;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void hand_over(codec *c) {
+    pthread_mutex_lock(&c->lock);
+    c->filled++;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief Wait for an empty block to fill.
+ * @return The block, or NULL if the consumer has stopped or failed.
+ */
+static codec_block *next_free(codec *c) {
+    pthread_mutex_lock(&c->lock);
+    while (c->filled - c->taken == codec_slots && !c->stopped && !c->error) {
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    codec_block *b = c->stopped || c->error ? NULL : &c->blocks[c->filled % codec_slots];
+    pthread_mutex_unlock(&c->lock);
+    return b;
+}
+
+/**
+ * @brief Wait for the next full block.
+ * @return The block, or NULL once the producer has finished and every
+ * block has been taken, or the producer has failed.
+ */
+static codec_block *next_full(codec *c) {
+    pthread_mutex_lock(&c->lock);
+    while (c->filled == c->taken && !c->finished && !c->error) {
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    codec_block *b = c->filled == c->taken ? NULL : &c->blocks[c->taken % codec_slots];
+    pthread_mutex_unlock(&c->lock);
+    return b;
+}
+
+static void release(codec *c) {
+    pthread_mutex_lock(&c->lock);
+    c->taken++;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief Wait for one ring request and account for it. A short transfer on
+ * a file with offsets is continued in place, so a block only stops being
+ * busy once it is full, written, or at the end of the input.
+ * @return false if waiting failed. c->error is set then or on an I/O error.
+ */
+static bool ring_complete(codec *c) {
+    uint64_t tag;
+    int res;
+    if (!uring_wait(c->ring, &tag, &res)) {
+        fprintf(stderr, "Error waiting for %s: %s\n", c->writer ? "output" : "input", strerror(errno));
+        c->error = true;
+        return false;
+    }
+    codec_block *b = &c->blocks[tag];
+    c->inflight--;
+    if (res == -EINTR || res == -EAGAIN) {
+        c->error = !ring_submit(c, b);
+        return !c->error;
+    }
+    if (res < 0 || (c->writer && res == 0)) {
+        fprintf(stderr, "Error %s: %s\n", c->writer ? "writing output" : "reading input", strerror(res < 0 ? -res : EIO));
+        b->busy = false;
+        c->error = true;
+        return true;
+    }
+    if (c->writer) {
+        b->done += res;
+        if (b->done < b->len) {
+            c->error = !ring_submit(c, b);
+            return !c->error;
+        }
+        b->len = b->done = 0;
+    } else {
+        b->len += res;
+        if (res > 0 && c->seekable && b->len < codec_block_len) {
+            c->error = !ring_submit(c, b);
+            return !c->error;
+        }
+    }
+    b->busy = false;
+    return true;
+}
+
+/**
+ * @brief Keep reads in flight for the empty blocks. With file offsets every
+ * block can be read at once; a pipe is read one block at a time.
+ */
+static void ring_fill(codec *c) {
+    size_t depth = c->seekable ? codec_slots : 1;
+    while (!c->error && c->filled - c->taken < depth) {
+        codec_block *b = &c->blocks[c->filled % codec_slots];
+        b->len = 0;
+        b->offset = c->offset;
+        if (c->seekable) {
+            c->offset += codec_block_len;
+        }
+        if (!ring_submit(c, b)) {
+            c->error = true;
+            return;
+        }
+        c->filled++;
+    }
+}
+
+static void ring_hand_over(codec *c) {
+    codec_block *b = c->fill;
+    // Writes to a pipe or an appended file land in the order they are
+    // made, so only one can be in flight.
+    while (!c->seekable && c->inflight > 0 && ring_complete(c));
+    b->done = 0;
+    b->offset = c->offset;
+    if (c->seekable) {
+        c->offset += b->len;
+    }
+    if (!c->error && !ring_submit(c, b)) {
+        c->error = true;
+    }
+    c->filled++;
+}
+
+static codec_block *ring_next_free(codec *c) {
+    codec_block *b = &c->blocks[c->filled % codec_slots];
+    while (b->busy && ring_complete(c));
+    return c->error ? NULL : b;
+}
+
+/**
+ * @brief Set up io_uring for a plain stream. Requests carry file offsets
+ * when the file is a regular one that is not opened for appending.
+ * @return false if io_uring is not available, and a thread has to be used.
+ */
+static bool ring_open(codec *c) {
+    struct stat st;
+    off_t pos = lseek(c->fd, 0, SEEK_CUR);
+    int flags = fcntl(c->fd, F_GETFL);
+    c->seekable = fstat(c->fd, &st) == 0 && S_ISREG(st.st_mode) && pos >= 0 && flags >= 0 && !(flags & O_APPEND);
+    c->offset = c->seekable ? pos : -1;
+    c->ring = uring_new(codec_slots);
+    return c->ring != NULL;
+}
+
+static bool ring_submit(codec *c, codec_block *b) {
+    size_t tag = b - c->blocks;
+    bool ok;
+    if (c->writer) {
+        ok = uring_write(c->ring, c->fd, b->data + b->done, b->len - b->done, b->offset < 0 ? -1 : b->offset + (int64_t)b->done, tag);
+    } else {
+        ok = uring_read(c->ring, c->fd, b->data + b->len, codec_block_len - b->len, b->offset < 0 ? -1 : b->offset + (int64_t)b->len, tag);
+    }
+    if (!ok) {
+        fprintf(stderr, "Unable to queue %s: %s\n", c->writer ? "output" : "input", strerror(errno));
+        return false;
+    }
+    b->busy = true;
+    c->inflight++;
+    return true;
+}
+
+static bool write_fd(int fd, const char *s, size_t len) {
+    while (len > 0) {
+        ssize_t r = write(fd, s, len);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            return false;
+        }
+        s += r;
+        len -= r;
+    }
+    return true;
+}
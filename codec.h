@@ -0,0 +1,87 @@
+/**
+ * @file codec.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief zstd and gzip streams that compress or decompress on a thread of
+ * their own, and plain streams read ahead or written behind the caller.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _CODEC_H
+#define _CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef enum codec_kind {
+    codec_none,
+    codec_gzip,
+    codec_zstd,
+    codec_copy              // no compression; data is only moved ahead or behind
+} codec_kind;
+
+/**
+ * @brief A compressed stream and the thread that serves it. Data passes
+ * between the caller and the thread in a small ring of blocks, so
+ * compression overlaps with whatever the caller does with the data.
+ * A codec_copy stream queues its blocks with io_uring where the kernel
+ * offers it, and uses a thread otherwise.
+ */
+typedef struct codec codec;
+
+/**
+ * @brief Recognize a compressed stream by its first bytes.
+ * @param s Start of the stream.
+ * @param len Number of bytes available.
+ * @return The kind of stream, or codec_none.
+ */
+extern codec_kind codec_detect(const char *s, size_t len);
+
+/**
+ * @brief Start decompressing a file descriptor.
+ * @param fd Compressed input. It is not closed by the codec.
+ * @param kind Format of the input.
+ * @param head Bytes already read from fd, which are decompressed first.
+ * They are copied. They are not used for codec_copy.
+ * @param head_len Number of bytes in head.
+ * @return The codec, or NULL on error.
+ */
+extern codec *codec_reader_new(int fd, codec_kind kind, const char *head, size_t head_len);
+
+/**
+ * @brief Read decompressed data.
+ * @param c Codec from codec_reader_new().
+ * @param buf Buffer to fill.
+ * @param len Size of the buffer.
+ * @return Bytes read, 0 at the end of the stream, or -1 on error.
+ */
+extern ssize_t codec_read(codec *c, char *buf, size_t len);
+
+/**
+ * @brief Start compressing to a file descriptor.
+ * @param fd Output. It is not closed by the codec.
+ * @param kind Format to write.
+ * @return The codec, or NULL on error.
+ */
+extern codec *codec_writer_new(int fd, codec_kind kind);
+
+/**
+ * @brief Queue data for compression. The data is copied.
+ * @param c Codec from codec_writer_new().
+ * @param s Data to compress.
+ * @param len Length of the data.
+ * @return true on success, false if compressing or writing has failed.
+ */
+extern bool codec_write(codec *c, const char *s, size_t len);
+
+/**
+ * @brief Stop a codec and release it. A writer compresses what is still
+ * queued and ends the stream first.
+ * @param c Codec to close, or NULL.
+ * @return true if every byte was compressed and written, false if not.
+ */
+extern bool codec_close(codec *c);
+
+#endif // _CODEC_H
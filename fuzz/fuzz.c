@@ -0,0 +1,304 @@
+/**
+ * @file fuzz.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Fuzz target for the LD parser and the output writer.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ *
+ * LLVMFuzzerTestOneInput() is the entry point libFuzzer calls (make fuzz,
+ * which needs clang). The first byte of each input picks parser options,
+ * and the rest is parsed as LD or binary records from a buffer of exactly
+ * its size, so the sanitizers catch any read past the end. Every span the
+ * parser hands out is read in full, escaped and wrapped.
+ *
+ * Built with -D FUZZ_MAIN (make fuzz-replay, any compiler), a main() runs
+ * each file named on the command line through the target once, which
+ * replays a corpus or a crash and also serves as an AFL harness
+ * (afl-fuzz ... -- fuzz/replay @@). -n runs makes it mutate the files
+ * instead, for a quick search where neither tool is installed.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ld.h"
+#include "../number.h"
+#include "../output.h"
+
+// gcc and clang say in different ways that AddressSanitizer is on.
+#if defined(__SANITIZE_ADDRESS__)
+#define fuzz_asan 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define fuzz_asan 1
+#endif
+#endif
+
+#if defined(FUZZ_MAIN) && defined(fuzz_asan)
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#define wrap_width 80
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static bool fuzz_begin(void *user, const char *name, size_t name_len, char type);
+static bool fuzz_end(void *user, char type);
+static bool fuzz_value(void *user, const ld_value *v);
+static void touch(output *o, const char *s, size_t len);
+
+static const ld_callbacks fuzz_callbacks = { fuzz_begin, fuzz_end, fuzz_value };
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    unsigned char options = data[0];
+    size--;
+    // A copy of exactly the input's size, with no terminator after it.
+    char *buf = malloc(size ? size : 1);
+    if (buf == NULL) {
+        return 0;
+    }
+    memcpy(buf, data + 1, size);
+    output o;
+    output_open(&o, -1, 0);
+    ld_parser *p = ld_parser_new(&fuzz_callbacks, &o);
+    if (p != NULL) {
+        if (options & 1) {
+            ld_parser_fields(p, "a,b.c,d");
+        }
+        if (options & 2) {
+            ld_parser_where(p, "a", "1");
+        }
+        if (options & 4) {
+            ld_parser_learn(p, 1 + (options >> 6));
+        }
+        ld_parser_trust(p, options & 8);
+        ld_parser_open_buffer(p, buf, size, 1);
+        ld_status st;
+        while ((st = ld_parser_next(p)) != ld_eof && st != ld_error) {
+            o.len = 0;
+        }
+        ld_parser_free(p);
+    }
+    output_close(&o);
+    free(buf);
+    return 0;
+}
+
+static bool fuzz_begin(void *user, const char *name, size_t name_len, char type) {
+    (void)type;
+    touch(user, name, name_len);
+    return true;
+}
+
+static bool fuzz_end(void *user, char type) {
+    (void)user;
+    (void)type;
+    return true;
+}
+
+static bool fuzz_value(void *user, const ld_value *v) {
+    output *o = user;
+    char num[number_max_len];
+    touch(o, v->name, v->name_len);
+    touch(o, v->data, v->len);
+    if (v->type == key_number) {
+        touch(o, v->num.s, v->num.len);
+        size_t len = v->num.real ? number_format_double(num, v->num.d) : number_format_int(num, v->num.i);
+        output_append(o, num, len);
+    }
+    return true;
+}
+
+/**
+ * @brief Read a span the parser handed out through the vector code paths
+ * that would go past its end if the span were wrong.
+ */
+static void touch(output *o, const char *s, size_t len) {
+    if (s == NULL) {
+        return;
+    }
+    output_escaped(o, s, len);
+    output_wrapped(o, s, len, wrap_width, 4);
+}
+
+#ifdef FUZZ_MAIN
+
+static const char *dictionary[] = {
+    "~~:{", "~~:}", "~~:[", "~~:]", "~~:$", "~~:#", "~~:?", "~~:!", "~~~:*", "\n", "    ",
+    "true", "false", "null", "-0.5e-7", "18446744073709551616", "\377LDB\001", "R", "\\u00e9", "\"",
+};
+
+static uint8_t *current = NULL;
+static size_t current_len = 0;
+static const char *crash_path = "crash-input";
+
+static uint8_t *mutate(const uint8_t *seed, size_t seed_len, size_t *len);
+static unsigned int next(unsigned int n);
+static uint8_t *read_file(const char *path, size_t *len);
+static void save_crash(void);
+
+int main(int ac, char **av) {
+    long runs = 0;
+    int first = 1;
+    for (; first < ac && av[first][0] == '-'; first++) {
+        if (strcmp(av[first], "-n") == 0 && first + 1 < ac) {
+            runs = atol(av[++first]);
+        } else {
+            first = ac;
+        }
+    }
+    if (first >= ac) {
+        fprintf(stderr, "Usage: %s [-n runs] file...\n", av[0]);
+        fprintf(stderr, "-n ..... Run this many mutations of the files instead of the files themselves\n");
+        return 1;
+    }
+#ifdef fuzz_asan
+    __sanitizer_set_death_callback(save_crash);
+#endif
+    size_t count = ac - first;
+    uint8_t **seeds = calloc(count, sizeof(*seeds));
+    size_t *lens = calloc(count, sizeof(*lens));
+    if (seeds == NULL || lens == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if ((seeds[i] = read_file(av[first + i], &lens[i])) == NULL) {
+            return 1;
+        }
+        if (runs == 0) {
+            current = seeds[i];
+            current_len = lens[i];
+            LLVMFuzzerTestOneInput(current, current_len);
+        }
+    }
+    for (long n = 0; n < runs; n++) {
+        size_t i = next(count);
+        current = mutate(seeds[i], lens[i], &current_len);
+        if (current == NULL) {
+            break;
+        }
+        LLVMFuzzerTestOneInput(current, current_len);
+        free(current);
+        if ((n + 1) % 10000 == 0) {
+            fprintf(stderr, "%ld runs\n", n + 1);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(seeds[i]);
+    }
+    free(seeds);
+    free(lens);
+    return 0;
+}
+
+/**
+ * @brief Copy a seed with a few random changes: bytes flipped, dictionary
+ * tokens put in, and runs of bytes dropped or repeated.
+ */
+static uint8_t *mutate(const uint8_t *seed, size_t seed_len, size_t *len) {
+    size_t cap = seed_len * 2 + 256;
+    uint8_t *s = malloc(cap);
+    if (s == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return NULL;
+    }
+    memcpy(s, seed, seed_len);
+    *len = seed_len;
+    for (unsigned int changes = 1 + next(8); changes > 0; changes--) {
+        size_t at = next(*len + 1);
+        size_t run = 1 + next(16);
+        switch (next(4)) {
+            case 0:
+                if (at < *len) {
+                    s[at] ^= 1 << next(8);
+                }
+                break;
+            case 1: {
+                const char *t = dictionary[next(sizeof(dictionary) / sizeof(*dictionary))];
+                size_t tl = strlen(t);
+                if (*len + tl <= cap) {
+                    memmove(s + at + tl, s + at, *len - at);
+                    memcpy(s + at, t, tl);
+                    *len += tl;
+                }
+                break;
+            }
+            case 2:
+                if (run > *len - at) {
+                    run = *len - at;
+                }
+                memmove(s + at, s + at + run, *len - at - run);
+                *len -= run;
+                break;
+            default:
+                if (run > *len - at) {
+                    run = *len - at;
+                }
+                if (*len + run <= cap) {
+                    memmove(s + at + run, s + at, *len - at);
+                    *len += run;
+                }
+                break;
+        }
+    }
+    return s;
+}
+
+static unsigned int next(unsigned int n) {
+    static uint64_t state = 0x9e3779b97f4a7c15;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return n ? (unsigned int)(state % n) : 0;
+}
+
+static uint8_t *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open file \"%s\"\n", path);
+        return NULL;
+    }
+    size_t cap = 65536;
+    uint8_t *s = malloc(cap);
+    *len = 0;
+    while (s != NULL) {
+        *len += fread(s + *len, 1, cap - *len, f);
+        if (*len < cap) {
+            break;
+        }
+        cap *= 2;
+        uint8_t *t = realloc(s, cap);
+        if (t == NULL) {
+            free(s);
+        }
+        s = t;
+    }
+    fclose(f);
+    if (s == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+    }
+    return s;
+}
+
+/**
+ * @brief Keep the input that made a sanitizer stop the run.
+ */
+static void save_crash(void) {
+    FILE *f = fopen(crash_path, "wb");
+    if (f != NULL) {
+        fwrite(current, 1, current_len, f);
+        fclose(f);
+        fprintf(stderr, "Input written to %s\n", crash_path);
+    }
+}
+
+#endif
@@ -0,0 +1,419 @@
+/**
+ * @file input.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Line reader shared by ld2json and json2ld.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#include "codec.h"
+#include "input.h"
+#include "stats.h"
+
+#define read_block_len 65536
+#define map_block_len (1024 * 1024)
+#define follow_poll_ns (100 * 1000000)
+
+static volatile sig_atomic_t stop_following = 0;
+
+static bool fill_buffer(input *in);
+static ssize_t read_follow(input *in);
+static bool wait_for_growth(input *in);
+
+bool input_open(input *in, const char *path) {
+    struct stat st;
+    memset(in, 0, sizeof(*in));
+    in->fd = STDIN_FILENO;
+    if (path != NULL) {
+        in->fd = open(path, O_RDONLY);
+        if (in->fd < 0) {
+            return false;
+        }
+    }
+    if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            in->map = map;
+            in->map_len = st.st_size;
+        }
+    }
+    // Compressed input cannot be used in place. A mapping goes back to
+    // being read from the start; otherwise the first block read counts.
+    codec_kind kind;
+    const char *head = NULL;
+    size_t head_len = 0;
+    if (in->map != NULL) {
+        kind = codec_detect(in->map, in->map_len);
+        if (kind != codec_none) {
+            munmap((void *)in->map, in->map_len);
+            in->map = NULL;
+            in->map_len = 0;
+        }
+    } else {
+        fill_buffer(in);
+        kind = codec_detect(in->buf, in->buf_len);
+        head = in->buf;
+        head_len = in->buf_len;
+    }
+    if (kind != codec_none) {
+        in->codec = codec_reader_new(in->fd, kind, head, head_len);
+        in->buf_len = in->pos = 0;
+        in->eof = false;
+        if (in->codec == NULL) {
+            input_close(in);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool input_async(input *in) {
+    if (in->fd < 0 || in->codec != NULL || in->eof) {
+        return true;
+    }
+    if (in->map != NULL) {
+        munmap((void *)in->map, in->map_len);
+        in->map = NULL;
+        in->map_len = 0;
+    }
+    in->codec = codec_reader_new(in->fd, codec_copy, NULL, 0);
+    return in->codec != NULL;
+}
+
+bool input_follow(input *in, void (*wait)(void *user), void *user) {
+    struct stat st;
+    if (in->codec != NULL) {
+        fprintf(stderr, "Compressed input cannot be followed\n");
+        return false;
+    }
+    if (in->fd < 0 || fstat(in->fd, &st) != 0) {
+        fprintf(stderr, "Input cannot be followed\n");
+        return false;
+    }
+    if (in->map != NULL) {
+        munmap((void *)in->map, in->map_len);
+        in->map = NULL;
+        in->map_len = 0;
+    }
+    in->follow = true;
+    in->regular = S_ISREG(st.st_mode);
+    in->notify = -1;
+    in->wait = wait;
+    in->wait_user = user;
+    if (in->regular) {
+        // An empty file has been read to its end already.
+        in->eof = in->error;
+#if defined(__linux__)
+        char name[64];
+        snprintf(name, sizeof(name), "/proc/self/fd/%d", in->fd);
+        in->notify = inotify_init1(IN_CLOEXEC);
+        if (in->notify >= 0 && inotify_add_watch(in->notify, name, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+            close(in->notify);
+            in->notify = -1;
+        }
+#endif
+    }
+    return true;
+}
+
+void input_stop_following(void) {
+    stop_following = 1;
+}
+
+uint64_t input_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void input_open_buffer(input *in, const char *buf, size_t len) {
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+    in->map = buf;
+    in->map_len = len;
+}
+
+const char *input_get_block(input *in, size_t *len) {
+    if (in->map != NULL) {
+        if (in->pos >= in->map_len) {
+            return NULL;
+        }
+        const char *s = in->map + in->pos;
+        *len = in->map_len - in->pos;
+        if (*len > map_block_len) {
+            const char *e = memchr(s + map_block_len - 1, '\n', *len - map_block_len + 1);
+            if (e != NULL) {
+                *len = (size_t)(e - s) + 1;
+            }
+        }
+        in->pos += *len;
+        if (in->fd >= 0) {
+            // Whole blocks before this one have been passed; let their
+            // pages go as input_read() does. A span that still points
+            // there is read back from the file if it is looked at again.
+            size_t passed = (size_t)(s - in->map) / map_block_len * map_block_len;
+            if (passed > in->map_dropped) {
+                madvise((void *)(in->map + in->map_dropped), passed - in->map_dropped, MADV_DONTNEED);
+                in->map_dropped = passed;
+            }
+            stats_count(stats_bytes_in, *len);
+        }
+        return s;
+    }
+    size_t seen = 0;
+    while (1) {
+        const char *s = in->buf + in->pos;
+        const char *e = in->buf + in->buf_len;
+        while (e > s + seen && e[-1] != '\n') {
+            e--;
+        }
+        if (e > s + seen || (in->eof && in->buf_len > in->pos)) {
+            *len = e > s + seen ? (size_t)(e - s) : in->buf_len - in->pos;
+            in->pos += *len;
+            return s;
+        }
+        seen = in->buf_len - in->pos;
+        if (in->eof || !fill_buffer(in)) {
+            return NULL;
+        }
+    }
+}
+
+const char *input_get_bytes(input *in, size_t len) {
+    const char *s = input_peek(in, len);
+    if (s != NULL) {
+        in->pos += len;
+        if (in->map != NULL && in->fd >= 0) {
+            stats_count(stats_bytes_in, len);
+        }
+    }
+    return s;
+}
+
+const char *input_get_line(input *in, size_t *len) {
+    if (in->map != NULL) {
+        if (in->pos >= in->map_len) {
+            return NULL;
+        }
+        const char *s = in->map + in->pos;
+        const char *e = memchr(s, '\n', in->map_len - in->pos);
+        *len = e != NULL ? (size_t)(e - s) + 1 : in->map_len - in->pos;
+        in->pos += *len;
+        if (in->fd >= 0) {
+            stats_count(stats_bytes_in, *len);
+        }
+        return s;
+    }
+    while (1) {
+        const char *s = in->buf + in->pos;
+        const char *e = in->buf_len > in->pos ? memchr(s, '\n', in->buf_len - in->pos) : NULL;
+        if (e != NULL || (in->eof && in->buf_len > in->pos)) {
+            *len = e != NULL ? (size_t)(e - s) + 1 : in->buf_len - in->pos;
+            in->pos += *len;
+            return s;
+        }
+        if (in->eof || !fill_buffer(in)) {
+            return NULL;
+        }
+    }
+}
+
+const char *input_peek(input *in, size_t len) {
+    if (in->map != NULL) {
+        return in->map_len - in->pos >= len ? in->map + in->pos : NULL;
+    }
+    while (in->buf_len - in->pos < len) {
+        if (in->eof || !fill_buffer(in)) {
+            return NULL;
+        }
+    }
+    return in->buf + in->pos;
+}
+
+const char *input_read(input *in, size_t *len) {
+    if (in->map != NULL) {
+        if (in->pos >= in->map_len) {
+            return NULL;
+        }
+        if (in->fd >= 0 && in->pos >= map_block_len && in->pos % map_block_len == 0) {
+            // The previous block is no longer needed; let its pages go so
+            // that reading a huge file does not grow the resident set.
+            madvise((void *)(in->map + in->pos - map_block_len), map_block_len, MADV_DONTNEED);
+        }
+        *len = in->map_len - in->pos;
+        if (*len > map_block_len) {
+            *len = map_block_len;
+        }
+        in->pos += *len;
+        if (in->fd >= 0) {
+            stats_count(stats_bytes_in, *len);
+        }
+        return in->map + in->pos - *len;
+    }
+    while (in->pos == in->buf_len) {
+        if (in->eof || !fill_buffer(in)) {
+            return NULL;
+        }
+    }
+    *len = in->buf_len - in->pos;
+    in->pos = in->buf_len;
+    return in->buf + in->pos - *len;
+}
+
+bool input_seek(input *in, uint64_t offset) {
+    if (in->map != NULL) {
+        if (offset > in->map_len) {
+            return false;
+        }
+        in->pos = offset;
+        if (in->map_dropped > offset) {
+            in->map_dropped = offset / map_block_len * map_block_len;
+        }
+        return true;
+    }
+    if (in->codec != NULL || lseek(in->fd, offset, SEEK_SET) < 0) {
+        return false;
+    }
+    in->buf_len = in->pos = 0;
+    in->eof = false;
+    return true;
+}
+
+void input_close(input *in) {
+    if (in->map != NULL && in->fd >= 0) {
+        munmap((void *)in->map, in->map_len);
+    }
+    codec_close(in->codec);
+    if (in->follow && in->notify >= 0) {
+        close(in->notify);
+    }
+    free(in->buf);
+    if (in->fd > STDIN_FILENO) {
+        close(in->fd);
+    }
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+}
+
+static bool fill_buffer(input *in) {
+    if (in->pos > 0) {
+        memmove(in->buf, in->buf + in->pos, in->buf_len - in->pos);
+        in->buf_len -= in->pos;
+        in->pos = 0;
+    }
+    if (in->buf_cap - in->buf_len < read_block_len) {
+        size_t cap = in->buf_cap ? in->buf_cap * 2 : read_block_len * 2;
+        char *n = realloc(in->buf, cap);
+        if (n == NULL) {
+            fprintf(stderr, "Memory allocation error reading input\n");
+            return false;
+        }
+        in->buf = n;
+        in->buf_cap = cap;
+    }
+    ssize_t r;
+    stats_begin(t);
+    do {
+        if (in->codec != NULL) {
+            r = codec_read(in->codec, in->buf + in->buf_len, in->buf_cap - in->buf_len);
+        } else if (in->follow) {
+            r = read_follow(in);
+        } else {
+            r = read(in->fd, in->buf + in->buf_len, in->buf_cap - in->buf_len);
+        }
+    } while (r < 0 && in->codec == NULL && errno == EINTR);
+    stats_end(stats_read, t);
+    in->read_time = input_clock();
+    if (r < 0) {
+        // The codec has already said what went wrong.
+        if (in->codec == NULL) {
+            fprintf(stderr, "Error reading input: %s\n", strerror(errno));
+        }
+        in->eof = true;
+        in->error = true;
+        return false;
+    }
+    if (r == 0) {
+        in->eof = true;
+    }
+    in->buf_len += r;
+    stats_count(stats_bytes_in, r);
+    return !in->error;
+}
+
+/**
+ * @brief Read into the buffer of a followed input. The wait callback runs
+ * before a pipe would block, and before waiting at the end of a file.
+ * @return As read(), with 0 once following has stopped.
+ */
+static ssize_t read_follow(input *in) {
+    while (!stop_following) {
+        if (in->wait != NULL && !in->regular) {
+            struct pollfd pfd = { .fd = in->fd, .events = POLLIN };
+            if (poll(&pfd, 1, 0) == 0) {
+                in->wait(in->wait_user);
+            }
+        }
+        ssize_t r = read(in->fd, in->buf + in->buf_len, in->buf_cap - in->buf_len);
+        if (r != 0 || !in->regular) {
+            return r;
+        }
+        if (in->wait != NULL) {
+            in->wait(in->wait_user);
+        }
+        if (!wait_for_growth(in)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait at the end of a followed file for it to change.
+ * @return true to read again, false if the file is gone or was truncated.
+ */
+static bool wait_for_growth(input *in) {
+    struct stat st;
+    if (fstat(in->fd, &st) != 0 || st.st_nlink == 0) {
+        return false;
+    }
+    off_t pos = lseek(in->fd, 0, SEEK_CUR);
+    if (st.st_size < pos) {
+        fprintf(stderr, "Input was truncated while it was being followed\n");
+        in->error = true;
+        return false;
+    }
+    if (st.st_size > pos) {
+        return true;
+    }
+#if defined(__linux__)
+    if (in->notify >= 0) {
+        // Any event will do; what changed is looked at again above. A
+        // signal cuts the wait short so that stop_following is seen.
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t r = read(in->notify, events, sizeof(events));
+        return r > 0 || errno == EINTR;
+    }
+#endif
+    struct timespec ts = { 0, follow_poll_ns };
+    nanosleep(&ts, NULL);
+    return true;
+}
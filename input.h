@@ -0,0 +1,165 @@
+/**
+ * @file input.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Line reader shared by ld2json and json2ld.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _INPUT_H
+#define _INPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Input source. Regular files are memory-mapped and lines point
+ * straight into the mapping. Anything else (pipes, terminals) is read in
+ * blocks into a buffer that grows to hold the longest line. zstd and gzip
+ * input is recognized by its first bytes and read, decompressed, through
+ * the buffer.
+ */
+typedef struct input {
+    int fd;
+    struct codec *codec;
+    const char *map;
+    size_t map_len;
+    size_t map_dropped;     // bytes at the start of the mapping given back
+    char *buf;
+    size_t buf_len;
+    size_t buf_cap;
+    size_t pos;
+    bool eof;
+    bool error;             // a read failed; the input ends there
+    bool follow;            // wait for more data at the end of a regular file
+    bool regular;
+    int notify;             // inotify descriptor watching a followed file, or -1
+    void (*wait)(void *user);
+    void *wait_user;
+    uint64_t read_time;     // input_clock() when the last read returned
+} input;
+
+/**
+ * @brief Open an input source.
+ * @param in Input to initialize.
+ * @param path File to read, or NULL for stdin.
+ * @return true on success, false if the file could not be opened.
+ */
+extern bool input_open(input *in, const char *path);
+
+/**
+ * @brief Read the rest of an input ahead of the caller, in blocks that are
+ * queued with io_uring or read on a thread. A mapped file is read instead
+ * of mapped, since page faults on slow storage stall the caller just as
+ * reads do. Compressed input is read ahead already.
+ * @param in Input from input_open().
+ * @return true on success, false if reading ahead could not be started.
+ */
+extern bool input_async(input *in);
+
+/**
+ * @brief Keep reading an input as it is written. A regular file is read
+ * rather than mapped, and at its end the input waits for the file to grow,
+ * with inotify on Linux and by looking again every 100 ms elsewhere. It
+ * ends when the file is deleted or input_stop_following() is called, and
+ * fails if the file is truncated. Pipes end when their writer closes them,
+ * as usual. Before waiting, the input calls wait, so that the caller can
+ * write out what it has. Compressed input cannot be followed.
+ * @param in Input from input_open().
+ * @param wait Function to call before waiting for data, or NULL.
+ * @param user Pointer passed to wait.
+ * @return true on success, false if the input cannot be followed.
+ */
+extern bool input_follow(input *in, void (*wait)(void *user), void *user);
+
+/**
+ * @brief Make followed inputs end where they would next wait for data. It
+ * is safe to call from a signal handler; a handler installed without
+ * SA_RESTART also cuts short a wait that is already under way.
+ */
+extern void input_stop_following(void);
+
+/**
+ * @brief Get the time that read_time is measured on.
+ * @return CLOCK_MONOTONIC time in nanoseconds.
+ */
+extern uint64_t input_clock(void);
+
+/**
+ * @brief Read lines from a block of memory that is already loaded. The
+ * block is not copied and must stay valid until the input is closed.
+ * @param in Input to initialize.
+ * @param buf Start of the block.
+ * @param len Length of the block.
+ */
+extern void input_open_buffer(input *in, const char *buf, size_t len);
+
+/**
+ * @brief Get the next run of whole lines from the input. Mapped input is
+ * handed out in blocks of about a megabyte, buffered input as whatever
+ * complete lines have been read so far.
+ * @param in Input to read from.
+ * @param len Receives the length of the block. The block ends with a line
+ * feed unless it holds the last line of the input and that line has none.
+ * @return Pointer to the start of the block, or NULL at end of input. The
+ * block remains valid until the next call.
+ */
+extern const char *input_get_block(input *in, size_t *len);
+
+/**
+ * @brief Get the next line from the input.
+ * @param in Input to read from.
+ * @param len Receives the length of the line, including its line feed if
+ * it has one. The line is not NUL-terminated.
+ * @return Pointer to the start of the line, or NULL at end of input. The
+ * line remains valid until the next call.
+ */
+extern const char *input_get_line(input *in, size_t *len);
+
+/**
+ * @brief Get the next bytes of the input without reading past them.
+ * @param in Input to look at.
+ * @param len Number of bytes wanted.
+ * @return Pointer to the bytes, or NULL if the input ends sooner. The bytes
+ * remain valid until the next call.
+ */
+extern const char *input_peek(input *in, size_t len);
+
+/**
+ * @brief Get the next bytes of the input, for formats that give the length
+ * of what follows rather than ending it with a line feed.
+ * @param in Input to read from.
+ * @param len Number of bytes wanted.
+ * @return Pointer to the bytes, or NULL if the input ends sooner. The bytes
+ * remain valid until the next call.
+ */
+extern const char *input_get_bytes(input *in, size_t len);
+
+/**
+ * @brief Get the next piece of input with no regard for line breaks, for
+ * readers that must not hold a whole line in memory.
+ * @param in Input to read from.
+ * @param len Receives the length of the piece.
+ * @return Pointer to the piece, or NULL at end of input. The piece remains
+ * valid until the next call.
+ */
+extern const char *input_read(input *in, size_t *len);
+
+/**
+ * @brief Continue reading from a byte offset. Only regular files and other
+ * seekable inputs support this; compressed input does not.
+ * @param in Input to reposition.
+ * @param offset Offset from the start of the input.
+ * @return true on success, false if the input cannot seek there.
+ */
+extern bool input_seek(input *in, uint64_t offset);
+
+/**
+ * @brief Release the resources held by an input source.
+ * @param in Input to close.
+ */
+extern void input_close(input *in);
+
+#endif // _INPUT_H
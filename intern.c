@@ -0,0 +1,112 @@
+/**
+ * @file intern.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Table of member names that lives across records, so that each
+ * distinct name is copied, hashed and escaped only once.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "output.h"
+
+#define min_slots 64
+
+static uint64_t hash_name(const char *s, size_t len);
+static intern_key *new_key(const char *name, size_t len);
+static bool resize(intern_table *t);
+
+const intern_key *intern_get(intern_table *t, const char *name, size_t len) {
+    uint64_t h = hash_name(name, len);
+    if (t->cap > 0) {
+        for (size_t i = h & (t->cap - 1); t->slots[i].key != NULL; i = (i + 1) & (t->cap - 1)) {
+            intern_key *k = t->slots[i].key;
+            if (t->slots[i].hash == h && k->len == len && memcmp(k->name, name, len) == 0) {
+                return k;
+            }
+        }
+    }
+    if (t->count == intern_max_keys || (t->count * 2 >= t->cap && !resize(t))) {
+        return NULL;
+    }
+    intern_key *k = new_key(name, len);
+    if (k == NULL) {
+        return NULL;
+    }
+    size_t i = h & (t->cap - 1);
+    while (t->slots[i].key != NULL) {
+        i = (i + 1) & (t->cap - 1);
+    }
+    t->slots[i].hash = h;
+    t->slots[i].key = k;
+    k->id = t->count++;
+    return k;
+}
+
+void intern_free(intern_table *t) {
+    for (size_t i = 0; i < t->cap; i++) {
+        free(t->slots[i].key);
+    }
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+/**
+ * @brief FNV-1a. Names are short, so anything stronger costs more than
+ * the collisions it saves.
+ */
+static uint64_t hash_name(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief Make a key with the name and its JSON form in one allocation.
+ */
+static intern_key *new_key(const char *name, size_t len) {
+    output json;
+    output_open(&json, -1, 0);
+    bool ok = output_char(&json, '"') && output_escaped(&json, name, len) && output_append(&json, "\": ", 3);
+    intern_key *k = ok ? malloc(sizeof(*k) + len + 1 + json.len) : NULL;
+    if (k != NULL) {
+        char *p = (char *)(k + 1);
+        memcpy(p, name, len);
+        p[len] = '\0';
+        memcpy(p + len + 1, json.data, json.len);
+        k->name = p;
+        k->len = len;
+        k->json = p + len + 1;
+        k->json_len = json.len;
+    }
+    output_close(&json);
+    return k;
+}
+
+static bool resize(intern_table *t) {
+    size_t cap = t->cap ? t->cap * 2 : min_slots;
+    intern_slot *slots = calloc(cap, sizeof(*slots));
+    if (slots == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->slots[i].key != NULL) {
+            size_t j = t->slots[i].hash & (cap - 1);
+            while (slots[j].key != NULL) {
+                j = (j + 1) & (cap - 1);
+            }
+            slots[j] = t->slots[i];
+        }
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->cap = cap;
+    return true;
+}
@@ -0,0 +1,62 @@
+/**
+ * @file intern.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Table of member names that lives across records, so that each
+ * distinct name is copied, hashed and escaped only once.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _INTERN_H
+#define _INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define intern_max_keys 65536
+
+/**
+ * @brief An interned member name. It stays valid until the table is freed.
+ */
+typedef struct intern_key {
+    const char *name;       // NUL-terminated copy of the name
+    size_t len;
+    const char *json;       // the name as JSON output wants it: "name": 
+    size_t json_len;
+    size_t id;              // number of names added to the table before it
+} intern_key;
+
+typedef struct intern_slot {
+    uint64_t hash;
+    intern_key *key;
+} intern_slot;
+
+/**
+ * @brief Open-addressed hash table of names. A zeroed table is empty and
+ * ready to use.
+ */
+typedef struct intern_table {
+    intern_slot *slots;
+    size_t cap;
+    size_t count;
+} intern_table;
+
+/**
+ * @brief Look a name up, adding it if it is new.
+ * @param t Table.
+ * @param name Name text. It does not need to be NUL-terminated.
+ * @param len Length of the name.
+ * @return The interned name, or NULL if the table already holds
+ * intern_max_keys names (records whose keys are data rather than field
+ * names) or memory ran out. Callers then handle the name themselves.
+ */
+extern const intern_key *intern_get(intern_table *t, const char *name, size_t len);
+
+/**
+ * @brief Release a table and every name in it.
+ * @param t Table.
+ */
+extern void intern_free(intern_table *t);
+
+#endif // _INTERN_H
@@ -8,13 +8,25 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <json-c/json.h>
 #include <json-c/json_object.h>
 
+#include "input.h"
+#include "ld.h"
+#include "ldb.h"
+#include "output.h"
+#include "stats.h"
+
 #ifdef DEBUG
 static int indent_level = 0;
 static char *indent_string = "                                                                                ";
@@ -30,80 +42,530 @@ static char *indent_string = "
 #endif
 
 #define indent_step 4
-#define max_line_len 65536
-#define key_prefix "~~:"
-#define key_start_obj '{'
-#define key_end_obj '}'
-#define key_start_array '['
-#define key_end_array ']'
-#define key_string '$'
-#define key_number '#'
-#define key_boolean '?'
-#define key_null '!'
-#define key_comment '*'
-#define key_escape '\\'
-#define key_type_position (sizeof(key_prefix) - 1)
 #define wrap_len 80
+#define replacement_char 0xfffd
+#define chunk_len (1024 * 1024)
+
+/**
+ * @brief Output of one conversion. Each -j worker has its own.
+ */
+typedef struct writer {
+    output out;
+    int indent;
+} writer;
 
-static FILE *fp = NULL;
-static char line[max_line_len];
+/**
+ * @brief Pull reader for the streaming conversion. Only the current block
+ * of input, the text of the current scalar or key and one byte per open
+ * container are held in memory.
+ */
+typedef struct reader {
+    input *in;
+    writer *w;
+    const char *p;
+    const char *end;
+    long int line_number;
+    output text;
+    output key;
+    output stack;
+} reader;
+
+/**
+ * @brief A run of whole input lines converted by one -j worker.
+ */
+typedef struct chunk {
+    output text;
+    const char *base;
+    size_t len;
+    long int line_number;
+    output out;
+    bool done;
+    bool failed;
+} chunk;
+
+static bool opt_async = false;
+static int opt_jobs = 1;
+static bool opt_dom = false;
+static bool opt_stats = false;
+static codec_kind opt_compress = codec_none;
 static const char *empty_string = "";
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static chunk *chunks = NULL;
+static size_t chunk_slots = 0;
+static size_t chunks_filled = 0;
+static size_t chunks_taken = 0;
+static bool pool_finished = false;
+static bool pool_failed = false;
 
-static void output_ld(const char *key, json_object *obj);
-static char *wrap(const char *s, int width, int indent);
+static bool binary_begin(void *user, const char *name, size_t name_len, char type);
+static bool binary_end(void *user, char type);
+static const char *binary_name(reader *r, const char *name, size_t len);
+static bool binary_value(void *user, const ld_value *v);
+static int convert_binary(input *in, writer *w);
+static void convert_chunk(chunk *c);
+static int convert_dom(input *in, writer *w);
+static int convert_parallel(input *in, output *out);
+static int convert_stream(input *in, writer *w, long int line_number);
+static void emit_boolean(writer *w, const char *key, bool b);
+static void emit_double(writer *w, const char *key, double d);
+static void emit_int(writer *w, const char *key, int64_t i);
+static void emit_string(writer *w, const char *key, const char *s);
+static void end_container(reader *r);
+static bool is_jsonl(input *in);
+static int next_char(reader *r);
+static void output_ld(writer *w, const char *key, json_object *obj);
+static size_t pad(int indent);
+static int peek_char(reader *r);
+static bool put_utf8(output *o, unsigned int cp);
+static int read_chunk(input *in, chunk *c, long int *line_number);
+static bool read_escape(reader *r, int c, output *text);
+static bool read_hex4(reader *r, unsigned int *cp);
+static bool read_member(reader *r, int *c);
+static bool read_string(reader *r, int quote, output *text);
+static bool refill(reader *r);
+static int skip_space(reader *r);
+static bool stream_keyword(reader *r, int c, const char *key);
+static bool stream_number(reader *r, int c, const char *key);
+static bool stream_scalar(reader *r, int c, const char *key);
+static bool stream_value(reader *r, int c);
+static bool syntax_error(reader *r, const char *what);
+static void *worker(void *arg);
+static size_t write_chunks(output *out, size_t written, bool drain);
+
+static const ld_callbacks binary_callbacks = { binary_begin, binary_end, binary_value };
 
 int main(int ac, char **av) {
+    debug_enter();
+    const char *path = NULL;
+    size_t buffer_len = 0;
+    input in;
+    writer w;
+    int r;
+    for (int i = 1; i < ac; i++) {
+        if (strcmp(av[i], "-a") == 0) {
+            opt_async = true;
+        } else if (strcmp(av[i], "-b") == 0 && i + 1 < ac) {
+            long n = atol(av[++i]);
+            if (n < 1) {
+                fprintf(stderr, "Invalid buffer size \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+            buffer_len = n;
+        } else if (strcmp(av[i], "-d") == 0) {
+            opt_dom = true;
+        } else if (strcmp(av[i], "-j") == 0 && i + 1 < ac) {
+            opt_jobs = atoi(av[++i]);
+            if (opt_jobs < 1) {
+                fprintf(stderr, "Invalid job count \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+        } else if (strcmp(av[i], "--stats") == 0) {
+            opt_stats = true;
+        } else if (strcmp(av[i], "-z") == 0 && i + 1 < ac) {
+            i++;
+            if (strcmp(av[i], "gzip") == 0) {
+                opt_compress = codec_gzip;
+            } else if (strcmp(av[i], "zstd") == 0) {
+                opt_compress = codec_zstd;
+            } else {
+                fprintf(stderr, "Unknown compression \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+        } else if (strcmp(av[i], "-h") == 0) {
+            fprintf(stderr, "Usage: %s [-a] [-b bytes] [-d] [-j jobs] [-z gzip|zstd] [--stats] [file]\n", av[0]);
+            fprintf(stderr, "-a ..... Read input ahead and write output behind conversion\n");
+            fprintf(stderr, "-b ..... Output buffer size\n");
+            fprintf(stderr, "-d ..... Build a json-c object for each value before output\n");
+            fprintf(stderr, "-j ..... Convert JSONL, one value per line, on this many threads\n");
+            fprintf(stderr, "-z ..... Compress output with gzip or zstd\n");
+            fprintf(stderr, "--stats  Print time per phase and counters to stderr as JSON\n");
+            fprintf(stderr, "file ... Input file\n");
+            debug_return 0;
+        } else if (path == NULL) {
+            path = av[i];
+        }
+    }
+    if (opt_stats) {
+        stats_start();
+    }
+    if (!input_open(&in, path)) {
+        fprintf(stderr, "Unable to open file \"%s\"\n", path);
+        debug_return 1;
+    }
+    if (opt_async && !input_async(&in)) {
+        input_close(&in);
+        debug_return 1;
+    }
+    if (opt_async && opt_compress == codec_none) {
+        opt_compress = codec_copy;
+    }
+    memset(&w, 0, sizeof(w));
+    output_open(&w.out, STDOUT_FILENO, buffer_len);
+    if (opt_compress != codec_none && !output_compress(&w.out, opt_compress)) {
+        r = 1;
+    } else if (ldb_detect(&in)) {
+        r = convert_binary(&in, &w);
+    } else if (opt_jobs > 1 && is_jsonl(&in)) {
+        r = convert_parallel(&in, &w.out);
+    } else {
+        r = opt_dom ? convert_dom(&in, &w) : convert_stream(&in, &w, 1);
+    }
+    input_close(&in);
+    if (!output_close(&w.out)) {
+        r = 1;
+    }
+    if (opt_stats) {
+        stats_print("json2ld");
+    }
+    debug_return r;
+}
+
+static bool binary_begin(void *user, const char *name, size_t name_len, char type) {
+    reader *r = user;
+    const char *key = binary_name(r, name, name_len);
+    if (key == NULL || !output_key(&r->w->out, pad(r->w->indent), type, key)) {
+        return false;
+    }
+    r->w->indent += indent_step;
+    stats_depth(r->w->indent / indent_step);
+    return true;
+}
+
+static bool binary_end(void *user, char type) {
+    reader *r = user;
+    r->w->indent -= indent_step;
+    return output_key(&r->w->out, pad(r->w->indent), type, empty_string);
+}
+
+/**
+ * @brief Get a member name of a binary record as the NUL-terminated string
+ * output_key() wants.
+ */
+static const char *binary_name(reader *r, const char *name, size_t len) {
+    if (name == NULL) {
+        return empty_string;
+    }
+    r->key.len = 0;
+    if ((len > 0 && !output_append(&r->key, name, len)) || !output_char(&r->key, '\0')) {
+        return NULL;
+    }
+    return r->key.data;
+}
+
+/**
+ * @brief Write a value of a binary record. Numbers keep the text they were
+ * written with in the LD the record came from.
+ */
+static bool binary_value(void *user, const ld_value *v) {
+    reader *r = user;
+    writer *w = r->w;
+    const char *key = binary_name(r, v->name, v->name_len);
+    if (key == NULL) {
+        return false;
+    }
+    stats_begin(t);
+    bool ok = output_key(&w->out, pad(w->indent), v->type, key);
+    if (v->type != key_string) {
+        ok = ok && output_spaces(&w->out, pad(w->indent)) && output_append(&w->out, v->data, v->len);
+    } else if (w->indent >= wrap_len) {
+        fprintf(stderr, "Error: indent must be less than width\n");
+    } else {
+        ok = ok && output_wrapped(&w->out, v->data, v->len, wrap_len, w->indent);
+    }
+    ok = ok && output_char(&w->out, '\n');
+    stats_end(stats_serialize, t);
+    return ok;
+}
+
+/**
+ * @brief Convert the binary records that ld2json --emit-bin writes. They
+ * have been checked already, so they are written straight out. Output
+ * stops at a record that fails, as it does for JSON.
+ */
+static int convert_binary(input *in, writer *w) {
+    debug_enter();
+    ldb_reader b;
+    reader r;
+    ld_status st;
+    int rc = 0;
+    memset(&b, 0, sizeof(b));
+    memset(&r, 0, sizeof(r));
+    b.in = in;
+    r.in = in;
+    r.w = w;
+    output_open(&r.key, -1, 0);
+    while (1) {
+        size_t start = w->out.len;
+        if ((st = ldb_next(&b, &binary_callbacks, &r)) == ld_eof) {
+            break;
+        }
+        if (st != ld_record) {
+            w->out.len = start;
+            w->indent = 0;
+            rc = 1;
+            break;
+        }
+        output_maybe_flush(&w->out);
+    }
+    output_close(&r.key);
+    ldb_free(&b);
+    debug_return rc;
+}
+
+static void convert_chunk(chunk *c) {
+    debug_enter();
+    input in;
+    writer w;
+    memset(&w, 0, sizeof(w));
+    w.out = c->out;
+    input_open_buffer(&in, c->base, c->len);
+    int r = opt_dom ? convert_dom(&in, &w) : convert_stream(&in, &w, c->line_number);
+    input_close(&in);
+    c->out = w.out;
+    c->failed = r != 0;
+    debug_return;
+}
+
+static int convert_dom(input *in, writer *w) {
     debug_enter();
     json_tokener *tok = json_tokener_new();
     json_object *json_obj = NULL;
-    enum json_tokener_error jerr;
-    fp = stdin;
+    enum json_tokener_error jerr = json_tokener_success;
+    const char *line;
+    size_t len;
     if (tok == NULL) {
         fprintf(stderr, "Unable to create json_tokener\n");
         debug_return 1;
     }
-    for (int i = 1; i < ac; i++) {
-        if (strcmp(av[i], "-h") == 0) {
-            fprintf(stderr, "Usage: %s [file]\n", av[0]);
-            fprintf(stderr, "file ... Input file\n");
-            debug_return 0;
-        } else if (fp == stdin) {
-            fp = fopen(av[i], "r");
-            if (fp == NULL) {
-                fprintf(stderr, "Unable to open file \"%s\"\n", av[i]);
-                debug_return 1;
-            }
+    while ((line = input_get_line(in, &len)) != NULL) {
+        // Worker threads read buffers that the main thread has counted.
+        if (in->fd >= 0) {
+            stats_count(stats_lines_in, 1);
         }
-    }
-    while (fgets(line, max_line_len, fp) != NULL) {
-        json_obj = json_tokener_parse_ex(tok, line, strlen(line));
+        stats_begin(t);
+        json_obj = json_tokener_parse_ex(tok, line, len);
+        stats_end(stats_parse, t);
         jerr = json_tokener_get_error(tok);
         if (jerr == json_tokener_success) {
             if (json_obj != NULL) {
-                output_ld(empty_string, json_obj);
+                stats_count(stats_records, 1);
+                output_ld(w, empty_string, json_obj);
                 json_object_put(json_obj);
                 json_obj = NULL;
+                output_maybe_flush(&w->out);
             }
         } else if (jerr != json_tokener_continue) {
             fprintf(stderr, "Error: %s\n", json_tokener_error_desc(jerr));
-            debug_return(1);
+            json_tokener_free(tok);
+            debug_return 1;
         }
     }
     if (jerr == json_tokener_continue && json_obj != NULL) {
         if (json_obj != NULL) {
-            output_ld(empty_string, json_obj);
+            stats_count(stats_records, 1);
+            output_ld(w, empty_string, json_obj);
             json_object_put(json_obj);
             json_obj = NULL;
         }
     }
-    debug_return 0;
+    json_tokener_free(tok);
+    debug_return in->error ? 1 : 0;
 }
 
-static void output_ld(const char *key, json_object *obj) {
+static int convert_parallel(input *in, output *out) {
+    debug_enter();
+    pthread_t *threads = calloc(opt_jobs, sizeof(*threads));
+    long int line_number = 1;
+    size_t written = 0;
+    int started = 0;
+    int r = 1;
+    chunk_slots = opt_jobs * 2;
+    chunks = calloc(chunk_slots, sizeof(*chunks));
+    if (threads == NULL || chunks == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        free(threads);
+        free(chunks);
+        debug_return 1;
+    }
+    for (size_t i = 0; i < chunk_slots; i++) {
+        output_open(&chunks[i].text, -1, 0);
+        output_open(&chunks[i].out, -1, 0);
+    }
+    for (; started < opt_jobs; started++) {
+        if (pthread_create(&threads[started], NULL, worker, NULL) != 0) {
+            fprintf(stderr, "Unable to start worker thread\n");
+            break;
+        }
+    }
+    if (started == 0) {
+        r = -1;
+    }
+    while (r == 1) {
+        written = write_chunks(out, written, false);
+        if (pool_failed) {
+            break;
+        }
+        chunk *c = &chunks[chunks_filled % chunk_slots];
+        r = read_chunk(in, c, &line_number);
+        pthread_mutex_lock(&pool_lock);
+        chunks_filled++;
+        pthread_cond_signal(&pool_work);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_finished = true;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+    write_chunks(out, written, true);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = 0; i < chunk_slots; i++) {
+        output_close(&chunks[i].text);
+        output_close(&chunks[i].out);
+    }
+    free(chunks);
+    free(threads);
+    debug_return r < 0 || pool_failed ? 1 : 0;
+}
+
+static int convert_stream(input *in, writer *w, long int line_number) {
+    debug_enter();
+    reader r;
+    int c;
+    int rc = 0;
+    memset(&r, 0, sizeof(r));
+    r.in = in;
+    r.w = w;
+    r.line_number = line_number;
+    output_open(&r.text, -1, 0);
+    output_open(&r.key, -1, 0);
+    output_open(&r.stack, -1, 0);
+    while ((c = skip_space(&r)) != EOF) {
+        // ld2json -p separates top-level objects with commas.
+        if (c == ',') {
+            continue;
+        }
+        if (!stream_value(&r, c)) {
+            rc = 1;
+            break;
+        }
+        stats_count(stats_records, 1);
+        output_maybe_flush(&w->out);
+    }
+    output_close(&r.text);
+    output_close(&r.key);
+    output_close(&r.stack);
+    debug_return rc || in->error ? 1 : 0;
+}
+
+static void emit_boolean(writer *w, const char *key, bool b) {
+    stats_begin(t);
+    output_key(&w->out, pad(w->indent), key_boolean, key);
+    output_spaces(&w->out, pad(w->indent));
+    if (b) {
+        output_append(&w->out, "true\n", 5);
+    } else {
+        output_append(&w->out, "false\n", 6);
+    }
+    stats_end(stats_serialize, t);
+}
+
+static void emit_double(writer *w, const char *key, double d) {
+    stats_begin(t);
+    output_key(&w->out, pad(w->indent), key_number, key);
+    output_spaces(&w->out, pad(w->indent));
+    output_double(&w->out, d);
+    output_char(&w->out, '\n');
+    stats_end(stats_serialize, t);
+}
+
+static void emit_int(writer *w, const char *key, int64_t i) {
+    stats_begin(t);
+    output_key(&w->out, pad(w->indent), key_number, key);
+    output_spaces(&w->out, pad(w->indent));
+    output_int(&w->out, i);
+    output_char(&w->out, '\n');
+    stats_end(stats_serialize, t);
+}
+
+static void emit_string(writer *w, const char *key, const char *s) {
+    stats_begin(t);
+    output_key(&w->out, pad(w->indent), key_string, key);
+    if (w->indent >= wrap_len) {
+        fprintf(stderr, "Error: indent must be less than width\n");
+    } else {
+        output_wrapped(&w->out, s, strlen(s), wrap_len, w->indent);
+    }
+    output_char(&w->out, '\n');
+    stats_end(stats_serialize, t);
+}
+
+static void end_container(reader *r) {
+    char open = r->stack.data[--r->stack.len];
+    r->w->indent -= indent_step;
+    output_key(&r->w->out, pad(r->w->indent), open == '{' ? key_end_obj : key_end_array, empty_string);
+}
+
+/**
+ * @brief Check, without reading it, that the input starts with a whole value
+ * on its own line. -j cuts the input at line breaks, so anything else would
+ * be cut through the middle of a value.
+ */
+static bool is_jsonl(input *in) {
+    size_t want = 4096;
+    const char *s;
+    const char *nl = NULL;
+    size_t len;
+    while (1) {
+        len = want;
+        if ((s = input_peek(in, want)) == NULL) {
+            // The input is shorter than that; look at all there is.
+            s = in->map != NULL ? in->map + in->pos : in->buf + in->pos;
+            len = (in->map != NULL ? in->map_len : in->buf_len) - in->pos;
+        }
+        if ((nl = memchr(s, '\n', len)) != NULL || len < want || want >= chunk_len) {
+            break;
+        }
+        want *= 2;
+    }
+    if (nl == NULL && len < want) {
+        // A single line with no line feed after it.
+        nl = s + len;
+    }
+    bool whole = false;
+    json_tokener *tok = nl != NULL ? json_tokener_new() : NULL;
+    if (tok != NULL) {
+        json_object *obj = json_tokener_parse_ex(tok, s, nl - s);
+        whole = json_tokener_get_error(tok) == json_tokener_success;
+        json_object_put(obj);
+        json_tokener_free(tok);
+    }
+    if (!whole && len > 0) {
+        fprintf(stderr, "Input is not JSONL, one value per line; converting it on one thread\n");
+    }
+    return whole;
+}
+
+static int next_char(reader *r) {
+    if (r->p == r->end && !refill(r)) {
+        return EOF;
+    }
+    unsigned char c = *r->p++;
+    if (c == '\n') {
+        r->line_number++;
+        if (r->in->fd >= 0) {
+            stats_count(stats_lines_in, 1);
+        }
+    }
+    return c;
+}
+
+static void output_ld(writer *w, const char *key, json_object *obj) {
     debug_enter();
-    static int indent = 0;
     char *k;
-    char *s;
     json_object *val;
     if (obj == NULL) {
         fprintf(stderr, "Error: NULL object\n");
@@ -111,44 +573,41 @@ static void output_ld(const char *key, json_object *obj) {
     }
     switch (json_object_get_type(obj)) {
         case json_type_array:
-            printf("%*s~~:%c%s\n", indent, " ", key_start_array, key);
-            indent += indent_step;
+            output_key(&w->out, pad(w->indent), key_start_array, key);
+            w->indent += indent_step;
+            stats_depth(w->indent / indent_step);
             for (int i = 0; i < json_object_array_length(obj); i++) {
-                output_ld(empty_string, json_object_array_get_idx(obj, i));
+                output_ld(w, empty_string, json_object_array_get_idx(obj, i));
             }
-            indent -= indent_step;
-            printf("%*s~~:%c\n", indent, " ", key_end_array);
+            w->indent -= indent_step;
+            output_key(&w->out, pad(w->indent), key_end_array, empty_string);
             break;
         case json_type_boolean:
-            printf("%*s~~:%c%s\n%*s%s\n", indent, " ", key_number, key, indent, " ", json_object_get_boolean(obj) ? "true" : "false");
+            emit_boolean(w, key, json_object_get_boolean(obj));
             break;
         case json_type_double:
-            printf("%*s~~:%c%s\n%*s%lf\n", indent, " ", key_number, key, indent, " ", json_object_get_double(obj));
+            emit_double(w, key, json_object_get_double(obj));
             break;
         case json_type_int:
-            printf("%*s~~:%c%s\n%*s%d\n", indent, " ", key_number, key, indent, " ", json_object_get_int(obj));
+            emit_int(w, key, json_object_get_int64(obj));
             break;
         case json_type_null:
-            printf("%*s~~:%c%s\n%*snull\n", indent, " ", key_null, key, indent, " ");
+            output_key(&w->out, pad(w->indent), key_null, key);
+            output_spaces(&w->out, pad(w->indent));
+            output_append(&w->out, "null\n", 5);
             break;
         case json_type_object:
-            printf("%*s~~:%c%s\n", indent, " ", key_start_obj, key);
-            indent += indent_step;
+            output_key(&w->out, pad(w->indent), key_start_obj, key);
+            w->indent += indent_step;
+            stats_depth(w->indent / indent_step);
             json_object_object_foreach(obj, k, val) {
-                output_ld(k, val);
+                output_ld(w, k, val);
             }
-            indent -= indent_step;
-            printf("%*s~~:%c\n", indent, " ", key_end_obj);
+            w->indent -= indent_step;
+            output_key(&w->out, pad(w->indent), key_end_obj, empty_string);
             break;
         case json_type_string:
-            s = wrap(json_object_get_string(obj), wrap_len, indent);
-            if (s != NULL) {
-                printf("%*s~~:%c%s\n%s\n", indent, " ", key_string, key, s);
-                free(s);
-                s = NULL;
-            } else {
-                printf("%*s~~:%c%s\n%s\n", indent, " ", key_string, key, empty_string);
-            }
+            emit_string(w, key, json_object_get_string(obj));
             break;
         default:
             break;
@@ -156,56 +615,425 @@ static void output_ld(const char *key, json_object *obj) {
     debug_return;
 }
 
-static char *wrap(const char *s, int width, int indent) {
-    debug_enter();
-    if (indent >= width) {
-        fprintf(stderr, "Error: indent must be less than width\n");
-        debug_return NULL;
-    }
-    int sl = strlen(s);
-    int rl = sl;
-    int bl = ((sl / (width / 4)) * (width + indent + 2)) + (sl % width) + indent + 1;
-    char *r = (char *)malloc(bl);
-    if (!r) {
-        debug_return NULL;
-    }
-    memset(r, ' ', bl);
-    debug("string len = %d", sl);
-    debug("buffer size = %d", bl);
-    char *p = r;
-    int ll = 0;
-    int l;
+/**
+ * @brief Width of the space run before a line. Top-level lines get a
+ * single space.
+ */
+static size_t pad(int indent) {
+    return indent > 0 ? indent : 1;
+}
+
+static int peek_char(reader *r) {
+    if (r->p == r->end && !refill(r)) {
+        return EOF;
+    }
+    return (unsigned char)*r->p;
+}
+
+static bool put_utf8(output *o, unsigned int cp) {
+    char b[4];
+    size_t n;
+    if (cp < 0x80) {
+        b[0] = cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        b[0] = 0xc0 | (cp >> 6);
+        b[1] = 0x80 | (cp & 0x3f);
+        n = 2;
+    } else if (cp < 0x10000) {
+        b[0] = 0xe0 | (cp >> 12);
+        b[1] = 0x80 | ((cp >> 6) & 0x3f);
+        b[2] = 0x80 | (cp & 0x3f);
+        n = 3;
+    } else {
+        b[0] = 0xf0 | (cp >> 18);
+        b[1] = 0x80 | ((cp >> 12) & 0x3f);
+        b[2] = 0x80 | ((cp >> 6) & 0x3f);
+        b[3] = 0x80 | (cp & 0x3f);
+        n = 4;
+    }
+    return output_append(o, b, n);
+}
+
+/**
+ * @brief Collect about chunk_len bytes of whole lines. Mapped input is
+ * referenced where it lies; anything else is copied into the chunk.
+ * @return 1 if there may be more input, 0 at end of input, -1 on error.
+ */
+static int read_chunk(input *in, chunk *c, long int *line_number) {
+    const char *s;
+    size_t len;
+    c->text.len = 0;
+    c->base = NULL;
+    c->len = 0;
+    c->line_number = *line_number;
+    c->done = false;
+    c->failed = false;
+    while (c->len < chunk_len) {
+        if ((s = input_get_block(in, &len)) == NULL) {
+            return in->error ? -1 : 0;
+        }
+        if (in->map != NULL) {
+            if (c->base == NULL) {
+                c->base = s;
+            }
+        } else {
+            if (!output_append(&c->text, s, len)) {
+                return -1;
+            }
+            c->base = c->text.data;
+        }
+        c->len += len;
+        for (const char *e = s + len; (s = memchr(s, '\n', e - s)) != NULL; s++) {
+            (*line_number)++;
+            stats_count(stats_lines_in, 1);
+        }
+    }
+    return 1;
+}
+
+static bool read_escape(reader *r, int c, output *text) {
+    unsigned int cp;
+    switch (c) {
+        case 'b':
+            return output_char(text, '\b');
+        case 'f':
+            return output_char(text, '\f');
+        case 'n':
+            return output_char(text, '\n');
+        case 'r':
+            return output_char(text, '\r');
+        case 't':
+            return output_char(text, '\t');
+        case '"':
+        case '\'':
+        case '\\':
+        case '/':
+            return output_char(text, c);
+        case 'u':
+            if (!read_hex4(r, &cp)) {
+                return false;
+            }
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                if (peek_char(r) != '\\') {
+                    return put_utf8(text, replacement_char);
+                }
+                next_char(r);
+                c = next_char(r);
+                if (c != 'u') {
+                    return put_utf8(text, replacement_char) && read_escape(r, c, text);
+                }
+                unsigned int low;
+                if (!read_hex4(r, &low)) {
+                    return false;
+                }
+                if (low < 0xdc00 || low >= 0xe000) {
+                    return put_utf8(text, replacement_char) && put_utf8(text, low >= 0xd800 && low < 0xdc00 ? replacement_char : low);
+                }
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            } else if (cp >= 0xdc00 && cp < 0xe000) {
+                cp = replacement_char;
+            }
+            return put_utf8(text, cp);
+        default:
+            return syntax_error(r, "invalid string escape");
+    }
+}
+
+static bool read_hex4(reader *r, unsigned int *cp) {
+    *cp = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = next_char(r);
+        if (!isxdigit(c)) {
+            return syntax_error(r, "invalid \\u escape");
+        }
+        *cp = (*cp << 4) | (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+    }
+    return true;
+}
+
+static bool read_member(reader *r, int *c) {
+    if (*c != '"' && *c != '\'') {
+        return syntax_error(r, "expected an object key");
+    }
+    if (!read_string(r, *c, &r->key)) {
+        return false;
+    }
+    if (skip_space(r) != ':') {
+        return syntax_error(r, "expected ':' after object key");
+    }
+    *c = skip_space(r);
+    return true;
+}
+
+static bool read_string(reader *r, int quote, output *text) {
+    text->len = 0;
     while (1) {
-        p += indent;
-        ll = width - indent;
-        if (rl <= ll) {
-            strcpy(p, s);
+        if (r->p == r->end && !refill(r)) {
+            return syntax_error(r, "unterminated string");
+        }
+        const char *s = r->p;
+        while (s < r->end && *s != quote && *s != '\\') {
+            if (*s == '\n') {
+                r->line_number++;
+            }
+            s++;
+        }
+        if (!output_append(text, r->p, s - r->p)) {
+            return false;
+        }
+        r->p = s;
+        if (s == r->end) {
+            continue;
+        }
+        if (*r->p++ == quote) {
+            return output_char(text, '\0');
+        }
+        if (!read_escape(r, next_char(r), text)) {
+            return false;
+        }
+    }
+}
+
+static bool refill(reader *r) {
+    size_t len;
+    const char *s = input_read(r->in, &len);
+    if (s == NULL) {
+        return false;
+    }
+    r->p = s;
+    r->end = s + len;
+    return true;
+}
+
+static int skip_space(reader *r) {
+    int c;
+    while ((c = next_char(r)) != EOF) {
+        if (c == '/' && peek_char(r) == '*') {
+            int prev = next_char(r);
+            while ((c = next_char(r)) != EOF && !(prev == '*' && c == '/')) {
+                prev = c;
+            }
+        } else if (c == '/' && peek_char(r) == '/') {
+            while ((c = next_char(r)) != EOF && c != '\n') {
+            }
+        } else if (!isspace(c)) {
+            return c;
+        }
+    }
+    return EOF;
+}
+
+static bool stream_keyword(reader *r, int c, const char *key) {
+    bool negative = c == '-';
+    r->text.len = 0;
+    if (negative) {
+        c = next_char(r);
+    }
+    while (1) {
+        if (!output_char(&r->text, c)) {
+            return false;
+        }
+        c = peek_char(r);
+        if (c == EOF || !isalpha(c)) {
             break;
         }
-        const char *e = s + ll - 1;
-        while (e > s && !isspace(*e)) {
-            e--;
+        next_char(r);
+    }
+    if (!output_char(&r->text, '\0')) {
+        return false;
+    }
+    const char *w = r->text.data;
+    if (!negative && strcasecmp(w, "true") == 0) {
+        emit_boolean(r->w, key, true);
+    } else if (!negative && strcasecmp(w, "false") == 0) {
+        emit_boolean(r->w, key, false);
+    } else if (!negative && strcasecmp(w, "null") == 0) {
+        fprintf(stderr, "Error: NULL object\n");
+    } else if (!negative && strcasecmp(w, "nan") == 0) {
+        emit_double(r->w, key, NAN);
+    } else if (strcasecmp(w, "infinity") == 0) {
+        emit_double(r->w, key, negative ? -INFINITY : INFINITY);
+    } else {
+        return syntax_error(r, "unexpected word");
+    }
+    return true;
+}
+
+static bool stream_number(reader *r, int c, const char *key) {
+    bool real = false;
+    char *end;
+    r->text.len = 0;
+    while (1) {
+        real |= c == '.' || c == 'e' || c == 'E';
+        if (!output_char(&r->text, c)) {
+            return false;
         }
-        if (e == s) {
-            e = s + ll;
+        c = peek_char(r);
+        if (c == EOF || c == '\0' || strchr("0123456789.+-eE", c) == NULL) {
+            break;
         }
-        l = e - s + 1;
-        for (int j = 0; j < l; j++) {
-            if (s[j] == '\n') {
-                *p++ = '\\';
-                *p++ = 'n';
-                l--;
-            } else {
-                *p++ = s[j];
+        next_char(r);
+    }
+    if (!output_char(&r->text, '\0')) {
+        return false;
+    }
+    if (real) {
+        double d = strtod(r->text.data, &end);
+        if (*end != '\0') {
+            return syntax_error(r, "invalid number");
+        }
+        emit_double(r->w, key, d);
+    } else {
+        errno = 0;
+        long long i = strtoll(r->text.data, &end, 10);
+        if (*end != '\0' || end == r->text.data) {
+            return syntax_error(r, "invalid number");
+        }
+        if (errno == ERANGE) {
+            // Too big for an int64; keep its magnitude as a double.
+            emit_double(r->w, key, strtod(r->text.data, NULL));
+        } else {
+            emit_int(r->w, key, i);
+        }
+    }
+    return true;
+}
+
+static bool stream_scalar(reader *r, int c, const char *key) {
+    if (c == '"' || c == '\'') {
+        if (!read_string(r, c, &r->text)) {
+            return false;
+        }
+        emit_string(r->w, key, r->text.data);
+        return true;
+    }
+    if (isalpha(c) || (c == '-' && peek_char(r) != EOF && isalpha(peek_char(r)))) {
+        return stream_keyword(r, c, key);
+    }
+    if (isdigit(c) || c == '-' || c == '+' || c == '.') {
+        return stream_number(r, c, key);
+    }
+    if (c == EOF) {
+        return syntax_error(r, "unexpected end of input");
+    }
+    return syntax_error(r, "unexpected character");
+}
+
+static bool stream_value(reader *r, int c) {
+    debug_enter();
+    const char *key = empty_string;
+    bool have_value = false;
+    r->stack.len = 0;
+    while (1) {
+        output_maybe_flush(&r->w->out);
+        if (!have_value) {
+            if (c == '{' || c == '[') {
+                output_key(&r->w->out, pad(r->w->indent), c == '{' ? key_start_obj : key_start_array, key);
+                r->w->indent += indent_step;
+                if (!output_char(&r->stack, c)) {
+                    debug_return false;
+                }
+                stats_depth(r->stack.len);
+                char open = c;
+                c = skip_space(r);
+                if (c == (open == '{' ? '}' : ']')) {
+                    end_container(r);
+                    have_value = true;
+                } else if (open == '{') {
+                    if (!read_member(r, &c)) {
+                        debug_return false;
+                    }
+                    key = r->key.data;
+                } else {
+                    key = empty_string;
+                }
+                continue;
+            }
+            if (!stream_scalar(r, c, key)) {
+                debug_return false;
+            }
+            have_value = true;
+        }
+        if (r->stack.len == 0) {
+            debug_return true;
+        }
+        char top = r->stack.data[r->stack.len - 1];
+        char close = top == '{' ? '}' : ']';
+        c = skip_space(r);
+        if (c == ',') {
+            c = skip_space(r);
+            if (c != close) {
+                if (top == '{') {
+                    if (!read_member(r, &c)) {
+                        debug_return false;
+                    }
+                    key = r->key.data;
+                } else {
+                    key = empty_string;
+                }
+                have_value = false;
+                continue;
             }
         }
-        rl -= l;
-        *p++ = '\n';
-        s = e + 1;
-        if (*s == '\0') {
+        if (c != close) {
+            debug_return syntax_error(r, top == '{' ? "expected ',' or '}'" : "expected ',' or ']'");
+        }
+        end_container(r);
+    }
+}
+
+static bool syntax_error(reader *r, const char *what) {
+    fprintf(stderr, "Error: %s on line %li\n", what, r->line_number);
+    return false;
+}
+
+static void *worker(void *arg) {
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (chunks_taken == chunks_filled && !pool_finished) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+        if (chunks_taken == chunks_filled) {
             break;
         }
+        chunk *c = &chunks[chunks_taken++ % chunk_slots];
+        pthread_mutex_unlock(&pool_lock);
+        convert_chunk(c);
+        pthread_mutex_lock(&pool_lock);
+        c->done = true;
+        pthread_cond_broadcast(&pool_done);
     }
-    debug("result length = %ld", strlen(r));
-    debug_return r;
+    pthread_mutex_unlock(&pool_lock);
+    stats_merge();
+    return arg;
+}
+
+/**
+ * @brief Write finished chunks in input order. Once a chunk has failed,
+ * the chunks after it are dropped, as a single-threaded run would have
+ * stopped there.
+ */
+static size_t write_chunks(output *out, size_t written, bool drain) {
+    pthread_mutex_lock(&pool_lock);
+    while (written < chunks_filled) {
+        chunk *c = &chunks[written % chunk_slots];
+        if (!c->done) {
+            if (!drain && chunks_filled - written < chunk_slots) {
+                break;
+            }
+            pthread_cond_wait(&pool_done, &pool_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if (!pool_failed) {
+            output_write(out, c->out.data, c->out.len);
+            pool_failed = c->failed;
+        }
+        c->out.len = 0;
+        written++;
+        pthread_mutex_lock(&pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return written;
 }
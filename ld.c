@@ -0,0 +1,1040 @@
+/**
+ * @file ld.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Reentrant LD parser that reports records through callbacks.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "input.h"
+#include "ld.h"
+#include "ldb.h"
+#include "lines.h"
+#include "number.h"
+#include "stats.h"
+
+#ifdef DEBUG
+static int indent_level = 0;
+static char *indent_string = "                                                                                ";
+#define debug(...) do { fprintf(stderr, "%.*s%s  %d  ", indent_level, indent_string, __FILE__, __LINE__); fprintf(stderr, __VA_ARGS__); } while(0)
+#define debug_enter() do { debug("%s()\n", __PRETTY_FUNCTION__); indent_level += 4; } while(0)
+#define debug_return indent_level -= 4; return
+#else
+#define debug(...)
+#define debug_enter()
+#define debug_return return
+#endif
+
+#define min_data_len 4096
+#define arena_block_len 16384
+#define max_shape_keys 4096
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t cap;
+    size_t used;
+    char data[];
+} arena_block;
+
+typedef struct arena {
+    arena_block *head;
+    arena_block *cur;
+} arena;
+
+typedef struct data_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} data_buffer;
+
+/**
+ * @brief A key as it appears after the prefix: the type character followed
+ * by the name.
+ */
+typedef struct key_span {
+    const char *s;
+    size_t len;
+} key_span;
+
+/**
+ * @brief One key line of a record shape. Offsets are into shape.text.
+ */
+typedef struct shape_key {
+    size_t text;            // start of the line, after its indent
+    size_t len;
+    size_t key_len;         // length of the key span, which follows the prefix
+    bool has_key;
+} shape_key;
+
+/**
+ * @brief The sequence of key lines that makes up a record.
+ */
+typedef struct shape {
+    data_buffer text;
+    shape_key *keys;
+    size_t count;
+    size_t cap;
+    char type;              // type of the record's opening key
+    bool full;              // too long to learn
+} shape;
+
+/**
+ * @brief A member selected by ld_parser_fields(), with the members of it
+ * that are selected in turn.
+ */
+typedef struct field {
+    struct field *child;
+    struct field *next;
+    bool all;               // the whole value is selected
+    size_t len;
+    char name[];
+} field;
+
+struct ld_parser {
+    ld_callbacks cb;
+    void *user;
+    input in;
+    line_index lines;
+    size_t line_pos;
+    long int line_number;
+    uint64_t offset;
+    uint64_t record_offset;
+    long int record_line;
+    bool in_comment;
+    arena keys;
+    data_buffer data;
+    const char *span;
+    size_t span_len;
+    unsigned int learn;     // records in a row with one shape before using it
+    unsigned int streak;
+    bool matching;          // known is in use
+    bool missed;            // the current record left known
+    size_t shape_pos;
+    shape known;            // shape in use, or the candidate while learning
+    shape cur;              // shape of the record being learned
+    field *fields;          // members to deliver, or NULL for all of them
+    char *where;            // name of the ld_parser_where() member, then its value
+    size_t where_len;
+    size_t where_value_len;
+    unsigned int depth;     // containers open in the record being parsed
+    bool where_met;
+    bool rejected;          // the record failed the where condition
+    data_buffer skip;       // types of the containers skip_lines() is in
+    bool trust;             // values are taken as written, without checks
+    bool detected;          // the input has been checked for binary records
+    bool binary;            // the input holds binary records, read by bin
+    ldb_reader bin;
+};
+
+static bool append_line(ld_parser *p, const line_info *l, unsigned int indent);
+static void *arena_alloc(arena *a, size_t len);
+static void arena_free(arena *a);
+static void arena_reset(arena *a);
+static bool buffer_append(data_buffer *b, const char *s, size_t l);
+static void clear_data(ld_parser *p);
+static bool detect(ld_parser *p);
+static bool emit_value(ld_parser *p, const key_span *key, bool in_array);
+static bool field_add(field *root, const char *path, size_t len);
+static const field *field_find(const field *sel, const char *name, size_t len);
+static void field_free(field *f);
+static const char *finish_data(ld_parser *p, size_t *len);
+static bool get_key(ld_parser *p, const line_info *l, key_span *key);
+static const line_info *get_line(ld_parser *p);
+static bool is_where(const ld_parser *p, const key_span *key);
+static bool key_line(ld_parser *p, const line_info *l, key_span *key, char end);
+static bool parse_array(ld_parser *p, const char *name, size_t name_len, const field *sel);
+static bool parse_object(ld_parser *p, const char *name, size_t name_len, const field *sel);
+static void reject(ld_parser *p, const char *open, size_t count);
+static void shape_add(shape *sh, const char *s, size_t len, const key_span *key, bool has_key);
+static void shape_done(ld_parser *p, ld_status st);
+static bool shape_equal(const shape *a, const shape *b);
+static void shape_free(shape *sh);
+static bool skip_lines(ld_parser *p, const char *open, size_t count);
+static bool text_is(const char *s, size_t len, const char *word);
+static bool unwind(ld_parser *p, char open, char type);
+
+ld_parser *ld_parser_new(const ld_callbacks *cb, void *user) {
+    ld_parser *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return NULL;
+    }
+    p->cb = *cb;
+    p->user = user;
+    p->in.fd = -1;
+    return p;
+}
+
+bool ld_parser_async(ld_parser *p) {
+    return input_async(&p->in);
+}
+
+bool ld_parser_binary(ld_parser *p) {
+    return ldb_detect(&p->in);
+}
+
+bool ld_parser_follow(ld_parser *p, void (*wait)(void *user), void *user) {
+    return input_follow(&p->in, wait, user);
+}
+
+bool ld_parser_fields(ld_parser *p, const char *fields) {
+    field_free(p->fields);
+    p->fields = NULL;
+    if (fields == NULL) {
+        return true;
+    }
+    p->fields = calloc(1, sizeof(*p->fields));
+    if (p->fields == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return false;
+    }
+    while (1) {
+        const char *e = strchr(fields, ',');
+        size_t len = e != NULL ? (size_t)(e - fields) : strlen(fields);
+        if (!field_add(p->fields, fields, len)) {
+            return false;
+        }
+        if (e == NULL) {
+            return true;
+        }
+        fields = e + 1;
+    }
+}
+
+void ld_parser_trust(ld_parser *p, bool trust) {
+    p->trust = trust;
+}
+
+void ld_parser_learn(ld_parser *p, unsigned int records) {
+    p->learn = records;
+    p->streak = 0;
+    p->matching = false;
+}
+
+bool ld_parser_where(ld_parser *p, const char *name, const char *value) {
+    free(p->where);
+    p->where = NULL;
+    if (name == NULL) {
+        return true;
+    }
+    p->where_len = strlen(name);
+    p->where_value_len = strlen(value);
+    p->where = malloc(p->where_len + p->where_value_len);
+    if (p->where == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return false;
+    }
+    memcpy(p->where, name, p->where_len);
+    memcpy(p->where + p->where_len, value, p->where_value_len);
+    return true;
+}
+
+bool ld_parser_open(ld_parser *p, const char *path) {
+    ld_parser_close(p);
+    return input_open(&p->in, path);
+}
+
+void ld_parser_open_buffer(ld_parser *p, const char *buf, size_t len, long int line_number) {
+    ld_parser_close(p);
+    input_open_buffer(&p->in, buf, len);
+    p->line_number = line_number - 1;
+}
+
+ld_status ld_parser_next(ld_parser *p) {
+    debug_enter();
+    const line_info *l;
+    if (!detect(p)) {
+        debug_return ld_error;
+    }
+    if (p->binary) {
+        ld_status st = ldb_next(&p->bin, &p->cb, p->user);
+        p->offset = p->bin.offset;
+        p->record_offset = p->bin.record_offset;
+        p->line_number = p->record_line = p->bin.records;
+        debug_return st;
+    }
+    while ((l = get_line(p)) != NULL) {
+        debug("read line %li: \"%.*s\"\n", p->line_number, (int)l->len, l->s);
+        if (!l->key) {
+            continue;
+        }
+        char type = l->type;
+        if (type == key_start_obj || type == key_start_array) {
+            debug("got %s\n", type == key_start_obj ? "object" : "array");
+            p->in_comment = false;
+            p->record_offset = p->offset - l->size;
+            p->record_line = p->line_number;
+            stats_count(stats_records, 1);
+            stats_key(type);
+            p->cur.type = type;
+            p->missed = !p->matching || p->known.type != type;
+            p->shape_pos = 0;
+            p->depth = 0;
+            p->where_met = false;
+            p->rejected = false;
+            p->skip.len = 0;
+            bool ok;
+            if (p->where != NULL && type == key_start_array) {
+                // An array has no members, so it cannot meet the condition.
+                reject(p, "[", 1);
+                ok = false;
+            } else {
+                ok = type == key_start_obj ? parse_object(p, NULL, 0, p->fields) : parse_array(p, NULL, 0, p->fields);
+            }
+            ld_status st = ok ? ld_record : ld_failed;
+            if (p->rejected) {
+                st = skip_lines(p, NULL, 0) ? ld_skipped : ld_failed;
+            } else if (!ok) {
+                // unwind() noted the containers still open innermost first;
+                // pass over the rest of the record, so that the next one is
+                // read from its own first line.
+                for (size_t i = 0; i < p->skip.len / 2; i++) {
+                    char t = p->skip.data[i];
+                    p->skip.data[i] = p->skip.data[p->skip.len - 1 - i];
+                    p->skip.data[p->skip.len - 1 - i] = t;
+                }
+                skip_lines(p, NULL, 0);
+            }
+            if (p->learn > 0) {
+                shape_done(p, st);
+            }
+            arena_reset(&p->keys);
+            debug_return st;
+        } else if (type == key_comment) {
+            debug("got comment\n");
+            p->in_comment = true;
+        } else if (!p->in_comment) {
+            fprintf(stderr, "Invalid key type: \"%.*s\" on line %li\n", (int)(l->len - l->indent), l->s + l->indent, p->line_number);
+            debug_return ld_error;
+        }
+    }
+    debug_return p->in.error ? ld_error : ld_eof;
+}
+
+bool ld_parser_seek(ld_parser *p, uint64_t offset, long int line_number) {
+    // A binary record can use names defined anywhere before it.
+    if (!detect(p) || p->binary || !input_seek(&p->in, offset)) {
+        return false;
+    }
+    p->lines.count = p->line_pos = 0;
+    p->line_number = line_number;
+    p->offset = offset;
+    p->in_comment = false;
+    clear_data(p);
+    return true;
+}
+
+uint64_t ld_parser_offset(const ld_parser *p) {
+    return p->offset;
+}
+
+long int ld_parser_line(const ld_parser *p) {
+    return p->line_number;
+}
+
+uint64_t ld_parser_record_offset(const ld_parser *p) {
+    return p->record_offset;
+}
+
+long int ld_parser_record_line(const ld_parser *p) {
+    return p->record_line;
+}
+
+uint64_t ld_parser_read_time(const ld_parser *p) {
+    return p->in.read_time;
+}
+
+void ld_parser_close(ld_parser *p) {
+    input_close(&p->in);
+    ldb_free(&p->bin);
+    p->detected = p->binary = false;
+    p->lines.count = p->line_pos = 0;
+    p->line_number = 0;
+    p->offset = 0;
+    p->in_comment = false;
+    clear_data(p);
+}
+
+void ld_parser_free(ld_parser *p) {
+    if (p == NULL) {
+        return;
+    }
+    input_close(&p->in);
+    lines_free(&p->lines);
+    arena_free(&p->keys);
+    free(p->data.data);
+    shape_free(&p->known);
+    shape_free(&p->cur);
+    field_free(p->fields);
+    free(p->where);
+    free(p->skip.data);
+    ldb_free(&p->bin);
+    free(p);
+}
+
+static bool append_line(ld_parser *p, const line_info *l, unsigned int indent) {
+    stats_begin(t);
+    const char *lp = l->s + (l->indent < indent ? l->indent : indent);
+    const char *end = l->s + l->len;
+    bool escaped = end - lp > (long)key_type_position && memcmp(lp, key_prefix, key_type_position) == 0 && lp[key_type_position] == key_escape;
+    bool ok = true;
+    if (!escaped && p->span == NULL && p->data.len == 0 && p->in.map != NULL) {
+        // Mapped input does not move, so a value that sits on one line is
+        // handed out where it lies instead of being copied.
+        p->span = lp;
+        p->span_len = end - lp;
+    } else {
+        if (p->span != NULL) {
+            ok = buffer_append(&p->data, p->span, p->span_len);
+            p->span = NULL;
+        }
+        if (ok && escaped) {
+            ok = buffer_append(&p->data, lp, key_type_position);
+            lp += key_type_position + 1;
+        }
+        ok = ok && buffer_append(&p->data, lp, end - lp);
+    }
+    stats_end(stats_values, t);
+    return ok;
+}
+
+static void *arena_alloc(arena *a, size_t len) {
+    len = (len + 7) & ~(size_t)7;
+    while (a->cur != NULL && a->cur->cap - a->cur->used < len && a->cur->next != NULL) {
+        a->cur = a->cur->next;
+        a->cur->used = 0;
+    }
+    if (a->cur == NULL || a->cur->cap - a->cur->used < len) {
+        size_t cap = len > arena_block_len ? len : arena_block_len;
+        arena_block *b = malloc(sizeof(*b) + cap);
+        stats_count(stats_allocations, 1);
+        if (b == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return NULL;
+        }
+        b->cap = cap;
+        b->used = 0;
+        if (a->cur == NULL) {
+            b->next = a->head;
+            a->head = b;
+        } else {
+            b->next = a->cur->next;
+            a->cur->next = b;
+        }
+        a->cur = b;
+    }
+    void *r = a->cur->data + a->cur->used;
+    a->cur->used += len;
+    return r;
+}
+
+static void arena_free(arena *a) {
+    while (a->head != NULL) {
+        arena_block *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->cur = NULL;
+}
+
+static void arena_reset(arena *a) {
+    a->cur = a->head;
+    if (a->cur != NULL) {
+        a->cur->used = 0;
+    }
+}
+
+static bool buffer_append(data_buffer *b, const char *s, size_t l) {
+    if (b->len + l > b->cap) {
+        size_t cap = b->cap ? b->cap : min_data_len;
+        while (cap < b->len + l) {
+            cap *= 2;
+        }
+        char *n = realloc(b->data, cap);
+        stats_count(stats_allocations, 1);
+        if (n == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return false;
+        }
+        b->data = n;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, s, l);
+    b->len += l;
+    return true;
+}
+
+static void clear_data(ld_parser *p) {
+    p->data.len = 0;
+    p->span = NULL;
+}
+
+/**
+ * @brief Find out, before the first record is read, whether the input
+ * holds binary records rather than LD.
+ * @return false if it does and the parser was asked for something only LD
+ * input supports.
+ */
+static bool detect(ld_parser *p) {
+    if (p->detected) {
+        return true;
+    }
+    p->detected = true;
+    p->binary = ldb_detect(&p->in);
+    p->bin.in = &p->in;
+    if (p->binary && (p->fields != NULL || p->where != NULL)) {
+        fprintf(stderr, "Members cannot be selected from binary input\n");
+        return false;
+    }
+    return true;
+}
+
+static bool emit_value(ld_parser *p, const key_span *key, bool in_array) {
+    debug_enter();
+    ld_value v;
+    memset(&v, 0, sizeof(v));
+    v.type = key->s[0];
+    switch (v.type) {
+        case key_comment:
+        case key_start_obj:
+        case key_end_obj:
+        case key_start_array:
+        case key_end_array:
+            debug_return true;
+        default:
+            break;
+    }
+    if (!in_array) {
+        v.name = key->s + 1;
+        v.name_len = key->len - 1;
+    }
+    v.data = finish_data(p, &v.len);
+    if (v.data == NULL) {
+        if (in_array) {
+            debug_return true;
+        }
+        v.type = key_null;
+        debug_return p->cb.value == NULL || p->cb.value(p->user, &v);
+    }
+    debug("data = \"%.*s\"\n", (int)v.len, v.data);
+    if (p->trust) {
+        v.boolean = v.len > 0 && (v.data[0] | 0x20) == 't';
+        v.num.json = true;
+        v.num.s = v.data;
+        v.num.len = v.len;
+        debug_return p->cb.value == NULL || p->cb.value(p->user, &v);
+    }
+    switch (v.type) {
+        case key_boolean:
+            v.boolean = text_is(v.data, v.len, "true");
+            if (!v.boolean && !text_is(v.data, v.len, "false")) {
+                fprintf(stderr, "Invalid boolean value \"%.*s\" on line %li\n", (int)v.len, v.data, p->line_number);
+                debug_return false;
+            }
+            break;
+        case key_null:
+            if (!text_is(v.data, v.len, "null")) {
+                fprintf(stderr, "Invalid null value \"%.*s\" on line %li\n", (int)v.len, v.data, p->line_number);
+                debug_return false;
+            }
+            break;
+        case key_number: {
+            stats_begin(t);
+            bool ok = number_parse(v.data, v.len, &v.num);
+            stats_end(stats_numbers, t);
+            if (!ok) {
+                fprintf(stderr, "Invalid number value \"%.*s\" on line %li\n", (int)v.len, v.data, p->line_number);
+                debug_return false;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    debug_return p->cb.value == NULL || p->cb.value(p->user, &v);
+}
+
+/**
+ * @brief Add a dotted path to a selection. Empty names are ignored.
+ */
+static bool field_add(field *root, const char *path, size_t len) {
+    field *f = root;
+    const char *end = path + len;
+    while (path < end && !f->all) {
+        const char *dot = memchr(path, '.', end - path);
+        size_t n = dot != NULL ? (size_t)(dot - path) : (size_t)(end - path);
+        if (n > 0) {
+            field *c = (field *)field_find(f, path, n);
+            if (c == NULL) {
+                c = calloc(1, sizeof(*c) + n);
+                if (c == NULL) {
+                    fprintf(stderr, "Memory allocation error\n");
+                    return false;
+                }
+                memcpy(c->name, path, n);
+                c->len = n;
+                c->next = f->child;
+                f->child = c;
+            }
+            f = c;
+        }
+        path += n + 1;
+    }
+    if (f != root && !f->all) {
+        // A path that stops here selects everything below it.
+        f->all = true;
+        field_free(f->child);
+        f->child = NULL;
+    }
+    return true;
+}
+
+static const field *field_find(const field *sel, const char *name, size_t len) {
+    for (const field *f = sel->child; f != NULL; f = f->next) {
+        if (f->len == len && memcmp(f->name, name, len) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static void field_free(field *f) {
+    while (f != NULL) {
+        field *next = f->next;
+        field_free(f->child);
+        free(f);
+        f = next;
+    }
+}
+
+static const char *finish_data(ld_parser *p, size_t *len) {
+    const char *s = p->data.data;
+    size_t n = p->data.len;
+    if (p->span != NULL) {
+        s = p->span;
+        n = p->span_len;
+    }
+    if (n == 0) {
+        return NULL;
+    }
+    while (n > 0 && isspace((unsigned char)s[n - 1])) {
+        n--;
+    }
+    *len = n;
+    return s;
+}
+
+static bool get_key(ld_parser *p, const line_info *l, key_span *key) {
+    debug_enter();
+    debug("parsing key from \"%.*s\"\n", (int)l->len, l->s);
+    const char *s = l->s + l->indent;
+    const char *end = l->s + l->len;
+    if (end - s <= (long)key_type_position) {
+        debug_return false;
+    }
+    s += key_type_position;
+    while (end > s && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    if (s == end) {
+        debug_return false;
+    }
+    debug("key = \"%.*s\"\n", (int)(end - s), s);
+    key->len = end - s;
+    if (p->in.map != NULL) {
+        key->s = s;
+        debug_return true;
+    }
+    // Buffered input is refilled in place, so the key has to outlive the
+    // block it came from.
+    char *k = arena_alloc(&p->keys, key->len);
+    if (k == NULL) {
+        debug_return false;
+    }
+    memcpy(k, s, key->len);
+    key->s = k;
+    debug_return true;
+}
+
+static const line_info *get_line(ld_parser *p) {
+    const line_info *l = lines_next(&p->lines, &p->in, &p->line_pos);
+    if (l != NULL) {
+        p->line_number++;
+        p->offset += l->size;
+    }
+    return l;
+}
+
+/**
+ * @brief Check whether a key names the member of the where condition.
+ */
+static bool is_where(const ld_parser *p, const key_span *key) {
+    return key->len - 1 == p->where_len && memcmp(key->s + 1, p->where, p->where_len) == 0;
+}
+
+/**
+ * @brief Read the key from a key line. While a learned shape is in use, a
+ * line that matches the next key of the shape takes its key from there
+ * without looking at it any further. The key type end, which closes the
+ * container the line is in, has no key to read.
+ */
+static bool key_line(ld_parser *p, const line_info *l, key_span *key, char end) {
+    const char *s = l->s + l->indent;
+    size_t len = l->len - l->indent;
+    if (!p->missed) {
+        if (p->shape_pos < p->known.count) {
+            const shape_key *k = &p->known.keys[p->shape_pos];
+            const char *text = p->known.text.data + k->text;
+            if (k->len == len && memcmp(text, s, len) == 0) {
+                p->shape_pos++;
+                key->s = text + key_type_position;
+                key->len = k->key_len;
+                return k->has_key;
+            }
+        }
+        debug("record leaves its shape on line %li\n", p->line_number);
+        p->missed = true;
+    }
+    bool ok = l->type != end && get_key(p, l, key);
+    if (p->learn > 0 && !p->matching) {
+        shape_add(&p->cur, s, len, key, ok);
+    }
+    return ok;
+}
+
+/**
+ * @brief Parse an array. Objects in it, at any depth of arrays, are given
+ * the selection sel; other elements are all delivered.
+ */
+static bool parse_array(ld_parser *p, const char *name, size_t name_len, const field *sel) {
+    debug_enter();
+    const line_info *l;
+    key_span key;
+    bool have_key = false;
+    bool gather = true;         // the pending value's data is needed
+    unsigned int indent = 0;
+    p->depth++;
+    clear_data(p);
+    if (p->cb.begin != NULL && !p->cb.begin(p->user, name, name_len, key_start_array)) {
+        debug_return unwind(p, key_start_array, '\0');
+    }
+    while ((l = get_line(p)) != NULL) {
+        char type = l->type;
+        debug("line %li = \"%.*s\"\n", p->line_number, (int)l->len, l->s);
+        if (l->key && type != key_escape) {
+            debug("got key \"%.*s\"\n", (int)l->len, l->s);
+            stats_key(type);
+            indent = l->indent;
+            char pending = have_key ? key.s[0] : '\0';
+            if (p->depth == 1) {
+                // The elements of a record that is an array are done with
+                // one at a time; all that is left of the last one is the
+                // type of its value, which is all an element's key gives.
+                // Its keys can go, so that the array is held in no more
+                // memory than its largest element.
+                key.s = &pending;
+                key.len = 1;
+                arena_reset(&p->keys);
+            }
+            key_span next;
+            bool have_next = key_line(p, l, &next, key_end_array);
+            if (have_key) {
+                have_key = false;
+                if (!emit_value(p, &key, true)) {
+                    debug_return unwind(p, key_start_array, type);
+                }
+            }
+            clear_data(p);
+            if (type == key_end_array) {
+                p->depth--;
+                debug_return p->cb.end == NULL || p->cb.end(p->user, key_end_array);
+            }
+            key = next;
+            have_key = have_next;
+            // A string is never checked, so with no one to deliver it to
+            // its lines are not gathered.
+            gather = p->cb.value != NULL || !have_key || key.s[0] != key_string;
+            if (type == key_start_obj || type == key_start_array) {
+                bool ok = type == key_start_obj ? parse_object(p, NULL, 0, sel) : parse_array(p, NULL, 0, sel);
+                if (!ok) {
+                    debug_return unwind(p, key_start_array, '\0');
+                }
+            }
+        } else if (!l->blank && gather && !append_line(p, l, indent)) {
+            debug_return unwind(p, key_start_array, '\0');
+        }
+    }
+    p->depth--;
+    debug_return p->cb.end == NULL || p->cb.end(p->user, key_end_array);
+}
+
+/**
+ * @brief Parse an object, delivering only the members that sel selects, or
+ * all of them when sel is NULL. A member that is not selected is passed
+ * over: its data lines are not gathered, and a container is skipped to its
+ * closing line without its keys being read. The record object also checks
+ * the where condition, which fails the record at the first member that
+ * settles it.
+ */
+static bool parse_object(ld_parser *p, const char *name, size_t name_len, const field *sel) {
+    debug_enter();
+    const line_info *l;
+    key_span key;
+    bool have_key = false;
+    bool emit = true;           // the pending key is selected
+    bool gather = true;         // its data is needed, to emit or to check
+    bool top = p->depth++ == 0 && p->where != NULL;
+    unsigned int indent = 0;
+    clear_data(p);
+    if (p->cb.begin != NULL && !p->cb.begin(p->user, name, name_len, key_start_obj)) {
+        debug_return unwind(p, key_start_obj, '\0');
+    }
+    while ((l = get_line(p)) != NULL) {
+        char type = l->type;
+        debug("line %li = \"%.*s\"\n", p->line_number, (int)l->len, l->s);
+        if (l->key && type != key_escape) {
+            debug("got key \"%.*s\"\n", (int)l->len, l->s);
+            stats_key(type);
+            indent = l->indent;
+            key_span next;
+            bool have_next = key_line(p, l, &next, key_end_obj);
+            if (have_key) {
+                if (key.len == 1) {
+                    fprintf(stderr, "Anonymous value is not allowed on line %li\n", p->line_number);
+                    debug_return unwind(p, key_start_obj, type);
+                }
+                debug("Inserting key \"%.*s\" with datatype %c\n", (int)key.len - 1, key.s + 1, key.s[0]);
+                have_key = false;
+                if (top && is_where(p, &key)) {
+                    size_t len = 0;
+                    const char *v = finish_data(p, &len);
+                    if (len != p->where_value_len || (len > 0 && memcmp(v, p->where + p->where_len, len) != 0)) {
+                        // The line just read may have opened a container or
+                        // closed the record.
+                        char open[2] = { key_start_obj, type };
+                        reject(p, open, type == key_end_obj ? 0 : type == key_start_obj || type == key_start_array ? 2 : 1);
+                        debug_return false;
+                    }
+                    p->where_met = true;
+                }
+                if (emit && !emit_value(p, &key, false)) {
+                    debug_return unwind(p, key_start_obj, type);
+                }
+            }
+            clear_data(p);
+            if (type == key_end_obj) {
+                if (top && !p->where_met) {
+                    reject(p, NULL, 0);
+                    debug_return false;
+                }
+                debug("returning object\n");
+                p->depth--;
+                debug_return p->cb.end == NULL || p->cb.end(p->user, key_end_obj);
+            }
+            key = next;
+            have_key = have_next;
+            const field *f = NULL;
+            emit = true;
+            if (sel != NULL && have_key) {
+                f = field_find(sel, key.s + 1, key.len - 1);
+                emit = f != NULL;
+                if (f != NULL && f->all) {
+                    f = NULL;
+                }
+            }
+            gather = have_key && ((emit && (p->cb.value != NULL || key.s[0] != key_string)) || (top && is_where(p, &key)));
+            if (type == key_start_obj || type == key_start_array) {
+                if (!have_key || key.len == 1) {
+                    fprintf(stderr, "Anonymous value is not allowed on line %li\n", p->line_number);
+                    debug_return unwind(p, key_start_obj, type);
+                }
+                char open[2] = { key_start_obj, type };
+                if (top && is_where(p, &key)) {
+                    reject(p, open, 2);
+                    debug_return false;
+                }
+                if (!emit) {
+                    if (!skip_lines(p, open + 1, 1)) {
+                        debug_return unwind(p, key_start_obj, '\0');
+                    }
+                    continue;
+                }
+                bool ok = type == key_start_obj ? parse_object(p, key.s + 1, key.len - 1, f) : parse_array(p, key.s + 1, key.len - 1, f);
+                if (!ok) {
+                    debug_return unwind(p, key_start_obj, '\0');
+                }
+            }
+        } else if (!l->blank && gather && !append_line(p, l, indent)) {
+            debug_return unwind(p, key_start_obj, '\0');
+        }
+    }
+    fprintf(stderr, "Unexpected EOF on line %li\n", p->line_number);
+    debug_return false;
+}
+
+/**
+ * @brief Fail the record being parsed on its where condition. The types of
+ * the containers still open, outermost first, are kept for skip_lines().
+ * If memory runs out the record just fails.
+ */
+static void reject(ld_parser *p, const char *open, size_t count) {
+    debug("record on line %li does not meet the condition\n", p->record_line);
+    p->skip.len = 0;
+    p->rejected = count == 0 || buffer_append(&p->skip, open, count);
+}
+
+static void shape_add(shape *sh, const char *s, size_t len, const key_span *key, bool has_key) {
+    if (sh->full) {
+        return;
+    }
+    if (sh->count == sh->cap) {
+        size_t cap = sh->cap ? sh->cap * 2 : 64;
+        shape_key *keys = cap <= max_shape_keys ? realloc(sh->keys, cap * sizeof(*keys)) : NULL;
+        if (keys == NULL) {
+            sh->full = true;
+            return;
+        }
+        sh->keys = keys;
+        sh->cap = cap;
+    }
+    shape_key *k = &sh->keys[sh->count];
+    k->text = sh->text.len;
+    k->len = len;
+    k->key_len = has_key ? key->len : 0;
+    k->has_key = has_key;
+    if (!buffer_append(&sh->text, s, len)) {
+        sh->full = true;
+        return;
+    }
+    sh->count++;
+}
+
+/**
+ * @brief Account for a finished record. While learning, the shape is put to
+ * use once p->learn records in a row have had it. A record that leaves the
+ * shape sends the parser back to learning, with the shape as the candidate.
+ * A record skipped on the where condition was not read to its end, and
+ * counts neither way.
+ */
+static void shape_done(ld_parser *p, ld_status st) {
+    bool ok = st == ld_record;
+    if (st == ld_skipped) {
+        if (!p->matching) {
+            p->cur.text.len = p->cur.count = 0;
+            p->cur.full = false;
+        }
+        return;
+    }
+    if (p->matching) {
+        if (ok && !p->missed && p->shape_pos == p->known.count) {
+            return;
+        }
+        debug("shape dropped on line %li\n", p->line_number);
+        p->matching = false;
+        p->streak = 0;
+        return;
+    }
+    if (!ok || p->cur.full) {
+        p->streak = 0;
+    } else if (p->streak > 0 && shape_equal(&p->cur, &p->known)) {
+        p->streak++;
+    } else {
+        shape t = p->known;
+        p->known = p->cur;
+        p->cur = t;
+        p->streak = 1;
+    }
+    if (p->streak >= p->learn) {
+        debug("using shape of %zu keys from line %li\n", p->known.count, p->line_number);
+        p->matching = true;
+    }
+    p->cur.text.len = p->cur.count = 0;
+    p->cur.full = false;
+}
+
+static bool shape_equal(const shape *a, const shape *b) {
+    if (a->type != b->type || a->count != b->count || a->text.len != b->text.len) {
+        return false;
+    }
+    for (size_t i = 0; i < a->count; i++) {
+        if (a->keys[i].len != b->keys[i].len) {
+            return false;
+        }
+    }
+    return memcmp(a->text.data, b->text.data, a->text.len) == 0;
+}
+
+static void shape_free(shape *sh) {
+    free(sh->text.data);
+    free(sh->keys);
+    memset(sh, 0, sizeof(*sh));
+}
+
+/**
+ * @brief Pass over the lines of the containers open, up to and including
+ * the line that closes the outermost one. Only the key type of each line is
+ * looked at. A container closes where the parser would close it: only at
+ * its own closing type, so that a stray one is passed over as well.
+ * @param p Parser.
+ * @param open Types of the open containers, outermost first, added to
+ * those already kept in p->skip.
+ * @param count Number of types in open.
+ * @return false if memory ran out, true otherwise.
+ */
+static bool skip_lines(ld_parser *p, const char *open, size_t count) {
+    const line_info *l;
+    if (count > 0 && !buffer_append(&p->skip, open, count)) {
+        return false;
+    }
+    while (p->skip.len > 0 && (l = get_line(p)) != NULL) {
+        char type = l->type;
+        if (!l->key) {
+            continue;
+        }
+        if (type == key_start_obj || type == key_start_array) {
+            if (!buffer_append(&p->skip, &type, 1)) {
+                return false;
+            }
+        } else if (type == (p->skip.data[p->skip.len - 1] == key_start_obj ? key_end_obj : key_end_array)) {
+            p->skip.len--;
+        }
+    }
+    p->skip.len = 0;
+    return true;
+}
+
+static bool text_is(const char *s, size_t len, const char *word) {
+    return len == strlen(word) && strncasecmp(s, word, len) == 0;
+}
+
+/**
+ * @brief Note, as a failure returns through a container, that it is still
+ * open, so that ld_parser_next() can pass over the rest of the record. The
+ * types are kept in p->skip innermost first.
+ * @param p Parser.
+ * @param open Type of the container the failure returns through.
+ * @param type Type of the key line read last in that container, or '\0'.
+ * That line may have opened a container, which is then open as well, or
+ * closed this one, which then is not.
+ * @return false, the failure being returned.
+ */
+static bool unwind(ld_parser *p, char open, char type) {
+    if (p->rejected) {
+        return false;
+    }
+    if (type == key_start_obj || type == key_start_array) {
+        buffer_append(&p->skip, &type, 1);
+    }
+    if (type != (open == key_start_obj ? key_end_obj : key_end_array)) {
+        buffer_append(&p->skip, &open, 1);
+    }
+    return false;
+}
@@ -0,0 +1,263 @@
+/**
+ * @file ld.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Key markers of the line-delimited format and the libld parser.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _LD_H
+#define _LD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "number.h"
+
+// The key marker can be chosen at build time: make marker='@@:'. Files
+// written with one marker can only be read by tools built with the same one.
+#ifndef key_prefix
+#define key_prefix "~~:"
+#endif
+#define key_start_obj '{'
+#define key_end_obj '}'
+#define key_start_array '['
+#define key_end_array ']'
+#define key_string '$'
+#define key_number '#'
+#define key_boolean '?'
+#define key_null '!'
+#define key_comment '*'
+#define key_escape '\\'
+#define key_type_position (sizeof(key_prefix) - 1)
+
+/**
+ * @brief A scalar value handed to the value callback. Text is not
+ * NUL-terminated. When the parser reads mapped input (a regular file or a
+ * buffer) name and data point into the input; otherwise they point into
+ * memory owned by the parser. Either way they stay valid only until the
+ * callback returns.
+ */
+typedef struct ld_value {
+    char type;              // key type; key_null for a key without data
+    const char *name;       // member name, or NULL inside an array
+    size_t name_len;
+    const char *data;       // value text, or NULL for a key without data
+    size_t len;
+    bool boolean;           // value of a key_boolean
+    number num;             // value of a key_number
+} ld_value;
+
+/**
+ * @brief Event callbacks. Each gets the user pointer given to
+ * ld_parser_new(). Returning false fails the record being parsed. Any
+ * callback may be NULL.
+ */
+typedef struct ld_callbacks {
+    bool (*begin)(void *user, const char *name, size_t name_len, char type);
+    bool (*end)(void *user, char type);
+    bool (*value)(void *user, const ld_value *v);
+} ld_callbacks;
+
+/**
+ * @brief Result of ld_parser_next().
+ */
+typedef enum ld_status {
+    ld_eof,                 // no more records
+    ld_record,              // a record was parsed
+    ld_failed,              // a record was malformed or a callback failed
+    ld_error,               // the input cannot be parsed any further
+    ld_skipped              // a record did not meet the ld_parser_where() condition
+} ld_status;
+
+/**
+ * @brief Parser context. Contexts share no state, so each thread can run
+ * its own.
+ */
+typedef struct ld_parser ld_parser;
+
+/**
+ * @brief Create a parser.
+ * @param cb Callbacks to deliver events to. The struct is copied.
+ * @param user Pointer passed to every callback.
+ * @return The parser, or NULL if memory could not be allocated.
+ */
+extern ld_parser *ld_parser_new(const ld_callbacks *cb, void *user);
+
+/**
+ * @brief Learn the shape of the records: the sequence of key lines, with
+ * their types, names and nesting. Once that many records in a row have had
+ * the same shape, key lines that match it are taken from the learned copy
+ * instead of being read again. A record that leaves the shape is parsed as
+ * usual and learning starts over. Callbacks see the same events either way.
+ * The shape is kept when new input is opened.
+ * @param p Parser.
+ * @param records Number of records in a row that must agree, or 0 to stop
+ * learning.
+ */
+extern void ld_parser_learn(ld_parser *p, unsigned int records);
+
+/**
+ * @brief Deliver only some members of each record. Each path names a member
+ * of the record object, with dots between the names of members of members:
+ * "id,user.name". In an array, a path applies to each object in it. Members
+ * that are not selected get no callbacks, and are passed over without their
+ * values being gathered or checked.
+ * @param p Parser.
+ * @param fields Comma-separated paths, or NULL to deliver every member.
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool ld_parser_fields(ld_parser *p, const char *fields);
+
+/**
+ * @brief Deliver only records that have a top-level member with this name
+ * whose value, with trailing white space removed, is exactly this text.
+ * Any other record is passed over from the point where it fails, and
+ * ld_parser_next() returns ld_skipped for it. Callbacks may already have
+ * been made for the part of the record before that point. Arrays have no
+ * members, so they are always passed over.
+ * @param p Parser.
+ * @param name Member name, or NULL to deliver every record.
+ * @param value Value text to compare against.
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool ld_parser_where(ld_parser *p, const char *name, const char *value);
+
+/**
+ * @brief Trust that values are valid, as in input written by a program and
+ * checked before. Values are then passed on as written: a number's text
+ * is given in num.s with num.json set and nothing else filled in, a
+ * boolean is true if its text starts with t or T, and null values are not
+ * looked at.
+ * @param p Parser.
+ * @param trust true to skip the checks, false to make them again.
+ */
+extern void ld_parser_trust(ld_parser *p, bool trust);
+
+/**
+ * @brief Start parsing a file, closing any input that is already open.
+ * Input that starts with the header of the binary form that ld2json
+ * --emit-bin writes is read as binary records, with the same callbacks;
+ * member selection and seeking are then not available, shapes are not
+ * learned, and record and line numbers count records.
+ * @param p Parser.
+ * @param path File to read, or NULL for stdin.
+ * @return true on success, false if the file could not be opened.
+ */
+extern bool ld_parser_open(ld_parser *p, const char *path);
+
+/**
+ * @brief Read the rest of the open file ahead of the parser, so that parsing
+ * does not wait on storage. See input_async(). Spans then point into the
+ * parser's buffers rather than into a mapping, and the input cannot seek.
+ * @param p Parser opened with ld_parser_open().
+ * @return true on success, false if reading ahead could not be started.
+ */
+extern bool ld_parser_async(ld_parser *p);
+
+/**
+ * @brief Check, without consuming any of it, whether the open input holds
+ * the binary records that ld2json --emit-bin writes.
+ * @param p Parser opened with ld_parser_open().
+ * @return true if the input is binary, false if it is LD.
+ */
+extern bool ld_parser_binary(ld_parser *p);
+
+/**
+ * @brief Keep parsing the open file as it is written, waiting at its end
+ * for more. See input_follow(). Spans then point into the parser's buffers,
+ * and ld_parser_read_time() tells when each record arrived.
+ * @param p Parser opened with ld_parser_open().
+ * @param wait Function to call before the parser waits for input, or NULL.
+ * While it runs, no callback of the parser is under way.
+ * @param user Pointer passed to wait.
+ * @return true on success, false if the input cannot be followed.
+ */
+extern bool ld_parser_follow(ld_parser *p, void (*wait)(void *user), void *user);
+
+/**
+ * @brief Start parsing a block of memory, closing any input that is already
+ * open. The block is not copied and must stay valid until the input is
+ * closed.
+ * @param p Parser.
+ * @param buf Start of the block.
+ * @param len Length of the block.
+ * @param line_number Line number of the first line, for error messages.
+ */
+extern void ld_parser_open_buffer(ld_parser *p, const char *buf, size_t len, long int line_number);
+
+/**
+ * @brief Parse the next record, delivering its events to the callbacks.
+ * Errors are reported on stderr. After ld_failed, the rest of the record
+ * is passed over, and parsing resumes with the record that follows it.
+ * @param p Parser.
+ * @return Status of the record.
+ */
+extern ld_status ld_parser_next(ld_parser *p);
+
+/**
+ * @brief Continue parsing at a byte offset of the input, which must be the
+ * start of a line outside any record, such as a value returned by
+ * ld_parser_offset() after a record. The input must be seekable.
+ * @param p Parser.
+ * @param offset Offset from the start of the input.
+ * @param line_number Number of the line just before the offset.
+ * @return true on success, false if the input cannot seek there.
+ */
+extern bool ld_parser_seek(ld_parser *p, uint64_t offset, long int line_number);
+
+/**
+ * @brief Get the byte offset just past the last line read. After
+ * ld_parser_next() returns a record this is the end of that record.
+ * @param p Parser.
+ * @return Offset from the start of the input.
+ */
+extern uint64_t ld_parser_offset(const ld_parser *p);
+
+/**
+ * @brief Get the number of the line last read.
+ * @param p Parser.
+ * @return Line number.
+ */
+extern long int ld_parser_line(const ld_parser *p);
+
+/**
+ * @brief Get the byte offset of the start line of the last record that
+ * ld_parser_next() returned.
+ * @param p Parser.
+ * @return Offset from the start of the input.
+ */
+extern uint64_t ld_parser_record_offset(const ld_parser *p);
+
+/**
+ * @brief Get the line number of the start line of the last record that
+ * ld_parser_next() returned.
+ * @param p Parser.
+ * @return Line number.
+ */
+extern long int ld_parser_record_line(const ld_parser *p);
+
+/**
+ * @brief Get the time at which the input that ends the last record was
+ * read, on the input_clock() clock. Mapped input is not read, and has no
+ * read times; followed input is never mapped.
+ * @param p Parser.
+ * @return Time in nanoseconds, or 0 for mapped input.
+ */
+extern uint64_t ld_parser_read_time(const ld_parser *p);
+
+/**
+ * @brief Close the input of a parser. The parser can be opened again.
+ * @param p Parser.
+ */
+extern void ld_parser_close(ld_parser *p);
+
+/**
+ * @brief Close the input of a parser and release its memory.
+ * @param p Parser.
+ */
+extern void ld_parser_free(ld_parser *p);
+
+#endif // _LD_H
@@ -8,13 +8,31 @@
  */
 
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <json-c/json.h>
 #include <json-c/json_object.h>
 
+#include "input.h"
+#include "intern.h"
+#include "ld.h"
+#include "ldb.h"
+#include "lines.h"
+#include "output.h"
+#include "stats.h"
+
 #ifdef DEBUG
 static int indent_level = 0;
 static char *indent_string = "                                                                                ";
@@ -29,464 +47,2098 @@ static char *indent_string = "
 #define debug_return return
 #endif
 
-#define max_line_len 65536
-#define key_prefix "~~:"
-#define key_start_obj '{'
-#define key_end_obj '}'
-#define key_start_array '['
-#define key_end_array ']'
-#define key_string '$'
-#define key_number '#'
-#define key_boolean '?'
-#define key_null '!'
-#define key_comment '*'
-#define key_escape '\\'
-#define key_type_position (sizeof(key_prefix) - 1)
-
-static FILE *fp = NULL;
-static long int line_number = 0;
+#define min_data_len 4096
+#define chunk_len (1024 * 1024)
+#define checkpoint_len (64 * 1024 * 1024)
+
+/**
+ * @brief A point between two top-level records: the input offset and line
+ * number after the record and the amount of output written up to it.
+ */
+typedef struct checkpoint {
+    uint64_t input;
+    long int line_number;
+    uint64_t output;
+} checkpoint;
+
+typedef struct data_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} data_buffer;
+
+typedef struct writer {
+    ld_parser *ld;
+    output out;
+    data_buffer nest;
+    data_buffer text;
+    data_buffer first;      // value of the record's first member, for the index
+    intern_table keys;      // member names seen so far, kept across records
+    size_t depth;
+    bool first_done;
+    size_t record_start;
+    uint64_t record_written; // out.written when the record began
+    bool split;             // the record is a top-level array, written element by element
+    size_t elements;        // elements of the split array written so far
+    size_t element_start;   // output length after the last complete element
+    json_object *element;   // element being built when split in DOM mode
+    size_t failed;          // records that failed to parse
+    uint64_t *pending;      // read times of records not yet written out, with --follow
+    size_t pending_count;
+    size_t pending_cap;
+    uint32_t *bin_ref;      // binary name number + 1 of each interned name, or 0
+    uint32_t *bin_names;    // interned names in the order they were defined
+    size_t bin_count;       // names defined since the last binary header
+    size_t bin_record_count; // bin_count when the record began
+    json_object *dom_root;
+    json_object **dom_stack;
+    size_t dom_depth;
+    size_t dom_cap;
+} writer;
+
+typedef struct record_span {
+    size_t offset;
+    size_t len;
+    long int line_number;
+    uint64_t start;         // offset of the record in the input
+} record_span;
+
+typedef struct chunk {
+    data_buffer text;
+    const char *base;
+    record_span *records;
+    size_t count;
+    size_t cap;
+    uint64_t end_offset;
+    long int end_line;
+    output out;
+    output index;
+    bool done;
+} chunk;
+
+typedef struct scanner {
+    input *in;
+    line_index lines;
+    size_t line_pos;
+    long int line_number;
+    uint64_t offset;
+    bool in_comment;
+    data_buffer stack;
+} scanner;
+
+/**
+ * @brief Where a top-level record starts, as listed in an .ldx index.
+ */
+typedef struct index_entry {
+    uint64_t offset;
+    long int line_number;
+} index_entry;
+
+/**
+ * @brief Reads an .ldx index front to back. The entry after the one last
+ * returned is always read ahead, so that the end of each record is known.
+ */
+typedef struct index_reader {
+    input in;
+    index_entry next;
+    bool have_next;
+    uint64_t number;        // record number of next, counting from 1
+    size_t range;           // first of ranges that next can still fall in
+} index_reader;
+
+/**
+ * @brief One input of a batch run. When the outputs are concatenated, the
+ * converted file is held in out until every file before it is written.
+ */
+typedef struct batch_file {
+    char *path;
+    uint64_t size;
+    output out;
+    bool done;
+    bool failed;
+} batch_file;
+
+/**
+ * @brief Records first through last (counting from 1) of a -r list.
+ */
+typedef struct record_range {
+    uint64_t first;
+    uint64_t last;
+} record_range;
+
+static bool opt_async = false;
+static size_t opt_buffer_len = 0;
+static const char *opt_checkpoint = NULL;
+static bool opt_dom = false;
+static bool opt_emit_bin = false;
+static const char *opt_fields = NULL;
+static long int opt_flush_ms = 0;
+static bool opt_follow = false;
+static const char *opt_index = NULL;
+static const char *opt_index_out = NULL;
+static int opt_jobs = 1;
+static unsigned int opt_learn = 0;
+static const char *opt_list = NULL;
+static bool opt_numbers = false;
+static const char *opt_output_dir = NULL;
 static bool opt_pretty = false;
+static bool opt_resume = false;
+static bool opt_stats = false;
+static bool opt_stream = true;
+static bool opt_trust = false;
+static bool opt_validate = false;
+static const char *opt_where = NULL;
+static const char *opt_where_value = NULL;
+static codec_kind opt_compress = codec_none;
+static checkpoint last_checkpoint;
+static output index_out;
+static record_range *ranges = NULL;
+static size_t range_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static chunk *chunks = NULL;
+static size_t chunk_slots = 0;
+static size_t chunks_filled = 0;
+static size_t chunks_taken = 0;
+static bool pool_finished = false;
+static size_t records_failed = 0;      // by worker threads that have finished
+static batch_file *batch = NULL;
+static size_t batch_count = 0;
+static size_t batch_cap = 0;
+static size_t batch_taken = 0;
+static size_t batch_written = 0;
+static bool batch_expanded = false;   // a directory was named, so the run is a batch
 
-static char *get_key(char *line);
-static char *get_line(void);
-static void insert_key_value(json_object *obj, char *key, json_object *value);
-static bool is_blank(char *line);
-static bool is_real(const char *s);
-static void output_object(json_object *obj);
-static json_object *parse_array(void);
-static json_object *parse_object(void);
-static bool valid_number(const char *s);
+static bool batch_add(const char *path);
+static int batch_by_path(const void *a, const void *b);
+static int batch_by_size(const void *a, const void *b);
+static bool batch_convert(writer *w, batch_file *f);
+static void batch_free(void);
+static bool batch_list(const char *path);
+static char *batch_output_path(const char *path);
+static bool batch_push(const char *path, uint64_t size);
+static int batch_run(output *out);
+static void *batch_worker(void *arg);
+static bool bin_emit_begin(void *user, const char *name, size_t name_len, char type);
+static bool bin_emit_end(void *user, char type);
+static bool bin_emit_value(void *user, const ld_value *v);
+static bool bin_finish(writer *w);
+static void bin_forget(writer *w, size_t count);
+static bool bin_header(writer *w);
+static bool bin_name(writer *w, const char *name, size_t len);
+static bool bin_varint(output *o, uint64_t v);
+static bool buffer_append(data_buffer *b, const char *s, size_t l);
+static void checkpoint_maybe(output *out, uint64_t offset, long int line_number, bool force);
+static bool checkpoint_read(const char *path, checkpoint *ck);
+static bool checkpoint_write(const char *path, const checkpoint *ck);
+static int convert(writer *w, index_reader *ix);
+static void convert_chunk(writer *w, chunk *c);
+static int convert_parallel(input *in, output *out, index_reader *ix);
+static bool dom_add(writer *w, const char *name, size_t name_len, json_object *value);
+static bool dom_begin(writer *w, const char *name, size_t name_len, char type);
+static bool dom_emit_begin(void *user, const char *name, size_t name_len, char type);
+static bool dom_emit_end(void *user, char type);
+static bool dom_emit_value(void *user, const ld_value *v);
+static bool dom_value(writer *w, const ld_value *v);
+static bool element_done(writer *w, bool stream);
+static void element_write(writer *w, json_object *obj);
+static inline bool emit_begin(writer *w, const char *name, size_t name_len, char type, bool stream);
+static inline bool emit_end(writer *w, char type, bool stream);
+static inline bool emit_value(writer *w, const ld_value *v, bool stream);
+static bool follow_flush(writer *w);
+static void follow_record(writer *w, ld_status st);
+static void follow_stop(int sig);
+static void follow_wait(void *user);
+static int format_double(char *buf, size_t size, double d);
+static bool has_suffix(const char *s, size_t len, const char *suffix);
+static void index_add(output *o, uint64_t offset, long int line_number, const data_buffer *first);
+static int index_chunk(index_reader *ix, input *in, chunk *c);
+static bool index_open(index_reader *ix, const char *path);
+static bool index_read(index_reader *ix);
+static int index_select(index_reader *ix, index_entry *e, uint64_t *number);
+static bool keep_first(writer *w, const ld_value *v);
+static bool out_member(writer *w, const char *name, size_t name_len);
+static bool output_object(writer *w, json_object *obj);
+static bool parse_ranges(const char *s);
+static const char *parse_u64(const char *s, const char *e, uint64_t *v);
+static void record_abort(writer *w);
+static void record_close(writer *w);
+static void record_done(writer *w, ld_status st, output *index, uint64_t offset, long int line_number);
+static bool record_finish(writer *w);
+static bool record_push(chunk *c, size_t offset, long int line_number, uint64_t start);
+static bool resume(input *in, writer *w);
+static int scan_chunk(scanner *s, chunk *c);
+static bool stream_emit_begin(void *user, const char *name, size_t name_len, char type);
+static bool stream_emit_end(void *user, char type);
+static bool stream_emit_value(void *user, const ld_value *v);
+static bool stream_value(writer *w, const ld_value *v);
+static const char *terminate(writer *w, const char *s, size_t len);
+static void *worker(void *arg);
+static size_t write_chunks(output *out, size_t written, bool drain);
+static void writer_free(writer *w);
+static bool writer_init(writer *w);
+
+// The output flavor is fixed for the whole run, so each flavor gets its own
+// copy of the callbacks with the choice made at compile time.
+static const ld_callbacks bin_callbacks = { bin_emit_begin, bin_emit_end, bin_emit_value };
+static const ld_callbacks dom_callbacks = { dom_emit_begin, dom_emit_end, dom_emit_value };
+static const ld_callbacks stream_callbacks = { stream_emit_begin, stream_emit_end, stream_emit_value };
+static const ld_callbacks no_callbacks = { NULL, NULL, NULL };
 
 int main(int ac, char **av) {
     debug_enter();
-    char *line;
-    bool in_comment = false;
-    fp = stdin;
+    const char *path = NULL;
+    input in;
+    writer w;
+    index_reader ix;
+    int index_fd = -1;
+    bool opened;
+    bool jobs_given = false;
+    bool batched;
+    int r;
     for (int i = 1; i < ac; i++) {
-        if (strcmp(av[i], "-p") == 0) {
+        if (strcmp(av[i], "-a") == 0) {
+            opt_async = true;
+        } else if (strcmp(av[i], "-b") == 0 && i + 1 < ac) {
+            long n = atol(av[++i]);
+            if (n < 1) {
+                fprintf(stderr, "Invalid buffer size \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+            opt_buffer_len = n;
+        } else if (strcmp(av[i], "-c") == 0 && i + 1 < ac) {
+            opt_checkpoint = av[++i];
+        } else if (strcmp(av[i], "-d") == 0) {
+            opt_dom = true;
+        } else if (strcmp(av[i], "-f") == 0 && i + 1 < ac) {
+            opt_list = av[++i];
+        } else if (strcmp(av[i], "-i") == 0 && i + 1 < ac) {
+            opt_index = av[++i];
+        } else if (strcmp(av[i], "-j") == 0 && i + 1 < ac) {
+            opt_jobs = atoi(av[++i]);
+            if (opt_jobs < 1) {
+                fprintf(stderr, "Invalid job count \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+            jobs_given = true;
+        } else if (strcmp(av[i], "-l") == 0 && i + 1 < ac) {
+            int n = atoi(av[++i]);
+            if (n < 1) {
+                fprintf(stderr, "Invalid record count \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+            opt_learn = n;
+        } else if (strcmp(av[i], "-n") == 0) {
+            opt_numbers = true;
+        } else if (strcmp(av[i], "-o") == 0 && i + 1 < ac) {
+            opt_output_dir = av[++i];
+        } else if (strcmp(av[i], "-p") == 0) {
             opt_pretty = true;
+        } else if (strcmp(av[i], "-r") == 0 && i + 1 < ac) {
+            if (!parse_ranges(av[++i])) {
+                fprintf(stderr, "Invalid record list \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+        } else if (strcmp(av[i], "-x") == 0 && i + 1 < ac) {
+            opt_index_out = av[++i];
+        } else if (strcmp(av[i], "-z") == 0 && i + 1 < ac) {
+            i++;
+            if (strcmp(av[i], "gzip") == 0) {
+                opt_compress = codec_gzip;
+            } else if (strcmp(av[i], "zstd") == 0) {
+                opt_compress = codec_zstd;
+            } else {
+                fprintf(stderr, "Unknown compression \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+        } else if (strcmp(av[i], "--emit-bin") == 0) {
+            opt_emit_bin = true;
+        } else if (strcmp(av[i], "--fields") == 0 && i + 1 < ac) {
+            opt_fields = av[++i];
+        } else if (strcmp(av[i], "--flush-ms") == 0 && i + 1 < ac) {
+            opt_flush_ms = atol(av[++i]);
+            if (opt_flush_ms < 1) {
+                fprintf(stderr, "Invalid flush interval \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+        } else if (strcmp(av[i], "--follow") == 0) {
+            opt_follow = true;
+        } else if (strcmp(av[i], "--resume") == 0) {
+            opt_resume = true;
+        } else if (strcmp(av[i], "--stats") == 0) {
+            opt_stats = true;
+        } else if (strcmp(av[i], "--trust-input") == 0) {
+            opt_trust = true;
+        } else if (strcmp(av[i], "--validate-only") == 0) {
+            opt_validate = true;
+        } else if (strcmp(av[i], "--where") == 0 && i + 1 < ac) {
+            char *eq = strchr(av[++i], '=');
+            if (eq == NULL || eq == av[i]) {
+                fprintf(stderr, "Invalid condition \"%s\"\n", av[i]);
+                debug_return 1;
+            }
+            *eq = '\0';
+            opt_where = av[i];
+            opt_where_value = eq + 1;
         } else if (strcmp(av[i], "-h") == 0) {
-            fprintf(stderr, "Usage: %s [-p] [file]\n", av[0]);
+            fprintf(stderr, "Usage: %s [-a] [-b bytes] [-c file [--resume]] [-d] [-f list] [-i index [-r records]] [-j jobs] [-l records] [-n] [-o dir] [-p] [-x index] [-z gzip|zstd] [--emit-bin] [--fields list] [--follow [--flush-ms ms]] [--stats] [--trust-input | --validate-only] [--where key=value] [file...]\n", av[0]);
+            fprintf(stderr, "-a ..... Read input ahead and write output behind conversion\n");
+            fprintf(stderr, "-b ..... Output buffer size\n");
+            fprintf(stderr, "-c ..... Write a checkpoint to this file every 64 MiB of input\n");
+            fprintf(stderr, "-d ..... Build a json-c object for each record before output\n");
+            fprintf(stderr, "-f ..... Also convert the files listed in this file, one per line (- for stdin)\n");
+            fprintf(stderr, "-i ..... Find records through this index instead of scanning for them\n");
+            fprintf(stderr, "-j ..... Convert records, or files of a batch, on this many threads\n");
+            fprintf(stderr, "-l ..... Learn the record shape from this many records in a row\n");
+            fprintf(stderr, "-n ..... Copy numbers that are valid JSON through as written\n");
+            fprintf(stderr, "-o ..... Write each file of a batch to its own output in this directory\n");
             fprintf(stderr, "-p ..... Pretty print output\n");
-            fprintf(stderr, "file ... Input file\n");
+            fprintf(stderr, "-r ..... Convert only these records, such as 1-100,250,1000-\n");
+            fprintf(stderr, "-x ..... Write an index of the input records to this file\n");
+            fprintf(stderr, "-z ..... Compress output with gzip or zstd\n");
+            fprintf(stderr, "--emit-bin Write parsed records in binary form instead of JSON\n");
+            fprintf(stderr, "--fields Convert only these members, such as id,user.name\n");
+            fprintf(stderr, "--flush-ms Write output once the oldest record in it has waited this long\n");
+            fprintf(stderr, "--follow Write each record as soon as it is read, and wait for the file to grow\n");
+            fprintf(stderr, "--resume Continue from the checkpoint, appending to output\n");
+            fprintf(stderr, "--stats  Print time per phase and counters to stderr as JSON\n");
+            fprintf(stderr, "--trust-input   Copy values through as written, without checking them\n");
+            fprintf(stderr, "--validate-only Check the input and write nothing; exit 1 if a record is invalid\n");
+            fprintf(stderr, "--where  Convert only records with this top-level member value: key=value\n");
+            fprintf(stderr, "file ... Input files or directories; more than one makes a batch\n");
             debug_return 0;
-        } else if (fp == stdin) {
-            fp = fopen(av[i], "r");
-            if (fp == NULL) {
-                fprintf(stderr, "Unable to open file \"%s\"\n", av[i]);
-                debug_return 1;
-            }
+        } else if (!batch_add(av[i])) {
+            debug_return 1;
         }
     }
-    while ((line = get_line()) != NULL) {
-        debug("read line %li: \"%s\"\n", line_number, line);
-        char *lp = line;
-        while (*lp == ' ') {
-            lp++;
-        }
-        if (strncmp(lp, key_prefix, key_type_position - 1) == 0) {
-            debug("lp[key_type_position] = %c\n", lp[key_type_position]);
-            if (lp[key_type_position] == key_start_obj) {
-                debug("got object\n");
-                in_comment = false;
-                json_object *object = parse_object();
-                output_object(object);
-                json_object_put(object);
-            } else if (lp[key_type_position] == key_start_array) {
-                debug("got array\n");
-                in_comment = false;
-                json_object *array = parse_array();
-                output_object(array);
-                json_object_put(array);
-            } else if (lp[key_type_position] == key_comment) {
-                debug("got comment\n");
-                in_comment = true;
-            } else if (!in_comment) {
-                fprintf(stderr, "Invalid key type: \"%s\" on line %li\n", lp, line_number);
-                debug_return 1;
-            }
+    if (opt_list != NULL && !batch_list(opt_list)) {
+        debug_return 1;
+    }
+    batched = opt_list != NULL || opt_output_dir != NULL || batch_count > 1 || batch_expanded;
+    if (batched && (opt_checkpoint != NULL || opt_index != NULL || opt_index_out != NULL)) {
+        fprintf(stderr, "-c, -i and -x need a single input file\n");
+        debug_return 1;
+    }
+    path = batch_count > 0 ? batch[0].path : NULL;
+    if (opt_flush_ms > 0 && !opt_follow) {
+        fprintf(stderr, "--flush-ms needs --follow\n");
+        debug_return 1;
+    }
+    if (opt_follow && (batched || opt_async || opt_index != NULL || opt_jobs > 1 || opt_compress != codec_none)) {
+        fprintf(stderr, "--follow cannot be combined with -a, -i, -j, -z or a batch\n");
+        debug_return 1;
+    }
+    if (opt_resume && opt_checkpoint == NULL) {
+        fprintf(stderr, "--resume needs a checkpoint file (-c)\n");
+        debug_return 1;
+    }
+    if (range_count > 0 && opt_index == NULL) {
+        fprintf(stderr, "-r needs an index (-i)\n");
+        debug_return 1;
+    }
+    if (opt_index != NULL && opt_checkpoint != NULL) {
+        fprintf(stderr, "-i cannot be combined with -c\n");
+        debug_return 1;
+    }
+    if (opt_compress != codec_none && opt_checkpoint != NULL) {
+        fprintf(stderr, "-z cannot be combined with -c\n");
+        debug_return 1;
+    }
+    if (opt_async && (opt_checkpoint != NULL || opt_index != NULL)) {
+        fprintf(stderr, "-a cannot be combined with -c or -i\n");
+        debug_return 1;
+    }
+    if (opt_validate && (opt_trust || opt_fields != NULL || opt_where != NULL || opt_checkpoint != NULL || opt_output_dir != NULL || opt_index_out != NULL || opt_compress != codec_none)) {
+        fprintf(stderr, "--validate-only cannot be combined with -c, -o, -x, -z, --fields, --where or --trust-input\n");
+        debug_return 1;
+    }
+    if (opt_emit_bin && (opt_dom || opt_pretty || opt_trust || opt_validate)) {
+        fprintf(stderr, "--emit-bin cannot be combined with -d, -p, --trust-input or --validate-only\n");
+        debug_return 1;
+    }
+    if (opt_index_out != NULL && opt_resume) {
+        fprintf(stderr, "-x cannot be combined with --resume\n");
+        debug_return 1;
+    }
+    if (opt_index != NULL && !index_open(&ix, opt_index)) {
+        debug_return 1;
+    }
+    if (opt_index_out != NULL) {
+        index_fd = open(opt_index_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (index_fd < 0) {
+            fprintf(stderr, "Unable to open index \"%s\": %s\n", opt_index_out, strerror(errno));
+            debug_return 1;
         }
+        output_open(&index_out, index_fd, opt_buffer_len);
+        output_append(&index_out, "# ldx 1\n", 8);
     }
-    debug_return 0;
+    opt_stream = !opt_dom && !opt_pretty;
+    // Trusted numbers carry only their text, so they are always copied.
+    opt_numbers = opt_numbers || opt_trust;
+    if (opt_stats) {
+        stats_start();
+    }
+    if (batched) {
+        if (!jobs_given) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            opt_jobs = n > 1 ? n : 1;
+        }
+        if (opt_async && opt_compress == codec_none) {
+            opt_compress = codec_copy;
+        }
+        // Each file of a batch written to a directory is compressed on its
+        // own; a single output is compressed as a whole.
+        output_open(&w.out, STDOUT_FILENO, opt_buffer_len);
+        if (opt_output_dir == NULL && opt_compress != codec_none && !output_compress(&w.out, opt_compress)) {
+            r = 1;
+        } else {
+            r = batch_run(&w.out);
+        }
+        if (!output_close(&w.out)) {
+            r = 1;
+        }
+        batch_free();
+        free(ranges);
+        if (opt_stats) {
+            stats_print("ld2json");
+        }
+        debug_return r;
+    }
+    if (!writer_init(&w)) {
+        debug_return 1;
+    }
+    // The parallel path splits the input into records itself and gives
+    // each worker a parser of its own.
+    opened = opt_jobs > 1 ? input_open(&in, path) : ld_parser_open(w.ld, path);
+    if (!opened) {
+        fprintf(stderr, "Unable to open file \"%s\"\n", path);
+        writer_free(&w);
+        debug_return 1;
+    }
+    // Binary input cannot seek, so an index or checkpoint of it could never
+    // be used.
+    if ((opt_checkpoint != NULL || opt_index != NULL || opt_index_out != NULL) && (opt_jobs > 1 ? ldb_detect(&in) : ld_parser_binary(w.ld))) {
+        fprintf(stderr, "-c, -i and -x need LD input; binary input cannot seek\n");
+        if (opt_jobs > 1) {
+            input_close(&in);
+        }
+        if (opt_index != NULL) {
+            input_close(&ix.in);
+        }
+        if (index_fd >= 0) {
+            output_close(&index_out);
+            close(index_fd);
+            unlink(opt_index_out);
+        }
+        writer_free(&w);
+        debug_return 1;
+    }
+    if (opt_async && !(opt_jobs > 1 ? input_async(&in) : ld_parser_async(w.ld))) {
+        if (opt_jobs > 1) {
+            input_close(&in);
+        }
+        writer_free(&w);
+        debug_return 1;
+    }
+    if (opt_follow) {
+        if (!ld_parser_follow(w.ld, follow_wait, &w)) {
+            writer_free(&w);
+            debug_return 1;
+        }
+        // Without SA_RESTART a signal also ends a wait for input, so the
+        // run finishes normally and --stats is still printed.
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = follow_stop;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
+    if (opt_async && opt_compress == codec_none) {
+        opt_compress = codec_copy;
+    }
+    output_open(&w.out, STDOUT_FILENO, opt_buffer_len);
+    if (opt_compress != codec_none && !output_compress(&w.out, opt_compress)) {
+        r = 1;
+    } else if (opt_resume && !resume(&in, &w)) {
+        r = 1;
+    } else if (opt_jobs > 1) {
+        r = convert_parallel(&in, &w.out, opt_index != NULL ? &ix : NULL);
+    } else {
+        r = convert(&w, opt_index != NULL ? &ix : NULL);
+    }
+    // Dropped records are data lost, however many threads dropped them.
+    if (w.failed > 0 || records_failed > 0) {
+        r = 1;
+    }
+    if (opt_jobs > 1) {
+        input_close(&in);
+    }
+    if (!output_close(&w.out)) {
+        r = 1;
+    }
+    if (opt_index != NULL) {
+        input_close(&ix.in);
+    }
+    if (index_fd >= 0) {
+        if (!output_close(&index_out)) {
+            fprintf(stderr, "Unable to write index \"%s\": %s\n", opt_index_out, strerror(errno));
+            r = 1;
+        }
+        close(index_fd);
+    }
+    free(ranges);
+    batch_free();
+    writer_free(&w);
+    if (opt_stats) {
+        stats_print("ld2json");
+    }
+    debug_return r;
 }
 
-static char *get_key(char *line) {
+/**
+ * @brief Add an input to the batch. A directory adds the regular files in
+ * it, in name order, leaving out those whose names start with a dot.
+ */
+static bool batch_add(const char *path) {
     debug_enter();
-    debug("parsing key from \"%s\"\n", line);
-    char *k;
-    char *s = line ;
-    while (*s == ' ') {
-        s++;
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        // A path that cannot be read fails when it is opened, with the
+        // rest of the batch converted regardless.
+        debug_return batch_push(path, 0);
     }
-    if (*s == '\0') {
-        debug_return NULL;
+    if (!S_ISDIR(st.st_mode)) {
+        debug_return batch_push(path, S_ISREG(st.st_mode) ? st.st_size : 0);
     }
-    s += key_type_position;
-    char *e = s + strlen(s) - 1;
-    while (e >= s && isspace(*e)) {
-        *e-- = '\0';
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        fprintf(stderr, "Unable to read directory \"%s\": %s\n", path, strerror(errno));
+        debug_return false;
     }
-    if (*s == '\0') {
-        debug_return NULL;
+    batch_expanded = true;
+    size_t first = batch_count;
+    size_t dir_len = strlen(path);
+    bool ok = true;
+    struct dirent *e;
+    while (ok && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        size_t len = dir_len + strlen(e->d_name) + 2;
+        char *name = malloc(len);
+        if (name == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            ok = false;
+            break;
+        }
+        snprintf(name, len, "%s/%s", path, e->d_name);
+        if (stat(name, &st) == 0 && S_ISREG(st.st_mode)) {
+            ok = batch_push(name, st.st_size);
+        }
+        free(name);
     }
-    debug("key = \"%s\"\n", s);
-    k = strdup(s);
-    if (k == NULL) {
-        fprintf(stderr, "Memory allocation error on line %li\n", line_number);
-        debug_return NULL;
+    closedir(d);
+    if (ok) {
+        qsort(batch + first, batch_count - first, sizeof(*batch), batch_by_path);
     }
-    debug_return k;
+    debug_return ok;
 }
 
-static char *get_line(void) {
-    static char line[max_line_len];
-    char *r = fgets(line, max_line_len, fp);
-    if (r == NULL) {
-        return NULL;
-    }
-    char *lp = line + strlen(line) - 1;
-    while (lp >= line && (*lp == '\n' || *lp == '\r')) {
-        *lp-- = '\0';
-    }
-    line_number++;
-    return r;
+static int batch_by_path(const void *a, const void *b) {
+    return strcmp(((const batch_file *)a)->path, ((const batch_file *)b)->path);
+}
+
+/**
+ * @brief Order batch files largest first, so that no large file is left to
+ * start after the small ones are done.
+ */
+static int batch_by_size(const void *a, const void *b) {
+    const batch_file *fa = a;
+    const batch_file *fb = b;
+    return fa->size < fb->size ? 1 : fa->size > fb->size ? -1 : 0;
 }
-            
-static void insert_key_value(json_object *obj, char *key, json_object *value) {
+
+/**
+ * @brief Convert one file of a batch, to its own output when there is an
+ * output directory and to f->out otherwise.
+ * @return true if the file converted without error.
+ */
+static bool batch_convert(writer *w, batch_file *f) {
     debug_enter();
-    if (key != NULL) {
-        key++;
-        debug("adding key \"%s\" value %s\n", key, json_object_to_json_string(value));
-        json_object_object_add(obj, key, value);
+    int fd = -1;
+    if (!ld_parser_open(w->ld, f->path)) {
+        fprintf(stderr, "Unable to open file \"%s\"\n", f->path);
+        debug_return false;
+    }
+    if (opt_async && !ld_parser_async(w->ld)) {
+        ld_parser_close(w->ld);
+        debug_return false;
+    }
+    if (opt_output_dir != NULL) {
+        char *name = batch_output_path(f->path);
+        if (name != NULL) {
+            fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                fprintf(stderr, "Unable to open output \"%s\": %s\n", name, strerror(errno));
+            }
+            free(name);
+        }
+        if (fd < 0) {
+            ld_parser_close(w->ld);
+            debug_return false;
+        }
+    }
+    output_open(&w->out, fd, fd >= 0 ? opt_buffer_len : 0);
+    size_t failed = w->failed;
+    bool ok = fd < 0 || opt_compress == codec_none || output_compress(&w->out, opt_compress);
+    if (ok && convert(w, NULL) != 0) {
+        fprintf(stderr, "Unable to convert \"%s\"\n", f->path);
+        ok = false;
+    } else if (ok && w->failed != failed) {
+        fprintf(stderr, "Invalid records in \"%s\"\n", f->path);
+        ok = false;
+    }
+    ld_parser_close(w->ld);
+    if (fd >= 0) {
+        if (!output_close(&w->out)) {
+            fprintf(stderr, "Unable to write output for \"%s\"\n", f->path);
+            ok = false;
+        }
+        close(fd);
     } else {
-        fprintf(stderr, "Key is NULL on line %li\n", line_number);
+        f->out = w->out;
     }
-    debug_return;
+    memset(&w->out, 0, sizeof(w->out));
+    if (!ok) {
+        // A parse error leaves the writer partway into a record, which the
+        // next file must not carry on from.
+        json_object_put(w->element);
+        w->element = NULL;
+        json_object_put(w->dom_root);
+        w->dom_root = NULL;
+        w->dom_depth = 0;
+        w->nest.len = 0;
+        w->first.len = 0;
+        w->first_done = false;
+        w->depth = 0;
+        w->split = false;
+        w->elements = 0;
+    }
+    debug_return ok;
 }
 
-static bool is_blank(char *line) {
-    char *s = line;
-    while (*s != '\0' && isspace(*s)) {
-        s++;
-    }
-    if (*s == '\0') {
-        return true;
+static void batch_free(void) {
+    for (size_t i = 0; i < batch_count; i++) {
+        free(batch[i].path);
+        free(batch[i].out.data);
     }
-    return false;
+    free(batch);
+    batch = NULL;
+    batch_count = batch_cap = 0;
 }
 
-static bool is_real(const char *s) {
-    const char *p = s;
-    bool have_dec = false;
-    while (*p != '\0') {
-        if (*p == '.') {
-            have_dec = true;
+/**
+ * @brief Add the files named in a list, one per line, to the batch.
+ * @param path List file, or "-" for stdin.
+ */
+static bool batch_list(const char *path) {
+    debug_enter();
+    input in;
+    if (!input_open(&in, strcmp(path, "-") == 0 ? NULL : path)) {
+        fprintf(stderr, "Unable to open file list \"%s\"\n", path);
+        debug_return false;
+    }
+    bool ok = true;
+    const char *s;
+    size_t len;
+    while (ok && (s = input_get_line(&in, &len)) != NULL) {
+        while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r')) {
+            len--;
         }
-        if (have_dec && isdigit(*p)) {
-            if (*p > '0') {
-                return true;
-            }
+        if (len == 0) {
+            continue;
         }
-        p++;
+        char *name = strndup(s, len);
+        if (name == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            ok = false;
+            break;
+        }
+        ok = batch_add(name);
+        free(name);
     }
-    return false;
+    input_close(&in);
+    debug_return ok;
 }
 
-static void output_object(json_object *obj) {
-    if (obj != NULL) {
-        if (opt_pretty) {
-            char *t = "\n";
-            if (json_object_get_type(obj) == json_type_object) {
-                t = ",\n";
-            }
-            printf("%s%s", json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PRETTY), t);
-        } else {
-            printf("%s\n", json_object_to_json_string(obj));
+/**
+ * @brief Name the output for a batch file: the file's base name in the
+ * output directory, with a .ld extension and any compression extension
+ * replaced by .jsonl (.json with -p) and the extension of -z.
+ * @return Allocated name, or NULL if memory ran out.
+ */
+static char *batch_output_path(const char *path) {
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    size_t len = strlen(base);
+    if (has_suffix(base, len, ".gz")) {
+        len -= 3;
+    } else if (has_suffix(base, len, ".zst")) {
+        len -= 4;
+    }
+    if (has_suffix(base, len, ".ld")) {
+        len -= 3;
+    } else if (has_suffix(base, len, ".ldb")) {
+        len -= 4;
+    }
+    const char *ext = opt_emit_bin ? ".ldb" : opt_pretty ? ".json" : ".jsonl";
+    const char *zext = opt_compress == codec_gzip ? ".gz" : opt_compress == codec_zstd ? ".zst" : "";
+    size_t size = strlen(opt_output_dir) + len + strlen(ext) + strlen(zext) + 2;
+    char *name = malloc(size);
+    if (name == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return NULL;
+    }
+    snprintf(name, size, "%s/%.*s%s%s", opt_output_dir, (int)len, base, ext, zext);
+    return name;
+}
+
+static bool batch_push(const char *path, uint64_t size) {
+    if (batch_count == batch_cap) {
+        size_t cap = batch_cap ? batch_cap * 2 : 64;
+        batch_file *b = realloc(batch, cap * sizeof(*b));
+        if (b == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return false;
         }
+        batch = b;
+        batch_cap = cap;
+    }
+    batch_file *f = &batch[batch_count];
+    memset(f, 0, sizeof(*f));
+    f->path = strdup(path);
+    f->size = size;
+    if (f->path == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return false;
     }
+    batch_count++;
+    return true;
 }
 
-static json_object *parse_array(void) {
+/**
+ * @brief Convert every file of the batch on opt_jobs threads. Each idle
+ * thread takes the next file not yet claimed, so a thread held up by a
+ * large file leaves the rest to the others. A single output is written in
+ * input order, at most chunk_slots files ahead of the one being written.
+ * @return 0 if every file converted, 1 otherwise.
+ */
+static int batch_run(output *out) {
     debug_enter();
-    json_object *array = json_object_new_array();
-    json_object *value = NULL;
-    char *line = NULL;
-    char *data = NULL;
-    const char *key = NULL;
-    int indent = 0;
-    while ((line = get_line()) != NULL) {
-        char *lp = line;
-        while (*lp == ' ') {
-            lp++;
-        }
-        debug("line %li = \"%s\"\n", line_number, lp);
-        if (strncmp(lp, key_prefix, key_type_position - 1) == 0 && lp[key_type_position] != key_escape) {
-            lp = line;
-            while (*lp == ' ') {
-                lp++;
-                indent++;
-            }
-            debug("got key \"%s\"\n", lp);
-            if (data != NULL) {
-                char *e = data + strlen(data) - 1;
-                while (e >= data && isspace(*e)) {
-                    *e-- = '\0';
-                }
-                if (key[0] != key_comment) {
-                    debug("data = \"%s\"\n", data);
-                    switch (key[0]) {
-                        case key_boolean:
-                            if (strcasecmp(data, "true") != 0 && strcasecmp(data, "false") != 0) {
-                                fprintf(stderr, "Invalid boolean value \"%s\" on line %li\n", data, line_number);
-                                debug_return NULL;
-                            }
-                            value = json_object_new_boolean(strcasecmp(data, "true") == 0);
-                            break;
-                        case key_null:
-                            if (strcasecmp(data, "null") != 0) {
-                                fprintf(stderr, "Invalid null value \"%s\" on line %li\n", data, line_number);
-                                debug_return NULL;
-                            }
-                            value = NULL;
-                            break;
-                        case key_number:
-                            if (!valid_number(data)) {
-                                fprintf(stderr, "Invalid number value \"%s\" on line %li\n", data, line_number);
-                                debug_return NULL;
-                            }
-                            value = json_object_new_double(atof(data));
-                            break;
-                        default:
-                            debug("adding data as string \"%s\"\n", data);
-                            value = json_object_new_string(data);
-                            break;
-                    }
-                    if (data) {
-                        free(data);
-                        data = NULL;
-                    }
-                    json_object_array_add(array, value);
-                } else {
-                    free(data);
-                    data = NULL;
-                }
-            } else if (value != NULL) {
-                json_object_array_add(array, value);
-                value = NULL;
-            }
-            if (lp[key_type_position] == key_start_obj) {
-                value = parse_object();
-            } else if (lp[key_type_position] == key_start_array) {
-                value = parse_array();
-            } else if (lp[key_type_position] == key_end_array) {
-                debug_return array;
+    if (batch_count == 0) {
+        debug_return 0;
+    }
+    int jobs = (size_t)opt_jobs < batch_count ? opt_jobs : (int)batch_count;
+    pthread_t *threads = calloc(jobs, sizeof(*threads));
+    int started = 0;
+    int r = 0;
+    if (threads == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        debug_return 1;
+    }
+    if (opt_output_dir != NULL) {
+        qsort(batch, batch_count, sizeof(*batch), batch_by_size);
+    }
+    chunk_slots = jobs * 2;
+    for (; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, NULL) != 0) {
+            fprintf(stderr, "Unable to start worker thread\n");
+            break;
+        }
+    }
+    if (started == 0) {
+        free(threads);
+        debug_return 1;
+    }
+    if (opt_output_dir == NULL) {
+        pthread_mutex_lock(&pool_lock);
+        while (batch_written < batch_count) {
+            batch_file *f = &batch[batch_written];
+            if (!f->done) {
+                pthread_cond_wait(&pool_done, &pool_lock);
+                continue;
             }
-            key = get_key(line);
-        } else {
-            if (!is_blank(line)) {
-                lp = line;
-                int i = 0;
-                while (*lp == ' ' && i < indent) {
-                    lp++;
-                    i++;
-                }
-                if (strncmp(lp, key_prefix, key_type_position) == 0 && lp[key_type_position] == key_escape) {
-                    memmove(lp + key_type_position, lp + key_type_position + 1, strlen(lp + key_type_position + 1) + 1);
-                }
-                long int l = strlen(lp);
-                if (data == NULL) {
-                    data = malloc(l + 1);
-                    strncpy(data, lp, l + 1);
-                } else {
-                    l += strlen(data);
-                    char *n = realloc(data, l + 1);
-                    if (n != NULL) {
-                        data = n;
-                    } else {
-                        fprintf(stderr, "Memory allocation error on line %li\n", line_number);
-                        debug_return NULL;
-                    }
-                    strcat(data, lp);
-                }
+            pthread_mutex_unlock(&pool_lock);
+            if (f->out.len > 0) {
+                output_write(out, f->out.data, f->out.len);
             }
+            free(f->out.data);
+            memset(&f->out, 0, sizeof(f->out));
+            pthread_mutex_lock(&pool_lock);
+            batch_written++;
+            pthread_cond_broadcast(&pool_work);
         }
+        pthread_mutex_unlock(&pool_lock);
     }
-    debug_return array;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = 0; i < batch_count; i++) {
+        if (batch[i].failed) {
+            r = 1;
+        }
+    }
+    free(threads);
+    debug_return r;
 }
 
-static json_object *parse_object(void) {
-    debug_enter();
-    json_object *object = json_object_new_object();
-    json_object *value = NULL;
-    char *line = NULL;
-    char *key = NULL;
-    char *data = NULL;
-    int indent = 0;
-    fp = stdin;
-    while ((line = get_line()) != NULL) {
-        char *lp = line;
-        while (*lp == ' ') {
-            lp++;
-        }
-        debug("line %li = \"%s\"\n", line_number, lp);
-        if (strncmp(lp, key_prefix, key_type_position - 1) == 0 && lp[key_type_position] != key_escape) {
-            debug("got key \"%s\"\n", lp);
-            lp = line;
-            indent = 0;
-            while (*lp == ' ') {
-                lp++;
-                indent++;
-            }
-            if (key != NULL) {
-                if (key[1] == '\0') {
-                    fprintf(stderr, "Anonymous value is not allowed on line %li\n", line_number);
-                    debug_return NULL;
-                }
-                debug("Inserting key \"%s\" with datatype %c\n", key + 1, key[0]);
-                if (key[0] != key_comment) {
-                    if (data != NULL) {
-                        char *e = data + strlen(data) - 1;
-                        while (e >= data && isspace(*e)) {
-                            *e-- = '\0';
-                        }
-                        debug("data = \"%s\"\n", data);
-                        switch (key[0]) {
-                            case key_boolean:
-                                if (strcasecmp(data, "true") != 0 && strcasecmp(data, "false") != 0) {
-                                    fprintf(stderr, "Invalid boolean value \"%s\" on line %li\n", data, line_number);
-                                    debug_return NULL;
-                                }
-                                value = json_object_new_boolean(strcasecmp(data, "true") == 0);
-                                break;
-                            case key_null:
-                                if (strcasecmp(data, "null") != 0) {
-                                    fprintf(stderr, "Invalid null value \"%s\" on line %li\n", data, line_number);
-                                    debug_return NULL;
-                                }
-                                value = NULL;
-                                break;
-                            case key_number:
-                                if (!valid_number(data)) {
-                                    fprintf(stderr, "Invalid number value \"%s\" on line %li\n", data, line_number);
-                                    debug_return NULL;
-                                }
-                                if (is_real(data)) {
-                                    value = json_object_new_double(strtod(data, NULL));
-                                } else {
-                                    value = json_object_new_int(strtol(data, NULL, 10));
-                                }
-                                break;
-                            default:
-                                debug("adding data as string \"%s\"\n", data);
-                                value = json_object_new_string(data);
-                                break;
-                        }
-                    }
-                    insert_key_value(object, key, value);
-                    if (data != NULL) {
-                        free(data);
-                        data = NULL;
-                    }
-                    free(key);
-                    key = NULL;
-                } else {
-                    if (data != NULL) {
-                        free(data);
-                        data = NULL;
-                    }
-                    free(key);
-                    key = NULL;
-                }
-            }
-            key = get_key(line);
-            if (lp[key_type_position] == key_start_obj) {
-                value = parse_object();
-            } else if (lp[key_type_position] == key_start_array) {
-                value = parse_array();
-            } else if (lp[key_type_position] == key_end_obj) {
-                debug("returning object\n");
-                debug_return object;
+static void *batch_worker(void *arg) {
+    writer w;
+    if (!writer_init(&w)) {
+        return arg;
+    }
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (opt_output_dir == NULL && batch_taken < batch_count && batch_taken - batch_written >= chunk_slots) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+        if (batch_taken == batch_count) {
+            break;
+        }
+        batch_file *f = &batch[batch_taken++];
+        pthread_mutex_unlock(&pool_lock);
+        bool ok = batch_convert(&w, f);
+        pthread_mutex_lock(&pool_lock);
+        f->failed = !ok;
+        f->done = true;
+        pthread_cond_broadcast(&pool_done);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    writer_free(&w);
+    stats_merge();
+    return arg;
+}
+
+static bool bin_emit_begin(void *user, const char *name, size_t name_len, char type) {
+    writer *w = user;
+    if (w->depth == 0) {
+        // The length of the record is filled in when it is finished.
+        const char frame[ldb_record_header_len] = { ldb_record };
+        w->record_start = w->out.len;
+        w->bin_record_count = w->bin_count;
+        if (!output_append(&w->out, frame, sizeof(frame))) {
+            return false;
+        }
+    }
+    w->first_done = w->first_done || w->depth == 1;
+    w->depth++;
+    stats_depth(w->depth);
+    stats_begin(t);
+    bool ok = output_char(&w->out, type) && bin_name(w, name, name_len);
+    stats_end(stats_serialize, t);
+    return ok;
+}
+
+static bool bin_emit_end(void *user, char type) {
+    writer *w = user;
+    w->depth--;
+    return output_char(&w->out, type);
+}
+
+static bool bin_emit_value(void *user, const ld_value *v) {
+    writer *w = user;
+    if (!keep_first(w, v)) {
+        return false;
+    }
+    stats_begin(t);
+    bool ok = output_char(&w->out, v->type) && bin_name(w, v->name, v->name_len);
+    switch (v->type) {
+        case key_string:
+            ok = ok && bin_varint(&w->out, v->len) && (v->len == 0 || output_append(&w->out, v->data, v->len));
+            break;
+        case key_number: {
+            char num[9];
+            uint64_t bits = (uint64_t)v->num.i;
+            if (v->num.real) {
+                memcpy(&bits, &v->num.d, sizeof(bits));
             }
-        } else {
-            if (!is_blank(line)) {
-                lp = line;
-                int i = 0;
-                while (*lp == ' ' && i < indent) {
-                    lp++;
-                    i++;
-                }
-                if (strncmp(lp, key_prefix, key_type_position) == 0 && lp[key_type_position] == key_escape) {
-                    memmove(lp + key_type_position, lp + key_type_position + 1, strlen(lp + key_type_position + 1) + 1);
-                }
-                long int l = strlen(lp);
-                if (data == NULL) {
-                    data = malloc(l + 1);
-                    strncpy(data, lp, l + 1);
-                } else {
-                    l += strlen(data);
-                    char *n = realloc(data, l + 1);
-                    if (n != NULL) {
-                        data = n;
-                    } else {
-                        fprintf(stderr, "Memory allocation error on line %li\n", line_number);
-                        debug_return NULL;
-                    }
-                    strcat(data, lp);
-                }
+            num[0] = (v->num.real ? ldb_number_real : 0) | (v->num.json ? ldb_number_json : 0);
+            for (int i = 0; i < 8; i++) {
+                num[i + 1] = bits >> (i * 8);
             }
+            ok = ok && output_append(&w->out, num, sizeof(num)) && bin_varint(&w->out, v->num.len) && output_append(&w->out, v->num.s, v->num.len);
+            break;
+        }
+        case key_boolean:
+            ok = ok && output_char(&w->out, v->boolean);
+            break;
+        default:
+            break;
+    }
+    stats_end(stats_serialize, t);
+    return ok;
+}
+
+/**
+ * @brief Fill in the length of the binary record just written.
+ */
+static bool bin_finish(writer *w) {
+    size_t len = w->out.len - w->record_start - ldb_record_header_len;
+    if (len > UINT32_MAX) {
+        fprintf(stderr, "Record too large for binary output\n");
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        w->out.data[w->record_start + 1 + i] = len >> (i * 8);
+    }
+    return true;
+}
+
+/**
+ * @brief Forget the binary names defined after the first count of them,
+ * when the records that defined them are dropped or a header starts over.
+ */
+static void bin_forget(writer *w, size_t count) {
+    while (w->bin_count > count) {
+        w->bin_ref[w->bin_names[--w->bin_count]] = 0;
+    }
+}
+
+static bool bin_header(writer *w) {
+    char header[ldb_header_len] = ldb_magic;
+    header[ldb_magic_len] = ldb_version;
+    bin_forget(w, 0);
+    return output_append(&w->out, header, sizeof(header));
+}
+
+/**
+ * @brief Write a member name: by number if it has been defined since the
+ * last header, as a definition the first time, and in full if the intern
+ * table is too full to number it.
+ */
+static bool bin_name(writer *w, const char *name, size_t len) {
+    if (name == NULL) {
+        return bin_varint(&w->out, ldb_name_none);
+    }
+    const intern_key *k = intern_get(&w->keys, name, len);
+    uint64_t ref = ldb_name_inline;
+    if (k != NULL && w->bin_ref[k->id] > 0) {
+        return bin_varint(&w->out, ldb_name_first + w->bin_ref[k->id] - 1);
+    }
+    if (k != NULL) {
+        w->bin_names[w->bin_count++] = k->id;
+        w->bin_ref[k->id] = w->bin_count;
+        ref = ldb_name_define;
+    }
+    return bin_varint(&w->out, ref) && bin_varint(&w->out, len) && (len == 0 || output_append(&w->out, name, len));
+}
+
+static bool bin_varint(output *o, uint64_t v) {
+    char buf[10];
+    size_t n = 0;
+    do {
+        buf[n] = v & 0x7f;
+        v >>= 7;
+        if (v != 0) {
+            buf[n] |= 0x80;
+        }
+        n++;
+    } while (v != 0);
+    return output_append(o, buf, n);
+}
+
+static bool buffer_append(data_buffer *b, const char *s, size_t l) {
+    if (b->len + l + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : min_data_len;
+        while (cap < b->len + l + 1) {
+            cap *= 2;
         }
+        char *n = realloc(b->data, cap);
+        stats_count(stats_allocations, 1);
+        if (n == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return false;
+        }
+        b->data = n;
+        b->cap = cap;
     }
-    fprintf(stderr, "Unexpected EOF on line %li\n", line_number);
-    debug_return NULL;
+    memcpy(b->data + b->len, s, l);
+    b->len += l;
+    b->data[b->len] = '\0';
+    return true;
 }
 
-static bool valid_number(const char *s) {
-    int i = 0;
-    int l = strlen(s);
-    int j = l - 1;
-    while (i < l && s[i] == ' ') {
-        i++;
+static void checkpoint_maybe(output *out, uint64_t offset, long int line_number, bool force) {
+    if (opt_checkpoint == NULL || (!force && offset - last_checkpoint.input < checkpoint_len)) {
+        return;
+    }
+    // Everything up to the checkpoint has to be written before the
+    // checkpoint itself is. fdatasync() fails harmlessly on pipes.
+    if (!output_flush(out)) {
+        return;
     }
-    while (j >= 0 && s[j] == ' ') {
-        j--;
+    fdatasync(out->fd);
+    last_checkpoint.input = offset;
+    last_checkpoint.line_number = line_number;
+    last_checkpoint.output = out->written;
+    if (!checkpoint_write(opt_checkpoint, &last_checkpoint)) {
+        fprintf(stderr, "Unable to write checkpoint \"%s\": %s\n", opt_checkpoint, strerror(errno));
     }
-     if (i > j)
+}
+
+static bool checkpoint_read(const char *path, checkpoint *ck) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open checkpoint \"%s\": %s\n", path, strerror(errno));
         return false;
-    if (i == j && !(s[i] >= '0' && s[i] <= '9')) {
+    }
+    int n = fscanf(f, "input %" SCNu64 " line %li output %" SCNu64, &ck->input, &ck->line_number, &ck->output);
+    fclose(f);
+    if (n != 3) {
+        fprintf(stderr, "Invalid checkpoint \"%s\"\n", path);
         return false;
     }
-    if (s[i] != '.' && s[i] != '+' && s[i] != '-' && !(s[i] >= '0' && s[i] <= '9')) {
+    return true;
+}
+
+/**
+ * @brief Replace the checkpoint file. The new one is written next to it
+ * and renamed over it, so a crash leaves either the old or the new one.
+ */
+static bool checkpoint_write(const char *path, const checkpoint *ck) {
+    data_buffer tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    if (!buffer_append(&tmp, path, strlen(path)) || !buffer_append(&tmp, ".tmp", 4)) {
+        free(tmp.data);
         return false;
     }
-    bool dot_or_e = false;
-    for (; i <= j; i++) {
-        if (s[i] != 'e' && s[i] != '.' && s[i] != '+' && s[i] != '-' && !(s[i] >= '0' && s[i] <= '9')) {
-            return false;
-        }
-        if (s[i] == '.') {
-            if (dot_or_e == true) {
-                return false;
-            }
-            if (i + 1 > l) {
-                return false;
+    FILE *f = fopen(tmp.data, "w");
+    bool ok = f != NULL;
+    if (ok) {
+        ok = fprintf(f, "input %" PRIu64 "\nline %li\noutput %" PRIu64 "\n", ck->input, ck->line_number, ck->output) > 0;
+        ok = fflush(f) == 0 && ok;
+        ok = fsync(fileno(f)) == 0 && ok;
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmp.data, path) == 0;
+    }
+    free(tmp.data);
+    return ok;
+}
+
+static int convert(writer *w, index_reader *ix) {
+    debug_enter();
+    output *index = opt_index_out != NULL ? &index_out : NULL;
+    uint64_t number = 0;
+    ld_status st;
+    if (opt_emit_bin && !bin_header(w)) {
+        debug_return 1;
+    }
+    while (1) {
+        if (ix != NULL) {
+            index_entry e;
+            uint64_t last = number;
+            int r = index_select(ix, &e, &number);
+            if (r <= 0) {
+                debug_return r < 0 ? 1 : 0;
             }
-            if (!(s[i + 1] >= '0' && s[i + 1] <= '9')) {
-                return false;
+            // A record that follows the last one is parsed straight on,
+            // since seeking means scanning the input for lines again.
+            if (number != last + 1 && !ld_parser_seek(w->ld, e.offset, e.line_number - 1)) {
+                fprintf(stderr, "Unable to seek input to byte %" PRIu64 "\n", e.offset);
+                debug_return 1;
             }
         }
-        else if (s[i] == 'e') {
-            dot_or_e = true;
-            if (!(s[i - 1] >= '0' && s[i - 1] <= '9')) {
-                return false;
-            }
-            if (i + 1 > l) {
-                return false;
-            }
-            if (s[i + 1] != '+' && s[i + 1] != '-' && (s[i + 1] >= '0' && s[i] <= '9')) {
-                return false;
-            }
+        if ((st = ld_parser_next(w->ld)) == ld_eof) {
+            break;
+        }
+        if (st == ld_error) {
+            debug_return 1;
+        }
+        record_done(w, st, index, ld_parser_record_offset(w->ld), ld_parser_record_line(w->ld));
+        if (opt_follow) {
+            follow_record(w, st);
+        } else {
+            output_maybe_flush(&w->out);
+        }
+        if (index != NULL) {
+            output_maybe_flush(index);
         }
+        checkpoint_maybe(&w->out, ld_parser_offset(w->ld), ld_parser_line(w->ld), false);
     }
-    return true;
+    if (opt_follow) {
+        follow_flush(w);
+    }
+    checkpoint_maybe(&w->out, ld_parser_offset(w->ld), ld_parser_line(w->ld), true);
+    debug_return 0;
+}
+
+static void convert_chunk(writer *w, chunk *c) {
+    debug_enter();
+    output *index = opt_index_out != NULL ? &c->index : NULL;
+    w->out = c->out;
+    // Chunks are written in order but converted apart, so each starts its
+    // binary names afresh.
+    if (opt_emit_bin) {
+        bin_header(w);
+    }
+    for (size_t i = 0; i < c->count; i++) {
+        record_span *r = &c->records[i];
+        ld_parser_open_buffer(w->ld, c->base + r->offset, r->len, r->line_number);
+        ld_status st = ld_parser_next(w->ld);
+        if (st == ld_record || st == ld_failed || st == ld_skipped) {
+            record_done(w, st, index, r->start, r->line_number);
+        }
+    }
+    ld_parser_close(w->ld);
+    c->out = w->out;
+    memset(&w->out, 0, sizeof(w->out));
+    debug_return;
 }
 
+static int convert_parallel(input *in, output *out, index_reader *ix) {
+    debug_enter();
+    // A binary record can use names defined anywhere before it, so the
+    // input cannot be cut into pieces for the workers.
+    if (ldb_detect(in)) {
+        fprintf(stderr, "-j needs LD input; binary input is read on one thread\n");
+        debug_return 1;
+    }
+    if (ix != NULL && in->map == NULL) {
+        fprintf(stderr, "-i with -j needs a regular input file\n");
+        debug_return 1;
+    }
+    scanner s;
+    memset(&s, 0, sizeof(s));
+    s.in = in;
+    s.offset = last_checkpoint.input;
+    s.line_number = last_checkpoint.line_number;
+    pthread_t *threads = calloc(opt_jobs, sizeof(*threads));
+    size_t written = 0;
+    int started = 0;
+    int r = 1;
+    chunk_slots = opt_jobs * 2;
+    chunks = calloc(chunk_slots, sizeof(*chunks));
+    if (threads == NULL || chunks == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        free(threads);
+        free(chunks);
+        debug_return 1;
+    }
+    for (size_t i = 0; i < chunk_slots; i++) {
+        output_open(&chunks[i].out, -1, 0);
+        output_open(&chunks[i].index, -1, 0);
+    }
+    for (; started < opt_jobs; started++) {
+        if (pthread_create(&threads[started], NULL, worker, NULL) != 0) {
+            fprintf(stderr, "Unable to start worker thread\n");
+            break;
+        }
+    }
+    if (started == 0) {
+        r = -1;
+    }
+    while (r == 1) {
+        written = write_chunks(out, written, false);
+        chunk *c = &chunks[chunks_filled % chunk_slots];
+        r = ix != NULL ? index_chunk(ix, in, c) : scan_chunk(&s, c);
+        pthread_mutex_lock(&pool_lock);
+        chunks_filled++;
+        pthread_cond_signal(&pool_work);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_finished = true;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+    write_chunks(out, written, true);
+    if (r == 0) {
+        checkpoint_maybe(out, s.offset, s.line_number, true);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = 0; i < chunk_slots; i++) {
+        free(chunks[i].text.data);
+        free(chunks[i].records);
+        free(chunks[i].out.data);
+        free(chunks[i].index.data);
+    }
+    free(chunks);
+    free(threads);
+    free(s.stack.data);
+    lines_free(&s.lines);
+    debug_return r < 0 ? 1 : 0;
+}
+
+static bool dom_add(writer *w, const char *name, size_t name_len, json_object *value) {
+    if (w->dom_depth == 0) {
+        w->dom_root = value;
+        return true;
+    }
+    json_object *parent = w->dom_stack[w->dom_depth - 1];
+    if (json_object_get_type(parent) == json_type_object) {
+        const intern_key *k = intern_get(&w->keys, name, name_len);
+        if (k != NULL) {
+            debug("adding key \"%s\" value %s\n", k->name, json_object_to_json_string(value));
+            json_object_object_add_ex(parent, k->name, value, JSON_C_OBJECT_KEY_IS_CONSTANT);
+            return true;
+        }
+        const char *key = terminate(w, name, name_len);
+        if (key == NULL) {
+            json_object_put(value);
+            return false;
+        }
+        debug("adding key \"%s\" value %s\n", key, json_object_to_json_string(value));
+        json_object_object_add(parent, key, value);
+    } else if (w->split && w->dom_depth == 1) {
+        w->element = value;
+    } else {
+        json_object_array_add(parent, value);
+    }
+    return true;
+}
+
+static bool dom_begin(writer *w, const char *name, size_t name_len, char type) {
+    json_object *container = type == key_start_obj ? json_object_new_object() : json_object_new_array();
+    stats_count(stats_allocations, 1);
+    if (container == NULL) {
+        fprintf(stderr, "Memory allocation error on line %li\n", ld_parser_line(w->ld));
+        return false;
+    }
+    if (w->dom_depth == w->dom_cap) {
+        size_t cap = w->dom_cap ? w->dom_cap * 2 : 16;
+        json_object **n = realloc(w->dom_stack, cap * sizeof(*w->dom_stack));
+        if (n == NULL) {
+            fprintf(stderr, "Memory allocation error on line %li\n", ld_parser_line(w->ld));
+            json_object_put(container);
+            return false;
+        }
+        w->dom_stack = n;
+        w->dom_cap = cap;
+    }
+    if (!dom_add(w, name, name_len, container)) {
+        return false;
+    }
+    w->dom_stack[w->dom_depth++] = container;
+    return true;
+}
+
+static bool dom_emit_begin(void *user, const char *name, size_t name_len, char type) {
+    return emit_begin(user, name, name_len, type, false);
+}
+
+static bool dom_emit_end(void *user, char type) {
+    return emit_end(user, type, false);
+}
+
+static bool dom_emit_value(void *user, const ld_value *v) {
+    return emit_value(user, v, false);
+}
+
+static bool dom_value(writer *w, const ld_value *v) {
+    json_object *value;
+    switch (v->type) {
+        case key_boolean:
+            value = json_object_new_boolean(v->boolean);
+            break;
+        case key_null:
+            value = NULL;
+            break;
+        case key_number:
+            if (opt_numbers && v->num.json) {
+                const char *text = terminate(w, v->num.s, v->num.len);
+                if (text == NULL) {
+                    return false;
+                }
+                value = json_object_new_double_s(v->num.real ? v->num.d : v->num.i, text);
+            } else if (v->num.real) {
+                value = json_object_new_double(v->num.d);
+            } else {
+                value = json_object_new_int64(v->num.i);
+            }
+            break;
+        default:
+            debug("adding data as string \"%.*s\"\n", (int)v->len, v->data);
+            value = json_object_new_string_len(v->data, v->len);
+            break;
+    }
+    if (value != NULL) {
+        stats_count(stats_allocations, 1);
+    }
+    return dom_add(w, v->name, v->name_len, value);
+}
+
+/**
+ * @brief Finish an element of a split top-level array. Once an element is
+ * complete the output up to it can be written, so a huge array needs no more
+ * memory than its largest element.
+ */
+static bool element_done(writer *w, bool stream) {
+    if (!stream) {
+        element_write(w, w->element);
+        json_object_put(w->element);
+        w->element = NULL;
+    }
+    w->elements++;
+    output_maybe_flush(&w->out);
+    w->element_start = w->out.len;
+    return !w->out.error;
+}
+
+static void element_write(writer *w, json_object *obj) {
+    stats_begin(t);
+    size_t len = 4;
+    const char *s = "null";
+    if (obj != NULL) {
+        s = json_object_to_json_string_length(obj, opt_pretty ? JSON_C_TO_STRING_PRETTY : JSON_C_TO_STRING_SPACED, &len);
+    }
+    if (opt_pretty) {
+        const char *sep = w->elements ? ",\n  " : "  ";
+        output_append(&w->out, sep, strlen(sep));
+        // json-c indents by nesting level, so an element printed on its own
+        // is one level short on every line after its first.
+        const char *end = s + len;
+        const char *nl;
+        while ((nl = memchr(s, '\n', end - s)) != NULL) {
+            output_append(&w->out, s, nl + 1 - s);
+            output_append(&w->out, "  ", 2);
+            s = nl + 1;
+        }
+        output_append(&w->out, s, end - s);
+    } else {
+        const char *sep = w->elements ? ", " : " ";
+        output_append(&w->out, sep, strlen(sep));
+        output_append(&w->out, s, len);
+    }
+    stats_end(stats_serialize, t);
+}
+
+static inline bool emit_begin(writer *w, const char *name, size_t name_len, char type, bool stream) {
+    if (w->depth == 0) {
+        w->record_start = w->out.len;
+        w->record_written = w->out.written;
+        w->split = type == key_start_array;
+        w->element_start = w->out.len;
+    }
+    w->first_done = w->first_done || w->depth == 1;
+    w->depth++;
+    stats_depth(w->depth);
+    stats_begin(t);
+    bool ok;
+    if (stream) {
+        ok = out_member(w, name, name_len) && output_char(&w->out, type) && buffer_append(&w->nest, "", 1);
+        stats_end(stats_serialize, t);
+    } else {
+        ok = dom_begin(w, name, name_len, type);
+        if (ok && w->split && w->depth == 1) {
+            ok = opt_pretty ? output_append(&w->out, "[\n", 2) : output_char(&w->out, '[');
+        }
+        stats_end(stats_tree, t);
+    }
+    return ok;
+}
+
+static inline bool emit_end(writer *w, char type, bool stream) {
+    w->depth--;
+    if (stream) {
+        char close[2] = { ' ', type };
+        w->nest.len--;
+        if (!output_append(&w->out, close, 2)) {
+            return false;
+        }
+    } else {
+        w->dom_depth--;
+    }
+    return !w->split || w->depth != 1 || element_done(w, stream);
+}
+
+static inline bool emit_value(writer *w, const ld_value *v, bool stream) {
+    if (!keep_first(w, v)) {
+        return false;
+    }
+    stats_begin(t);
+    bool ok;
+    if (stream) {
+        ok = stream_value(w, v);
+        stats_end(stats_serialize, t);
+    } else {
+        ok = dom_value(w, v);
+        stats_end(stats_tree, t);
+    }
+    return ok && (!w->split || w->depth != 1 || element_done(w, stream));
+}
+
+/**
+ * @brief Write out the records converted so far while following, and count
+ * how long each took from being read.
+ */
+static bool follow_flush(writer *w) {
+    bool ok = output_flush(&w->out);
+    if (opt_stats) {
+        uint64_t now = input_clock();
+        for (size_t i = 0; i < w->pending_count; i++) {
+            stats_latency(now - w->pending[i]);
+        }
+    }
+    w->pending_count = 0;
+    return ok;
+}
+
+/**
+ * @brief Note a record converted while following. Output is written after
+ * every record, or with --flush-ms once the oldest record in it has waited
+ * that long.
+ */
+static void follow_record(writer *w, ld_status st) {
+    if (st == ld_record && !opt_validate) {
+        if (w->pending_count == w->pending_cap) {
+            size_t cap = w->pending_cap ? w->pending_cap * 2 : 64;
+            uint64_t *n = realloc(w->pending, cap * sizeof(*n));
+            if (n == NULL) {
+                // The record goes out now, so it need not be remembered.
+                follow_flush(w);
+                return;
+            }
+            w->pending = n;
+            w->pending_cap = cap;
+        }
+        w->pending[w->pending_count++] = ld_parser_read_time(w->ld);
+    }
+    if (opt_flush_ms == 0 || (w->pending_count > 0 && input_clock() - w->pending[0] >= (uint64_t)opt_flush_ms * 1000000)) {
+        follow_flush(w);
+    }
+}
+
+static void follow_stop(int sig) {
+    (void)sig;
+    input_stop_following();
+}
+
+/**
+ * @brief Write out what has been converted before the parser waits for
+ * input, unless a record is only partly converted; its output can still
+ * be taken back.
+ */
+static void follow_wait(void *user) {
+    writer *w = user;
+    if (w->depth == 0) {
+        follow_flush(w);
+    }
+}
+
+static int format_double(char *buf, size_t size, double d) {
+    if (isnan(d)) {
+        return snprintf(buf, size, "NaN");
+    }
+    if (isinf(d)) {
+        return snprintf(buf, size, d > 0 ? "Infinity" : "-Infinity");
+    }
+    int l = snprintf(buf, size, "%.17g", d);
+    if (strchr(buf, '.') == NULL && strchr(buf, 'e') == NULL) {
+        memcpy(buf + l, ".0", 3);
+        l += 2;
+    }
+    return l;
+}
+
+static bool has_suffix(const char *s, size_t len, const char *suffix) {
+    size_t n = strlen(suffix);
+    return len > n && memcmp(s + len - n, suffix, n) == 0;
+}
+
+static void index_add(output *o, uint64_t offset, long int line_number, const data_buffer *first) {
+    char buf[48];
+    int l = snprintf(buf, sizeof(buf), "%" PRIu64 " %li", offset, line_number);
+    output_append(o, buf, l);
+    if (first->len > 0) {
+        output_char(o, ' ');
+        output_append(o, first->data, first->len);
+    }
+    output_char(o, '\n');
+}
+
+/**
+ * @brief Fill a chunk with the next selected records of the index. Each
+ * record runs up to the start of the next entry, so the input itself is
+ * not scanned for boundaries.
+ * @return 1 if there may be more records, 0 at the end, -1 on error.
+ */
+static int index_chunk(index_reader *ix, input *in, chunk *c) {
+    debug_enter();
+    index_entry e;
+    uint64_t number;
+    size_t bytes = 0;
+    int r;
+    c->count = 0;
+    c->base = in->map;
+    c->done = false;
+    while ((r = index_select(ix, &e, &number)) > 0) {
+        uint64_t end = ix->have_next ? ix->next.offset : in->map_len;
+        if (e.offset > end || end > in->map_len) {
+            fprintf(stderr, "Index entry %" PRIu64 " does not match the input\n", number);
+            debug_return -1;
+        }
+        if (!record_push(c, e.offset, e.line_number, e.offset)) {
+            debug_return -1;
+        }
+        c->records[c->count - 1].len = end - e.offset;
+        bytes += end - e.offset;
+        if (bytes >= chunk_len) {
+            debug_return 1;
+        }
+    }
+    debug_return r;
+}
+
+static bool index_open(index_reader *ix, const char *path) {
+    memset(ix, 0, sizeof(*ix));
+    if (!input_open(&ix->in, path)) {
+        fprintf(stderr, "Unable to open index \"%s\"\n", path);
+        return false;
+    }
+    ix->number = 1;
+    if (!index_read(ix)) {
+        input_close(&ix->in);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Read the entry after the current one. Each line of an index is
+ * "offset line" or "offset line value"; lines starting with # are skipped.
+ */
+static bool index_read(index_reader *ix) {
+    const char *s;
+    size_t len;
+    ix->have_next = false;
+    while ((s = input_get_line(&ix->in, &len)) != NULL) {
+        const char *e = s + len;
+        if (e[-1] == '\n') {
+            e--;
+        }
+        if (e == s || *s == '#') {
+            continue;
+        }
+        uint64_t offset, line_number;
+        const char *p = parse_u64(s, e, &offset);
+        if (p != NULL && p < e && *p == ' ') {
+            p = parse_u64(p + 1, e, &line_number);
+        } else {
+            p = NULL;
+        }
+        if (p == NULL || (p < e && *p != ' ')) {
+            fprintf(stderr, "Invalid index entry \"%.*s\"\n", (int)(e - s), s);
+            return false;
+        }
+        ix->next.offset = offset;
+        ix->next.line_number = line_number;
+        ix->have_next = true;
+        return true;
+    }
+    return true;
+}
+
+/**
+ * @brief Get the next entry of the index that the -r list selects, or the
+ * next entry at all if there is no list.
+ * @return 1 with the entry and its record number, 0 when no more records
+ * are selected, -1 on error.
+ */
+static int index_select(index_reader *ix, index_entry *e, uint64_t *number) {
+    while (ix->have_next) {
+        *number = ix->number++;
+        *e = ix->next;
+        if (!index_read(ix)) {
+            return -1;
+        }
+        if (range_count == 0) {
+            return 1;
+        }
+        while (ix->range < range_count && *number > ranges[ix->range].last) {
+            ix->range++;
+        }
+        if (ix->range == range_count) {
+            return 0;
+        }
+        if (*number >= ranges[ix->range].first) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Keep the value of a record's first member, for the index.
+ */
+static bool keep_first(writer *w, const ld_value *v) {
+    if (w->depth == 1 && !w->first_done) {
+        w->first_done = true;
+        if (opt_index_out != NULL && v->len > 0 && !buffer_append(&w->first, v->data, v->len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool out_member(writer *w, const char *name, size_t name_len) {
+    if (w->nest.len == 0) {
+        return true;
+    }
+    char *had_children = &w->nest.data[w->nest.len - 1];
+    bool ok = *had_children ? output_append(&w->out, ", ", 2) : output_append(&w->out, " ", 1);
+    *had_children = 1;
+    if (ok && name != NULL) {
+        const intern_key *k = intern_get(&w->keys, name, name_len);
+        if (k != NULL) {
+            return output_append(&w->out, k->json, k->json_len);
+        }
+        ok = output_append(&w->out, "\"", 1) && output_escaped(&w->out, name, name_len) && output_append(&w->out, "\": ", 3);
+    }
+    return ok;
+}
+
+/**
+ * @brief Write a record built with json-c.
+ * @return false if the output cannot be written.
+ */
+static bool output_object(writer *w, json_object *obj) {
+    if (obj == NULL) {
+        return true;
+    }
+    stats_begin(t);
+    size_t len;
+    const char *s;
+    bool ok;
+    if (opt_pretty) {
+        char *t = "\n";
+        if (json_object_get_type(obj) == json_type_object) {
+            t = ",\n";
+        }
+        s = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PRETTY, &len);
+        ok = output_write(&w->out, s, len) && output_append(&w->out, t, strlen(t));
+    } else {
+        s = json_object_to_json_string_length(obj, JSON_C_TO_STRING_SPACED, &len);
+        ok = output_write(&w->out, s, len) && output_char(&w->out, '\n');
+    }
+    stats_end(stats_serialize, t);
+    return ok;
+}
+
+/**
+ * @brief Parse a list of record numbers and ranges such as 1-100,250,1000-
+ * into ranges. They must be in ascending order and must not overlap.
+ */
+static bool parse_ranges(const char *s) {
+    const char *e = s + strlen(s);
+    free(ranges);
+    ranges = NULL;
+    range_count = 0;
+    while (s < e) {
+        record_range rr;
+        s = parse_u64(s, e, &rr.first);
+        if (s == NULL || rr.first == 0) {
+            return false;
+        }
+        rr.last = rr.first;
+        if (s < e && *s == '-') {
+            s++;
+            rr.last = UINT64_MAX;
+            if (s < e && *s != ',' && ((s = parse_u64(s, e, &rr.last)) == NULL || rr.last < rr.first)) {
+                return false;
+            }
+        }
+        if (range_count > 0 && rr.first <= ranges[range_count - 1].last) {
+            return false;
+        }
+        if (s < e && *s++ != ',') {
+            return false;
+        }
+        record_range *n = realloc(ranges, (range_count + 1) * sizeof(*ranges));
+        if (n == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return false;
+        }
+        ranges = n;
+        ranges[range_count++] = rr;
+    }
+    return range_count > 0;
+}
+
+/**
+ * @brief Parse a decimal number in [s, e).
+ * @return Pointer just past the digits, or NULL if there are none or the
+ * number does not fit.
+ */
+static const char *parse_u64(const char *s, const char *e, uint64_t *v) {
+    const char *start = s;
+    *v = 0;
+    while (s < e && *s >= '0' && *s <= '9') {
+        unsigned d = *s++ - '0';
+        if (*v > (UINT64_MAX - d) / 10) {
+            return NULL;
+        }
+        *v = *v * 10 + d;
+    }
+    return s > start ? s : NULL;
+}
+
+/**
+ * @brief Drop a record that failed. When part of a split array has already
+ * been written, the array is closed after its last complete element instead,
+ * so the output stays valid JSON.
+ */
+static void record_abort(writer *w) {
+    if (opt_emit_bin) {
+        w->out.len = w->record_start;
+        bin_forget(w, w->bin_record_count);
+        return;
+    }
+    bool partial = w->split && w->out.written != w->record_written;
+    w->out.len = partial ? w->element_start : w->record_start;
+    if (opt_stream) {
+        w->nest.len = 0;
+        if (partial) {
+            output_append(&w->out, " ]\n", 3);
+        }
+    } else {
+        json_object_put(w->element);
+        w->element = NULL;
+        json_object_put(w->dom_root);
+        w->dom_root = NULL;
+        w->dom_depth = 0;
+        if (partial) {
+            record_close(w);
+        }
+    }
+}
+
+/**
+ * @brief Close a split array in DOM mode, the way json-c would have.
+ */
+static void record_close(writer *w) {
+    if (opt_pretty) {
+        const char *close = w->elements ? "\n]\n" : "]\n";
+        output_append(&w->out, close, strlen(close));
+    } else {
+        output_append(&w->out, " ]\n", 3);
+    }
+}
+
+/**
+ * @brief Finish or drop the record just parsed, and list it in the index
+ * if one is being written.
+ */
+static void record_done(writer *w, ld_status st, output *index, uint64_t offset, long int line_number) {
+    if (st == ld_failed) {
+        w->failed++;
+    }
+    if (opt_validate) {
+        // Nothing was written for the record.
+        return;
+    }
+    if (st == ld_record) {
+        if (!record_finish(w)) {
+            w->failed++;
+            record_abort(w);
+        }
+    } else if (st != ld_skipped || w->depth > 0) {
+        // A record skipped before it began has no output to take back.
+        record_abort(w);
+    }
+    if (index != NULL) {
+        index_add(index, offset, line_number, &w->first);
+    }
+    w->first.len = 0;
+    w->first_done = false;
+    w->depth = 0;
+    w->split = false;
+    w->elements = 0;
+}
+
+/**
+ * @brief Finish the output of the record just parsed.
+ * @return false if the record cannot be written, and must be dropped.
+ */
+static bool record_finish(writer *w) {
+    if (opt_emit_bin) {
+        return bin_finish(w);
+    }
+    bool ok = true;
+    if (opt_stream) {
+        ok = output_char(&w->out, '\n');
+    } else if (w->split) {
+        record_close(w);
+        json_object_put(w->dom_root);
+        w->dom_root = NULL;
+        w->dom_depth = 0;
+    } else {
+        ok = output_object(w, w->dom_root);
+        json_object_put(w->dom_root);
+        w->dom_root = NULL;
+        w->dom_depth = 0;
+    }
+    return ok;
+}
+
+static bool record_push(chunk *c, size_t offset, long int line_number, uint64_t start) {
+    if (c->count == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 256;
+        record_span *n = realloc(c->records, cap * sizeof(*c->records));
+        if (n == NULL) {
+            fprintf(stderr, "Memory allocation error on line %li\n", line_number);
+            return false;
+        }
+        c->records = n;
+        c->cap = cap;
+    }
+    c->records[c->count].offset = offset;
+    c->records[c->count].len = 0;
+    c->records[c->count].line_number = line_number;
+    c->records[c->count].start = start;
+    c->count++;
+    return true;
+}
+
+/**
+ * @brief Pick up where the checkpoint left off: cut the output back to the
+ * checkpointed length and move the input to the checkpointed offset.
+ */
+static bool resume(input *in, writer *w) {
+    struct stat st;
+    checkpoint *ck = &last_checkpoint;
+    if (!checkpoint_read(opt_checkpoint, ck)) {
+        return false;
+    }
+    if (fstat(w->out.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Output must be a regular file to resume\n");
+        return false;
+    }
+    if ((uint64_t)st.st_size < ck->output) {
+        fprintf(stderr, "Output is shorter than the checkpoint; append to it with >> to resume\n");
+        return false;
+    }
+    if (ftruncate(w->out.fd, ck->output) != 0 || lseek(w->out.fd, ck->output, SEEK_SET) < 0) {
+        fprintf(stderr, "Unable to truncate output: %s\n", strerror(errno));
+        return false;
+    }
+    w->out.written = ck->output;
+    bool ok = opt_jobs > 1 ? input_seek(in, ck->input) : ld_parser_seek(w->ld, ck->input, ck->line_number);
+    if (!ok) {
+        fprintf(stderr, "Unable to seek input to byte %" PRIu64 "\n", ck->input);
+    }
+    return ok;
+}
+
+static int scan_chunk(scanner *s, chunk *c) {
+    debug_enter();
+    const line_info *l;
+    size_t bytes = 0;
+    bool mapped = s->in->map != NULL;
+    c->count = 0;
+    c->text.len = 0;
+    c->base = s->in->map;
+    c->done = false;
+    while ((l = lines_next(&s->lines, s->in, &s->line_pos)) != NULL) {
+        char type = l->type;
+        s->line_number++;
+        s->offset += l->size;
+        if (s->stack.len == 0) {
+            if (!l->key) {
+                continue;
+            }
+            if (type != key_start_obj && type != key_start_array) {
+                if (type == key_comment) {
+                    s->in_comment = true;
+                } else if (!s->in_comment) {
+                    fprintf(stderr, "Invalid key type: \"%.*s\" on line %li\n", (int)(l->len - l->indent), l->s + l->indent, s->line_number);
+                    debug_return -1;
+                }
+                continue;
+            }
+            s->in_comment = false;
+            if (!record_push(c, mapped ? (size_t)(l->s - s->in->map) : c->text.len, s->line_number, s->offset - l->size)) {
+                debug_return -1;
+            }
+        }
+        record_span *r = &c->records[c->count - 1];
+        r->len += l->size;
+        if (!mapped) {
+            if (!buffer_append(&c->text, l->s, l->size)) {
+                debug_return -1;
+            }
+            c->base = c->text.data;
+        }
+        if (l->key && type != key_escape) {
+            char top = s->stack.len > 0 ? s->stack.data[s->stack.len - 1] : '\0';
+            if (type == key_start_obj || type == key_start_array) {
+                if (!buffer_append(&s->stack, &type, 1)) {
+                    debug_return -1;
+                }
+            } else if ((type == key_end_obj && top == key_start_obj) || (type == key_end_array && top == key_start_array)) {
+                s->stack.len--;
+            }
+        }
+        if (s->stack.len == 0) {
+            c->end_offset = s->offset;
+            c->end_line = s->line_number;
+            bytes += r->len;
+            if (bytes >= chunk_len) {
+                debug_return 1;
+            }
+        }
+    }
+    debug_return s->in->error ? -1 : 0;
+}
+
+
+static bool stream_emit_begin(void *user, const char *name, size_t name_len, char type) {
+    return emit_begin(user, name, name_len, type, true);
+}
+
+static bool stream_emit_end(void *user, char type) {
+    return emit_end(user, type, true);
+}
+
+static bool stream_emit_value(void *user, const ld_value *v) {
+    return emit_value(user, v, true);
+}
+
+static bool stream_value(writer *w, const ld_value *v) {
+    char buf[64];
+    int l;
+    if (!out_member(w, v->name, v->name_len)) {
+        return false;
+    }
+    switch (v->type) {
+        case key_boolean:
+            if (v->boolean) {
+                return output_append(&w->out, "true", 4);
+            }
+            return output_append(&w->out, "false", 5);
+        case key_null:
+            return output_append(&w->out, "null", 4);
+        case key_number:
+            if (opt_numbers && v->num.json) {
+                return output_append(&w->out, v->num.s, v->num.len);
+            }
+            if (!v->num.real) {
+                return output_int(&w->out, v->num.i);
+            }
+            l = format_double(buf, sizeof(buf), v->num.d);
+            return output_append(&w->out, buf, l);
+        default:
+            return output_char(&w->out, '"') && output_escaped(&w->out, v->data, v->len) && output_char(&w->out, '"');
+    }
+}
+
+static const char *terminate(writer *w, const char *s, size_t len) {
+    w->text.len = 0;
+    if (!buffer_append(&w->text, s, len)) {
+        return NULL;
+    }
+    return w->text.data;
+}
+
+static void *worker(void *arg) {
+    writer w;
+    if (!writer_init(&w)) {
+        return arg;
+    }
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (chunks_taken == chunks_filled && !pool_finished) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+        if (chunks_taken == chunks_filled) {
+            break;
+        }
+        chunk *c = &chunks[chunks_taken++ % chunk_slots];
+        pthread_mutex_unlock(&pool_lock);
+        convert_chunk(&w, c);
+        pthread_mutex_lock(&pool_lock);
+        c->done = true;
+        pthread_cond_broadcast(&pool_done);
+    }
+    records_failed += w.failed;
+    pthread_mutex_unlock(&pool_lock);
+    writer_free(&w);
+    stats_merge();
+    return arg;
+}
+
+static size_t write_chunks(output *out, size_t written, bool drain) {
+    pthread_mutex_lock(&pool_lock);
+    while (written < chunks_filled) {
+        chunk *c = &chunks[written % chunk_slots];
+        if (!c->done) {
+            if (!drain && chunks_filled - written < chunk_slots) {
+                break;
+            }
+            pthread_cond_wait(&pool_done, &pool_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        // Every record of a chunk can have been dropped, leaving it empty.
+        if (c->out.len > 0) {
+            output_write(out, c->out.data, c->out.len);
+        }
+        c->out.len = 0;
+        if (opt_index_out != NULL) {
+            output_write(&index_out, c->index.data, c->index.len);
+            c->index.len = 0;
+        }
+        if (c->count > 0) {
+            checkpoint_maybe(out, c->end_offset, c->end_line, false);
+        }
+        written++;
+        pthread_mutex_lock(&pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return written;
+}
+
+static void writer_free(writer *w) {
+    free(w->nest.data);
+    free(w->text.data);
+    free(w->first.data);
+    free(w->dom_stack);
+    free(w->bin_ref);
+    free(w->bin_names);
+    free(w->pending);
+    intern_free(&w->keys);
+    ld_parser_free(w->ld);
+    memset(w, 0, sizeof(*w));
+}
+
+static bool writer_init(writer *w) {
+    memset(w, 0, sizeof(*w));
+    if (opt_validate) {
+        w->ld = ld_parser_new(&no_callbacks, w);
+    } else if (opt_emit_bin) {
+        w->ld = ld_parser_new(&bin_callbacks, w);
+    } else {
+        w->ld = ld_parser_new(opt_stream ? &stream_callbacks : &dom_callbacks, w);
+    }
+    if (w->ld == NULL) {
+        return false;
+    }
+    if (opt_emit_bin) {
+        w->bin_ref = calloc(intern_max_keys, sizeof(*w->bin_ref));
+        w->bin_names = malloc(intern_max_keys * sizeof(*w->bin_names));
+        if (w->bin_ref == NULL || w->bin_names == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            writer_free(w);
+            return false;
+        }
+    }
+    ld_parser_learn(w->ld, opt_learn);
+    ld_parser_trust(w->ld, opt_trust);
+    if (!ld_parser_fields(w->ld, opt_fields) || !ld_parser_where(w->ld, opt_where, opt_where_value)) {
+        writer_free(w);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,294 @@
+/**
+ * @file ldb.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Binary form of parsed LD records, and a reader for it.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "input.h"
+#include "ld.h"
+#include "ldb.h"
+#include "stats.h"
+
+#define min_names 64
+
+static bool add_name(ldb_reader *r, const char *s, size_t len);
+static uint64_t get_le(const char *s, int n);
+static bool get_name(ldb_reader *r, const char **p, const char *e, const char **name, size_t *len);
+static bool get_text(const char **p, const char *e, const char **s, size_t *len);
+static bool get_varint(const char **p, const char *e, uint64_t *v);
+static bool push(ldb_reader *r, size_t depth, char type);
+static ld_status read_record(ldb_reader *r, const char *p, const char *e, const ld_callbacks *cb, void *user);
+static bool read_value(const char **p, const char *e, ld_value *v);
+
+bool ldb_detect(input *in) {
+    const char *s = input_peek(in, ldb_magic_len);
+    return s != NULL && memcmp(s, ldb_magic, ldb_magic_len) == 0;
+}
+
+ld_status ldb_next(ldb_reader *r, const ld_callbacks *cb, void *user) {
+    const char *h;
+    while ((h = input_get_bytes(r->in, 1)) != NULL) {
+        if (*h == ldb_magic[0]) {
+            h = input_get_bytes(r->in, ldb_header_len - 1);
+            if (h == NULL || memcmp(h, ldb_magic + 1, ldb_magic_len - 1) != 0 || h[ldb_magic_len - 1] != ldb_version) {
+                fprintf(stderr, "Invalid binary header at byte %" PRIu64 "\n", r->offset);
+                return ld_error;
+            }
+            r->offset += ldb_header_len;
+            r->count = 0;
+            r->text_len = 0;
+            continue;
+        }
+        if (*h != ldb_record) {
+            fprintf(stderr, "Invalid binary frame at byte %" PRIu64 "\n", r->offset);
+            return ld_error;
+        }
+        const char *s = NULL;
+        size_t len = 0;
+        if ((h = input_get_bytes(r->in, ldb_record_header_len - 1)) != NULL) {
+            len = get_le(h, ldb_record_header_len - 1);
+            s = input_get_bytes(r->in, len);
+        }
+        if (s == NULL) {
+            fprintf(stderr, "Binary record at byte %" PRIu64 " is cut short\n", r->offset);
+            return ld_error;
+        }
+        r->record_offset = r->offset;
+        r->offset += ldb_record_header_len + len;
+        r->records++;
+        stats_count(stats_records, 1);
+        return read_record(r, s, s + len, cb, user);
+    }
+    return r->in->error ? ld_error : ld_eof;
+}
+
+void ldb_free(ldb_reader *r) {
+    free(r->text);
+    free(r->names);
+    free(r->stack);
+    input *in = r->in;
+    memset(r, 0, sizeof(*r));
+    r->in = in;
+}
+
+/**
+ * @brief Copy a defined name, since buffered input moves on under it.
+ */
+static bool add_name(ldb_reader *r, const char *s, size_t len) {
+    if (r->count == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : min_names;
+        ldb_name *n = realloc(r->names, cap * sizeof(*n));
+        if (n == NULL) {
+            return false;
+        }
+        r->names = n;
+        r->cap = cap;
+    }
+    if (r->text_cap - r->text_len < len) {
+        size_t cap = r->text_cap ? r->text_cap : min_names * 16;
+        while (cap - r->text_len < len) {
+            cap *= 2;
+        }
+        char *t = realloc(r->text, cap);
+        if (t == NULL) {
+            return false;
+        }
+        r->text = t;
+        r->text_cap = cap;
+    }
+    // An empty name has nothing to copy, and the text may not exist yet.
+    if (len > 0) {
+        memcpy(r->text + r->text_len, s, len);
+    }
+    r->names[r->count].offset = r->text_len;
+    r->names[r->count].len = len;
+    r->text_len += len;
+    r->count++;
+    return true;
+}
+
+/**
+ * @brief Get an unsigned number stored least significant byte first.
+ */
+static uint64_t get_le(const char *s, int n) {
+    uint64_t v = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        v = v << 8 | (unsigned char)s[i];
+    }
+    return v;
+}
+
+static bool get_name(ldb_reader *r, const char **p, const char *e, const char **name, size_t *len) {
+    uint64_t ref;
+    if (!get_varint(p, e, &ref)) {
+        return false;
+    }
+    if (ref == ldb_name_none) {
+        *name = NULL;
+        *len = 0;
+        return true;
+    }
+    if (ref == ldb_name_inline || ref == ldb_name_define) {
+        if (!get_text(p, e, name, len)) {
+            return false;
+        }
+        if (ref == ldb_name_define && !add_name(r, *name, *len)) {
+            fprintf(stderr, "Memory allocation error\n");
+            return false;
+        }
+        return true;
+    }
+    if (ref - ldb_name_first >= r->count) {
+        return false;
+    }
+    const ldb_name *n = &r->names[ref - ldb_name_first];
+    *name = r->text + n->offset;
+    *len = n->len;
+    return true;
+}
+
+static bool get_text(const char **p, const char *e, const char **s, size_t *len) {
+    uint64_t l;
+    if (!get_varint(p, e, &l) || l > (uint64_t)(e - *p)) {
+        return false;
+    }
+    *s = *p;
+    *len = l;
+    *p += l;
+    return true;
+}
+
+static bool get_varint(const char **p, const char *e, uint64_t *v) {
+    const char *s = *p;
+    *v = 0;
+    for (int shift = 0; s < e && shift < 64; shift += 7) {
+        unsigned char c = *s++;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (c < 0x80) {
+            *p = s;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool push(ldb_reader *r, size_t depth, char type) {
+    if (depth == r->stack_cap) {
+        size_t cap = r->stack_cap ? r->stack_cap * 2 : min_names;
+        char *s = realloc(r->stack, cap);
+        if (s == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return false;
+        }
+        r->stack = s;
+        r->stack_cap = cap;
+    }
+    r->stack[depth] = type;
+    return true;
+}
+
+/**
+ * @brief Deliver the events of one record frame. After a callback fails
+ * the frame is still read through, without callbacks, for the names it
+ * defines.
+ */
+static ld_status read_record(ldb_reader *r, const char *p, const char *e, const ld_callbacks *cb, void *user) {
+    size_t depth = 0;
+    bool started = false;
+    bool valid = true;
+    bool ok = true;
+    const char *name;
+    size_t name_len;
+    ld_value v;
+    while (valid && p < e) {
+        char type = *p++;
+        if (depth == 0 && (started || (type != key_start_obj && type != key_start_array))) {
+            valid = false;
+        } else if (type == key_end_obj || type == key_end_array) {
+            valid = r->stack[depth - 1] == (type == key_end_obj ? key_start_obj : key_start_array);
+            if (valid) {
+                depth--;
+                ok = ok && (cb->end == NULL || cb->end(user, type));
+            }
+        } else if (!get_name(r, &p, e, &name, &name_len)) {
+            valid = false;
+        } else if (type == key_start_obj || type == key_start_array) {
+            if (!push(r, depth, type)) {
+                return ld_failed;
+            }
+            stats_key(type);
+            started = true;
+            depth++;
+            stats_depth(depth);
+            ok = ok && (cb->begin == NULL || cb->begin(user, name, name_len, type));
+        } else {
+            memset(&v, 0, sizeof(v));
+            v.type = type;
+            v.name = name;
+            v.name_len = name_len;
+            valid = read_value(&p, e, &v);
+            stats_key(type);
+            ok = ok && valid && (cb->value == NULL || cb->value(user, &v));
+        }
+    }
+    if (!valid || depth > 0 || !started) {
+        fprintf(stderr, "Invalid binary record at byte %" PRIu64 "\n", r->record_offset);
+        return ld_failed;
+    }
+    return ok ? ld_record : ld_failed;
+}
+
+/**
+ * @brief Read what follows the name of a value event.
+ * @return true on success, false if the event is malformed.
+ */
+static bool read_value(const char **p, const char *e, ld_value *v) {
+    switch (v->type) {
+        case key_string:
+            return get_text(p, e, &v->data, &v->len);
+        case key_number: {
+            if (e - *p < 9) {
+                return false;
+            }
+            unsigned char flags = **p;
+            uint64_t bits = get_le(*p + 1, 8);
+            *p += 9;
+            if (!get_text(p, e, &v->data, &v->len)) {
+                return false;
+            }
+            v->num.real = flags & ldb_number_real;
+            v->num.json = flags & ldb_number_json;
+            if (v->num.real) {
+                memcpy(&v->num.d, &bits, sizeof(v->num.d));
+            } else {
+                v->num.i = (int64_t)bits;
+            }
+            v->num.s = v->data;
+            v->num.len = v->len;
+            return true;
+        }
+        case key_boolean:
+            if (*p == e) {
+                return false;
+            }
+            v->boolean = *(*p)++ == 1;
+            v->data = v->boolean ? "true" : "false";
+            v->len = strlen(v->data);
+            return true;
+        case key_null:
+            v->data = "null";
+            v->len = 4;
+            return true;
+        default:
+            return false;
+    }
+}
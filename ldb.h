@@ -0,0 +1,104 @@
+/**
+ * @file ldb.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Binary form of parsed LD records, and a reader for it.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _LDB_H
+#define _LDB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "input.h"
+#include "ld.h"
+
+// A stream is a series of frames. A header frame is the magic followed by
+// a version byte; it starts the stream and may appear again between
+// records, which empties the key table, so that streams can be
+// concatenated. A record frame is ldb_record, the length of the rest of
+// the frame as four bytes, least significant first, and the record's
+// events.
+#define ldb_magic "\377LDB"
+#define ldb_magic_len 4
+#define ldb_version 1
+#define ldb_record 'R'
+#define ldb_header_len (ldb_magic_len + 1)
+#define ldb_record_header_len 5
+
+// Each event starts with its LD key type. Begin ({, [) and value ($, #, ?,
+// !) events then give the member name as a varint (LEB128): ldb_name_none
+// for no name, ldb_name_inline or ldb_name_define followed by the name's
+// length and text, or ldb_name_first plus the number of an earlier
+// ldb_name_define. Defined names are numbered from 0 in the order they
+// appear since the last header. After the name, $ has a length and text,
+// # has ldb_number_* flags, its value as eight bytes (an int64, or the
+// bits of a double if ldb_number_real is set), least significant first,
+// and the length and text it was written with, and ? has a byte that is 1
+// for true. End events (}, ]) have nothing after the type.
+#define ldb_name_none 0
+#define ldb_name_inline 1
+#define ldb_name_define 2
+#define ldb_name_first 3
+#define ldb_number_real 1
+#define ldb_number_json 2
+
+/**
+ * @brief A defined name, as an offset into the reader's copy of the names.
+ */
+typedef struct ldb_name {
+    size_t offset;
+    size_t len;
+} ldb_name;
+
+/**
+ * @brief Reads binary records from an input. A zeroed reader with its
+ * input set is ready to use.
+ */
+typedef struct ldb_reader {
+    input *in;
+    char *text;             // defined names, one after another
+    size_t text_len;
+    size_t text_cap;
+    ldb_name *names;
+    size_t count;
+    size_t cap;
+    char *stack;            // types of the open containers
+    size_t stack_cap;
+    uint64_t offset;        // offset just past the last frame read
+    uint64_t record_offset; // offset of the last record frame
+    long int records;       // record frames read
+} ldb_reader;
+
+/**
+ * @brief Check whether an input holds binary records, without reading any
+ * of it.
+ * @param in Input to look at.
+ * @return true if the input starts with a header frame.
+ */
+extern bool ldb_detect(input *in);
+
+/**
+ * @brief Read the next record and deliver its events to callbacks, as
+ * ld_parser_next() does. Values point into the input, which a mapped file
+ * makes free, and numbers arrive already converted. Errors are reported
+ * on stderr. A record that fails is still read to its end, so the next
+ * one starts in the right place and knows every name.
+ * @param r Reader.
+ * @param cb Callbacks.
+ * @param user Pointer passed to every callback.
+ * @return Status of the record.
+ */
+extern ld_status ldb_next(ldb_reader *r, const ld_callbacks *cb, void *user);
+
+/**
+ * @brief Release the memory held by a reader. Its input is not closed.
+ * @param r Reader.
+ */
+extern void ldb_free(ldb_reader *r);
+
+#endif // _LDB_H
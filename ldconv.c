@@ -0,0 +1,43 @@
+/**
+ * @file ldconv.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief ld2json and json2ld in a single binary. The tool is picked by the
+ * name the binary is run as, or by the first argument: ldconv ld2json -p.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+// The Makefile compiles ld2json.c and json2ld.c a second time with main()
+// renamed to these.
+extern int json2ld_main(int ac, char **av);
+extern int ld2json_main(int ac, char **av);
+
+static int run(const char *name, int ac, char **av);
+
+int main(int ac, char **av) {
+    const char *name = strrchr(av[0], '/');
+    name = name != NULL ? name + 1 : av[0];
+    int r = run(name, ac, av);
+    if (r < 0 && ac > 1) {
+        r = run(av[1], ac - 1, av + 1);
+    }
+    if (r < 0) {
+        fprintf(stderr, "Usage: %s ld2json|json2ld [options]\n", av[0]);
+        return 1;
+    }
+    return r;
+}
+
+static int run(const char *name, int ac, char **av) {
+    if (strcmp(name, "ld2json") == 0) {
+        return ld2json_main(ac, av);
+    }
+    if (strcmp(name, "json2ld") == 0) {
+        return json2ld_main(ac, av);
+    }
+    return -1;
+}
@@ -0,0 +1,182 @@
+/**
+ * @file lines.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Splits a block of LD input into an index of classified lines.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "input.h"
+#include "ld.h"
+#include "lines.h"
+#include "stats.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define simd_width 32
+#define simd_lane_shift 0
+#define simd_all ((simd_mask)0xffffffff)
+typedef uint32_t simd_mask;
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define simd_width 16
+#define simd_lane_shift 0
+#define simd_all ((simd_mask)0xffff)
+typedef uint32_t simd_mask;
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define simd_width 16
+#define simd_lane_shift 2
+#define simd_all ((simd_mask)0x8888888888888888ull)
+typedef uint64_t simd_mask;
+#endif
+
+#define min_index_len 1024
+
+static bool add_line(line_index *ix, const char *s, const char *stop);
+static const char *skip_spaces(const char *s, const char *end);
+#ifdef simd_width
+static inline simd_mask match(const char *s, char c);
+static inline unsigned int first_lane(simd_mask m);
+#endif
+
+bool lines_scan(line_index *ix, const char *block, size_t len) {
+    const char *end = block + len;
+    const char *start = block;
+    const char *s = block;
+    ix->count = 0;
+#ifdef simd_width
+    for (; end - s >= simd_width; s += simd_width) {
+        simd_mask m = match(s, '\n');
+        while (m != 0) {
+            const char *lf = s + first_lane(m) + 1;
+            if (!add_line(ix, start, lf)) {
+                return false;
+            }
+            start = lf;
+            m &= m - 1;
+        }
+    }
+#endif
+    while (s < end) {
+        const char *lf = memchr(s, '\n', end - s);
+        if (lf == NULL) {
+            break;
+        }
+        if (!add_line(ix, start, lf + 1)) {
+            return false;
+        }
+        start = s = lf + 1;
+    }
+    if (start < end) {
+        return add_line(ix, start, end);
+    }
+    return true;
+}
+
+void lines_free(line_index *ix) {
+    free(ix->lines);
+    memset(ix, 0, sizeof(*ix));
+}
+
+const line_info *lines_next(line_index *ix, input *in, size_t *pos) {
+    if (*pos == ix->count) {
+        size_t len;
+        const char *block = input_get_block(in, &len);
+        if (block == NULL) {
+            return NULL;
+        }
+        stats_begin(t);
+        bool ok = lines_scan(ix, block, len);
+        stats_end(stats_lines, t);
+        if (!ok) {
+            return NULL;
+        }
+        if (in->fd >= 0) {
+            stats_count(stats_lines_in, ix->count);
+        }
+        *pos = 0;
+    }
+    return &ix->lines[(*pos)++];
+}
+
+static bool add_line(line_index *ix, const char *s, const char *stop) {
+    if (ix->count == ix->cap) {
+        size_t cap = ix->cap ? ix->cap * 2 : min_index_len;
+        line_info *n = realloc(ix->lines, cap * sizeof(*ix->lines));
+        stats_count(stats_allocations, 1);
+        if (n == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return false;
+        }
+        ix->lines = n;
+        ix->cap = cap;
+    }
+    line_info *l = &ix->lines[ix->count++];
+    const char *e = stop;
+    while (e > s && (e[-1] == '\n' || e[-1] == '\r')) {
+        e--;
+    }
+    const char *lp = skip_spaces(s, e);
+    const char *q = lp;
+    while (q < e && isspace(*q)) {
+        q++;
+    }
+    l->s = s;
+    l->len = e - s;
+    l->size = stop - s;
+    l->indent = lp - s;
+    l->key = e - lp >= (long)key_type_position - 1 && memcmp(lp, key_prefix, key_type_position - 1) == 0;
+    l->type = e - lp > (long)key_type_position ? lp[key_type_position] : '\0';
+    l->blank = q == e;
+    return true;
+}
+
+static const char *skip_spaces(const char *s, const char *end) {
+#ifdef simd_width
+    for (; end - s >= simd_width; s += simd_width) {
+        simd_mask m = ~match(s, ' ') & simd_all;
+        if (m != 0) {
+            return s + first_lane(m);
+        }
+    }
+#endif
+    while (s < end && *s == ' ') {
+        s++;
+    }
+    return s;
+}
+
+#ifdef simd_width
+
+/**
+ * @brief Compare simd_width bytes against a character.
+ * @return A mask with a set bit for each matching byte, lowest byte first.
+ * On NEON each byte owns four bits of the mask and only the top one is kept.
+ */
+static inline simd_mask match(const char *s, char c) {
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)s);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+#elif defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+#else
+    uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)s), vdupq_n_u8((uint8_t)c));
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & simd_all;
+#endif
+}
+
+static inline unsigned int first_lane(simd_mask m) {
+    return (unsigned int)__builtin_ctzll(m) >> simd_lane_shift;
+}
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * @file lines.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Splits a block of LD input into an index of classified lines.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _LINES_H
+#define _LINES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "input.h"
+
+/**
+ * @brief One line of a block. The text is not copied; s points into the
+ * block that was scanned.
+ */
+typedef struct line_info {
+    const char *s;          // start of the line
+    size_t len;             // length without the trailing CR/LF run
+    size_t size;            // length including the trailing CR/LF run
+    unsigned int indent;    // number of leading spaces
+    char type;              // character after the key prefix, or '\0'
+    bool key;               // line starts with the key prefix after indent
+    bool blank;             // line holds nothing but white space
+} line_info;
+
+/**
+ * @brief Lines found in the last block scanned. The array is reused from
+ * block to block.
+ */
+typedef struct line_index {
+    line_info *lines;
+    size_t count;
+    size_t cap;
+} line_index;
+
+/**
+ * @brief Find every line in a block and classify it. Newlines and leading
+ * space runs are located with SSE2/AVX2 or NEON when the compiler targets
+ * them, and with a scalar loop otherwise.
+ * @param ix Index to fill. Previous contents are discarded.
+ * @param block Start of the block.
+ * @param len Length of the block. A final line without a line feed is
+ * included.
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool lines_scan(line_index *ix, const char *block, size_t len);
+
+/**
+ * @brief Release the memory held by an index.
+ * @param ix Index to free.
+ */
+extern void lines_free(line_index *ix);
+
+/**
+ * @brief Get the next line of an input, scanning the next block into the
+ * index when the current one is used up.
+ * @param ix Index holding the current block.
+ * @param in Input to read blocks from.
+ * @param pos Position of the next line in the index.
+ * @return The line, or NULL at end of input or on error. The line remains
+ * valid until the next block is read.
+ */
+extern const line_info *lines_next(line_index *ix, input *in, size_t *pos);
+
+#endif // _LINES_H
@@ -0,0 +1,443 @@
+/**
+ * @file number.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Validates, classifies and converts LD number values in one pass,
+ * and formats numbers for output.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+#define max_mantissa_digits 19
+#define max_exact_mantissa (1ull << 53)
+#define max_exact_exponent 22
+#define max_exponent 100000
+#define max_short_number 128
+
+static const double exact_powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Powers of ten 10^-348, 10^-340, ... 10^340 as normalized 64-bit
+// significands and binary exponents, for Grisu.
+static const struct { uint64_t f; int e; } cached_powers[] = {
+    { 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 },
+    { 0x8b16fb203055ac76ULL, -1166 }, { 0xcf42894a5dce35eaULL, -1140 },
+    { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+    { 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 },
+    { 0xbe5691ef416bd60cULL, -1007 }, { 0x8dd01fad907ffc3cULL, -980 },
+    { 0xd3515c2831559a83ULL, -954 }, { 0x9d71ac8fada6c9b5ULL, -927 },
+    { 0xea9c227723ee8bcbULL, -901 }, { 0xaecc49914078536dULL, -874 },
+    { 0x823c12795db6ce57ULL, -847 }, { 0xc21094364dfb5637ULL, -821 },
+    { 0x9096ea6f3848984fULL, -794 }, { 0xd77485cb25823ac7ULL, -768 },
+    { 0xa086cfcd97bf97f4ULL, -741 }, { 0xef340a98172aace5ULL, -715 },
+    { 0xb23867fb2a35b28eULL, -688 }, { 0x84c8d4dfd2c63f3bULL, -661 },
+    { 0xc5dd44271ad3cdbaULL, -635 }, { 0x936b9fcebb25c996ULL, -608 },
+    { 0xdbac6c247d62a584ULL, -582 }, { 0xa3ab66580d5fdaf6ULL, -555 },
+    { 0xf3e2f893dec3f126ULL, -529 }, { 0xb5b5ada8aaff80b8ULL, -502 },
+    { 0x87625f056c7c4a8bULL, -475 }, { 0xc9bcff6034c13053ULL, -449 },
+    { 0x964e858c91ba2655ULL, -422 }, { 0xdff9772470297ebdULL, -396 },
+    { 0xa6dfbd9fb8e5b88fULL, -369 }, { 0xf8a95fcf88747d94ULL, -343 },
+    { 0xb94470938fa89bcfULL, -316 }, { 0x8a08f0f8bf0f156bULL, -289 },
+    { 0xcdb02555653131b6ULL, -263 }, { 0x993fe2c6d07b7facULL, -236 },
+    { 0xe45c10c42a2b3b06ULL, -210 }, { 0xaa242499697392d3ULL, -183 },
+    { 0xfd87b5f28300ca0eULL, -157 }, { 0xbce5086492111aebULL, -130 },
+    { 0x8cbccc096f5088ccULL, -103 }, { 0xd1b71758e219652cULL, -77 },
+    { 0x9c40000000000000ULL, -50 }, { 0xe8d4a51000000000ULL, -24 },
+    { 0xad78ebc5ac620000ULL, 3 }, { 0x813f3978f8940984ULL, 30 },
+    { 0xc097ce7bc90715b3ULL, 56 }, { 0x8f7e32ce7bea5c70ULL, 83 },
+    { 0xd5d238a4abe98068ULL, 109 }, { 0x9f4f2726179a2245ULL, 136 },
+    { 0xed63a231d4c4fb27ULL, 162 }, { 0xb0de65388cc8ada8ULL, 189 },
+    { 0x83c7088e1aab65dbULL, 216 }, { 0xc45d1df942711d9aULL, 242 },
+    { 0x924d692ca61be758ULL, 269 }, { 0xda01ee641a708deaULL, 295 },
+    { 0xa26da3999aef774aULL, 322 }, { 0xf209787bb47d6b85ULL, 348 },
+    { 0xb454e4a179dd1877ULL, 375 }, { 0x865b86925b9bc5c2ULL, 402 },
+    { 0xc83553c5c8965d3dULL, 428 }, { 0x952ab45cfa97a0b3ULL, 455 },
+    { 0xde469fbd99a05fe3ULL, 481 }, { 0xa59bc234db398c25ULL, 508 },
+    { 0xf6c69a72a3989f5cULL, 534 }, { 0xb7dcbf5354e9beceULL, 561 },
+    { 0x88fcf317f22241e2ULL, 588 }, { 0xcc20ce9bd35c78a5ULL, 614 },
+    { 0x98165af37b2153dfULL, 641 }, { 0xe2a0b5dc971f303aULL, 667 },
+    { 0xa8d9d1535ce3b396ULL, 694 }, { 0xfb9b7cd9a4a7443cULL, 720 },
+    { 0xbb764c4ca7a44410ULL, 747 }, { 0x8bab8eefb6409c1aULL, 774 },
+    { 0xd01fef10a657842cULL, 800 }, { 0x9b10a4e5e9913129ULL, 827 },
+    { 0xe7109bfba19c0c9dULL, 853 }, { 0xac2820d9623bf429ULL, 880 },
+    { 0x80444b5e7aa7cf85ULL, 907 }, { 0xbf21e44003acdd2dULL, 933 },
+    { 0x8e679c2f5e44ff8fULL, 960 }, { 0xd433179d9c8cb841ULL, 986 },
+    { 0x9e19db92b4e31ba9ULL, 1013 }, { 0xeb96bf6ebadf77d9ULL, 1039 },
+    { 0xaf87023b9bf0ee6bULL, 1066 },
+};
+
+static const uint32_t powers_of_ten[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/**
+ * @brief A number f * 2^e with a 64-bit significand.
+ */
+typedef struct diy_fp {
+    uint64_t f;
+    int e;
+} diy_fp;
+
+static int digit_gen(diy_fp w, diy_fp mp, uint64_t delta, char *buf, int *k);
+static diy_fp fp_mul(diy_fp x, diy_fp y);
+static diy_fp fp_normalize(diy_fp x);
+static int grisu2(double d, char *buf, int *k);
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w);
+static inline bool is_digit(char c);
+static size_t prettify(char *buf, int len, int k);
+
+size_t number_format_double(char *buf, double d) {
+    if (isnan(d)) {
+        memcpy(buf, "NaN", 3);
+        return 3;
+    }
+    if (isinf(d)) {
+        memcpy(buf, d > 0 ? "Infinity" : "-Infinity", d > 0 ? 8 : 9);
+        return d > 0 ? 8 : 9;
+    }
+    size_t sign = signbit(d) ? 1 : 0;
+    buf[0] = '-';
+    if (d == 0) {
+        memcpy(buf + sign, "0e0", 3);
+        return sign + 3;
+    }
+    int k;
+    int len = grisu2(fabs(d), buf + sign, &k);
+    return sign + prettify(buf + sign, len, k);
+}
+
+size_t number_format_int(char *buf, int64_t v) {
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    while (u >= 100) {
+        p -= 2;
+        memcpy(p, digit_pairs + (u % 100) * 2, 2);
+        u /= 100;
+    }
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + u * 2, 2);
+    } else {
+        *--p = '0' + u;
+    }
+    size_t len = tmp + sizeof(tmp) - p;
+    size_t sign = v < 0 ? 1 : 0;
+    buf[0] = '-';
+    memcpy(buf + sign, p, len);
+    return sign + len;
+}
+
+bool number_parse(const char *s, size_t len, number *n) {
+    const char *p = s;
+    const char *end = s + len;
+    uint64_t mantissa = 0;
+    uint64_t integer = 0;
+    int digits = 0;
+    int dropped = 0;
+    long exponent = 0;
+    bool negative = false;
+    bool int_overflow = false;
+    bool fraction = false;
+    bool has_exponent = false;
+    bool truncated = false;
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    n->s = p;
+    n->json = true;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        n->json = *p == '-';
+        p++;
+    }
+    const char *int_start = p;
+    for (; p < end && is_digit(*p); p++) {
+        unsigned int d = *p - '0';
+        if (integer > (UINT64_MAX - d) / 10) {
+            int_overflow = true;
+        } else {
+            integer = integer * 10 + d;
+        }
+        if (digits < max_mantissa_digits) {
+            if (mantissa != 0 || d != 0) {
+                mantissa = mantissa * 10 + d;
+                digits++;
+            }
+        } else {
+            dropped++;
+            truncated = true;
+        }
+    }
+    if (p == int_start || (p - int_start > 1 && *int_start == '0')) {
+        n->json = false;
+    }
+    bool have_digits = p > int_start;
+    if (p < end && *p == '.') {
+        const char *frac_start = ++p;
+        for (; p < end && is_digit(*p); p++) {
+            unsigned int d = *p - '0';
+            fraction |= d != 0;
+            if (digits < max_mantissa_digits) {
+                if (mantissa != 0 || d != 0) {
+                    mantissa = mantissa * 10 + d;
+                    digits++;
+                }
+                exponent--;
+            } else {
+                truncated = true;
+            }
+        }
+        if (p == frac_start) {
+            return false;
+        }
+        have_digits = true;
+    }
+    if (!have_digits) {
+        return false;
+    }
+    exponent += dropped;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        long e = 0;
+        bool e_negative = false;
+        has_exponent = true;
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) {
+            e_negative = *p == '-';
+            p++;
+        }
+        if (p == end || !is_digit(*p)) {
+            return false;
+        }
+        for (; p < end && is_digit(*p); p++) {
+            if (e < max_exponent) {
+                e = e * 10 + (*p - '0');
+            }
+        }
+        exponent += e_negative ? -e : e;
+    }
+    n->len = p - n->s;
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    if (p != end) {
+        return false;
+    }
+    if (!has_exponent && !fraction && !int_overflow && integer <= (uint64_t)INT64_MAX + negative) {
+        n->real = false;
+        n->i = negative ? (int64_t)(0 - integer) : (int64_t)integer;
+        return true;
+    }
+    n->real = true;
+    if (!truncated && mantissa <= max_exact_mantissa && exponent >= -max_exact_exponent && exponent <= max_exact_exponent) {
+        double d = (double)mantissa;
+        d = exponent < 0 ? d / exact_powers[-exponent] : d * exact_powers[exponent];
+        n->d = negative ? -d : d;
+    } else {
+        // strtod() needs a terminated copy; long digit strings are rare.
+        char buf[max_short_number];
+        char *t = n->len < sizeof(buf) ? buf : malloc(n->len + 1);
+        if (t == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            return false;
+        }
+        memcpy(t, n->s, n->len);
+        t[n->len] = '\0';
+        n->d = strtod(t, NULL);
+        if (t != buf) {
+            free(t);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Generate the digits of w, stopping as soon as they identify a
+ * number between the boundaries mp - delta and mp.
+ * @return Number of digits. k is adjusted by the digits not generated.
+ */
+static int digit_gen(diy_fp w, diy_fp mp, uint64_t delta, char *buf, int *k) {
+    diy_fp one = { (uint64_t)1 << -mp.e, mp.e };
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = 1;
+    int len = 0;
+    while (kappa < 10 && p1 >= powers_of_ten[kappa]) {
+        kappa++;
+    }
+    while (kappa > 0) {
+        uint32_t d = p1 / powers_of_ten[kappa - 1];
+        p1 %= powers_of_ten[kappa - 1];
+        if (d != 0 || len > 0) {
+            buf[len++] = '0' + d;
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            grisu_round(buf, len, delta, rest, (uint64_t)powers_of_ten[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+    while (1) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d != 0 || len > 0) {
+            buf[len++] = '0' + d;
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(buf, len, delta, p2, one.f, -kappa < 10 ? wp_w * powers_of_ten[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+/**
+ * @brief Multiply, keeping the upper 64 bits of the product rounded.
+ */
+static diy_fp fp_mul(diy_fp x, diy_fp y) {
+    const uint64_t m32 = 0xffffffff;
+    uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & m32) + (bc & m32) + (1u << 31);
+    diy_fp r = { ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64 };
+    return r;
+}
+
+static diy_fp fp_normalize(diy_fp x) {
+    while (!(x.f & ((uint64_t)1 << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/**
+ * @brief Grisu2 (Loitsch, "Printing floating-point numbers quickly and
+ * accurately with integers"). The digits always read back as d, and are
+ * the shortest that do in all but a tiny fraction of cases.
+ * @param d A finite, positive value.
+ * @param buf Receives the digits, at most 17 of them.
+ * @param k Receives the decimal exponent: d is about digits * 10^k.
+ * @return Number of digits.
+ */
+static int grisu2(double d, char *buf, int *k) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    const uint64_t hidden = (uint64_t)1 << 52;
+    int biased = (int)(bits >> 52) & 0x7ff;
+    diy_fp v = { bits & (hidden - 1), 1 - 1075 };
+    if (biased != 0) {
+        v.f += hidden;
+        v.e = biased - 1075;
+    }
+    // The boundaries halfway to the neighbouring doubles, with the upper
+    // one normalized and the lower one brought to the same exponent.
+    diy_fp plus = { (v.f << 1) + 1, v.e - 1 };
+    while (!(plus.f & (hidden << 1))) {
+        plus.f <<= 1;
+        plus.e--;
+    }
+    plus.f <<= 64 - 52 - 2;
+    plus.e -= 64 - 52 - 2;
+    diy_fp minus = v.f == hidden ? (diy_fp){ (v.f << 2) - 1, v.e - 2 } : (diy_fp){ (v.f << 1) - 1, v.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    // A power of ten that brings the upper boundary's exponent into
+    // [-60, -32], so that its integer part fits in 32 bits.
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int ki = (int)dk;
+    if (dk - ki > 0.0) {
+        ki++;
+    }
+    unsigned int index = (unsigned int)((ki >> 3) + 1);
+    diy_fp c = { cached_powers[index].f, cached_powers[index].e };
+    *k = -(-348 + (int)(index << 3));
+    diy_fp w = fp_mul(fp_normalize(v), c);
+    diy_fp wp = fp_mul(plus, c);
+    diy_fp wm = fp_mul(minus, c);
+    wm.f++;
+    wp.f--;
+    return digit_gen(w, wp, wp.f - wm.f, buf, k);
+}
+
+/**
+ * @brief Move the last digit towards w while the result stays inside the
+ * boundaries.
+ */
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+/**
+ * @brief Lay out digits * 10^k as a decimal, or with an exponent when that
+ * would take more than 21 digits or 6 leading zeros. A whole number always
+ * takes an exponent, as in 2e0: number_parse() reads 2.0 as an integer.
+ * @return Length of the text.
+ */
+static size_t prettify(char *buf, int len, int k) {
+    int point = len + k;
+    if (k < 0 && point > 0 && point <= 21) {
+        memmove(buf + point + 1, buf + point, len - point);
+        buf[point] = '.';
+        return len + 1;
+    }
+    if (point > -6 && point <= 0) {
+        int offset = 2 - point;
+        memmove(buf + offset, buf, len);
+        buf[0] = '0';
+        buf[1] = '.';
+        memset(buf + 2, '0', offset - 2);
+        return len + offset;
+    }
+    size_t n = 1;
+    if (len > 1) {
+        memmove(buf + 2, buf + 1, len - 1);
+        buf[1] = '.';
+        n = len + 1;
+    }
+    buf[n++] = 'e';
+    int e = point - 1;
+    if (e < 0) {
+        buf[n++] = '-';
+        e = -e;
+    }
+    if (e >= 100) {
+        buf[n++] = '0' + e / 100;
+        e %= 100;
+        memcpy(buf + n, digit_pairs + e * 2, 2);
+        n += 2;
+    } else if (e >= 10) {
+        memcpy(buf + n, digit_pairs + e * 2, 2);
+        n += 2;
+    } else {
+        buf[n++] = '0' + e;
+    }
+    return n;
+}
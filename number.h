@@ -0,0 +1,68 @@
+/**
+ * @file number.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Validates, classifies and converts LD number values in one pass,
+ * and formats numbers for output.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _NUMBER_H
+#define _NUMBER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A parsed number. Values without an exponent whose fraction is all
+ * zeros are integers, as are plain digit strings that fit in an int64.
+ * Everything else is a double.
+ */
+typedef struct number {
+    bool real;          // value is in d rather than i
+    bool json;          // text is already a valid JSON number
+    int64_t i;
+    double d;
+    const char *s;      // number text without surrounding spaces
+    size_t len;
+} number;
+
+// Longest text number_format_double() or number_format_int() writes.
+#define number_max_len 32
+
+/**
+ * @brief Format a double as decimal text that reads back as the same
+ * value as a double, such as 0.1, 2e0 or 1e300, without going through
+ * printf(). The digits are found with Grisu2, which gives the shortest such
+ * text for nearly every value and at most one digit more for the rest. NaN
+ * and infinities are written as NaN, Infinity and -Infinity.
+ * @param buf Receives the text, which is not NUL-terminated. It must have
+ * room for number_max_len characters.
+ * @param d Value.
+ * @return Length of the text.
+ */
+extern size_t number_format_double(char *buf, double d);
+
+/**
+ * @brief Format an integer in decimal, two digits at a time.
+ * @param buf Receives the text, which is not NUL-terminated. It must have
+ * room for number_max_len characters.
+ * @param v Value.
+ * @return Length of the text.
+ */
+extern size_t number_format_int(char *buf, int64_t v);
+
+/**
+ * @brief Parse a number: an optional sign, digits with an optional
+ * fraction, and an optional exponent, with optional spaces around it.
+ * Doubles are correctly rounded.
+ * @param s Text to parse. It does not need to be NUL-terminated.
+ * @param len Length of the text.
+ * @param n Receives the value.
+ * @return true if the text is a valid number, false if not.
+ */
+extern bool number_parse(const char *s, size_t len, number *n);
+
+#endif // _NUMBER_H
@@ -0,0 +1,393 @@
+/**
+ * @file output.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Buffered output writer shared by ld2json and json2ld.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "ld.h"
+#include "number.h"
+#include "output.h"
+#include "stats.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define simd_width 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define simd_width 16
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define simd_width 16
+#endif
+
+#define min_output_len 4096
+
+static const char *clean_run(const char *s, const char *end);
+static const char *last_space(const char *lo, const char *hi);
+static bool put_line(output *o, const char *s, size_t len);
+static bool reserve(output *o, size_t len);
+static bool write_all(output *o, struct iovec *iov, int count);
+
+void output_open(output *o, int fd, size_t limit) {
+    memset(o, 0, sizeof(*o));
+    o->fd = fd;
+    o->limit = limit ? limit : output_default_len;
+}
+
+bool output_compress(output *o, codec_kind kind) {
+    o->codec = codec_writer_new(o->fd, kind);
+    return o->codec != NULL;
+}
+
+bool output_append(output *o, const char *s, size_t len) {
+    // A buffer nothing has been written to yet has no data to copy into.
+    if (len == 0) {
+        return true;
+    }
+    if (!reserve(o, len)) {
+        return false;
+    }
+    memcpy(o->data + o->len, s, len);
+    o->len += len;
+    return true;
+}
+
+bool output_char(output *o, char c) {
+    if (o->len == o->cap && !reserve(o, 1)) {
+        return false;
+    }
+    o->data[o->len++] = c;
+    return true;
+}
+
+bool output_double(output *o, double d) {
+    if (!reserve(o, number_max_len)) {
+        return false;
+    }
+    o->len += number_format_double(o->data + o->len, d);
+    return true;
+}
+
+bool output_escaped(output *o, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const char *end = s + len;
+    while (1) {
+        const char *e = clean_run(s, end);
+        if (!output_append(o, s, e - s)) {
+            return false;
+        }
+        if (e == end) {
+            return true;
+        }
+        unsigned char c = *e;
+        char esc[6] = { '\\', 0, '0', '0', 0, 0 };
+        size_t el = 2;
+        switch (c) {
+            case '\b':
+                esc[1] = 'b';
+                break;
+            case '\f':
+                esc[1] = 'f';
+                break;
+            case '\n':
+                esc[1] = 'n';
+                break;
+            case '\r':
+                esc[1] = 'r';
+                break;
+            case '\t':
+                esc[1] = 't';
+                break;
+            case '"':
+            case '\\':
+            case '/':
+                esc[1] = c;
+                break;
+            default:
+                esc[1] = 'u';
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0xf];
+                el = 6;
+                break;
+        }
+        if (!output_append(o, esc, el)) {
+            return false;
+        }
+        s = e + 1;
+    }
+}
+
+bool output_int(output *o, int64_t v) {
+    if (!reserve(o, number_max_len)) {
+        return false;
+    }
+    o->len += number_format_int(o->data + o->len, v);
+    return true;
+}
+
+bool output_key(output *o, size_t indent, char type, const char *name) {
+    size_t nl = strlen(name);
+    if (!reserve(o, indent + key_type_position + nl + 2)) {
+        return false;
+    }
+    memset(o->data + o->len, ' ', indent);
+    o->len += indent;
+    memcpy(o->data + o->len, key_prefix, key_type_position);
+    o->len += key_type_position;
+    o->data[o->len++] = type;
+    stats_key(type);
+    memcpy(o->data + o->len, name, nl);
+    o->len += nl;
+    o->data[o->len++] = '\n';
+    return true;
+}
+
+bool output_spaces(output *o, size_t n) {
+    if (!reserve(o, n)) {
+        return false;
+    }
+    memset(o->data + o->len, ' ', n);
+    o->len += n;
+    return true;
+}
+
+bool output_wrapped(output *o, const char *s, size_t len, size_t width, size_t indent) {
+    const char *end = s + len;
+    size_t room = width - indent;
+    while (1) {
+        if (!output_spaces(o, indent)) {
+            return false;
+        }
+        if ((size_t)(end - s) <= room) {
+            return put_line(o, s, end - s);
+        }
+        // Break after the last white space of the line, or one character
+        // past the width if there is none.
+        const char *e = last_space(s + 1, s + room);
+        if (e == NULL) {
+            e = s + room;
+        }
+        if (!put_line(o, s, e - s + 1)) {
+            return false;
+        }
+        s = e + 1;
+        if (s == end) {
+            return true;
+        }
+        if (!output_char(o, '\n')) {
+            return false;
+        }
+    }
+}
+
+bool output_write(output *o, const char *s, size_t len) {
+    if (o->fd < 0 || o->len + len < o->limit) {
+        return output_append(o, s, len);
+    }
+    struct iovec iov[2] = { { o->data, o->len }, { (void *)s, len } };
+    bool ok = o->error || write_all(o, iov, 2);
+    o->len = 0;
+    return ok && !o->error;
+}
+
+bool output_maybe_flush(output *o) {
+    if (o->len >= o->limit) {
+        return output_flush(o);
+    }
+    return !o->error;
+}
+
+bool output_flush(output *o) {
+    if (o->fd < 0 || o->len == 0) {
+        return !o->error;
+    }
+    struct iovec iov = { o->data, o->len };
+    bool ok = o->error || write_all(o, &iov, 1);
+    o->len = 0;
+    return ok && !o->error;
+}
+
+bool output_close(output *o) {
+    bool ok = output_flush(o);
+    if (o->codec != NULL) {
+        ok = codec_close(o->codec) && ok;
+        o->codec = NULL;
+    }
+    free(o->data);
+    o->data = NULL;
+    o->len = o->cap = 0;
+    return ok;
+}
+
+/**
+ * @brief Find the first byte in [s, end) that output_escaped() has to
+ * escape: a control character, a quote, a backslash or a slash. Clean
+ * bytes are passed over a vector at a time.
+ * @return Pointer to the byte, or end if there is none.
+ */
+static const char *clean_run(const char *s, const char *end) {
+#ifdef simd_width
+    while (end - s >= simd_width) {
+#if defined(__AVX2__)
+        __m256i v = _mm256_loadu_si256((const __m256i *)s);
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x1f)), _mm256_set1_epi8(0x1f));
+        __m256i q = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+        uint32_t m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(ctl, q), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'))));
+        if (m != 0) {
+            return s + __builtin_ctz(m);
+        }
+#elif defined(__SSE2__)
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        __m128i ctl = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f));
+        __m128i q = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        uint32_t m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(ctl, q), _mm_cmpeq_epi8(v, _mm_set1_epi8('/'))));
+        if (m != 0) {
+            return s + __builtin_ctz(m);
+        }
+#else
+        uint8x16_t v = vld1q_u8((const uint8_t *)s);
+        uint8x16_t q = vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\')));
+        uint8x16_t hit = vorrq_u8(vorrq_u8(vcltq_u8(v, vdupq_n_u8(' ')), q), vceqq_u8(v, vdupq_n_u8('/')));
+        uint64_t m = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+        if (m != 0) {
+            return s + __builtin_ctzll(m) / 4;
+        }
+#endif
+        s += simd_width;
+    }
+#endif
+    for (; s < end; s++) {
+        unsigned char c = *s;
+        if (c < ' ' || c == '"' || c == '\\' || c == '/') {
+            break;
+        }
+    }
+    return s;
+}
+
+/**
+ * @brief Find the last white space character (as isspace() in the C locale
+ * sees it) in [lo, hi), a vector at a time from the end.
+ */
+static const char *last_space(const char *lo, const char *hi) {
+#ifdef simd_width
+    while (hi - lo >= simd_width) {
+        hi -= simd_width;
+#if defined(__AVX2__)
+        __m256i v = _mm256_loadu_si256((const __m256i *)hi);
+        __m256i c = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+        __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(_mm256_min_epu8(c, _mm256_set1_epi8(4)), c));
+        uint32_t m = _mm256_movemask_epi8(ws);
+        if (m != 0) {
+            return hi + 31 - __builtin_clz(m);
+        }
+#elif defined(__SSE2__)
+        __m128i v = _mm_loadu_si128((const __m128i *)hi);
+        __m128i c = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(_mm_min_epu8(c, _mm_set1_epi8(4)), c));
+        uint32_t m = _mm_movemask_epi8(ws);
+        if (m != 0) {
+            return hi + 31 - __builtin_clz(m);
+        }
+#else
+        uint8x16_t v = vld1q_u8((const uint8_t *)hi);
+        uint8x16_t ws = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vcltq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(5)));
+        uint64_t m = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(ws), 4)), 0);
+        if (m != 0) {
+            return hi + (63 - __builtin_clzll(m)) / 4;
+        }
+#endif
+    }
+#endif
+    while (hi > lo) {
+        unsigned char c = *--hi;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) {
+            return hi;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Append text with line feeds written as the two characters \n, so
+ * that it stays on one LD line.
+ */
+static bool put_line(output *o, const char *s, size_t len) {
+    const char *end = s + len;
+    const char *nl;
+    while ((nl = memchr(s, '\n', end - s)) != NULL) {
+        if (!output_append(o, s, nl - s) || !output_append(o, "\\n", 2)) {
+            return false;
+        }
+        s = nl + 1;
+    }
+    return output_append(o, s, end - s);
+}
+
+static bool reserve(output *o, size_t len) {
+    if (o->len + len <= o->cap) {
+        return true;
+    }
+    size_t cap = o->cap ? o->cap : min_output_len;
+    while (cap < o->len + len) {
+        cap *= 2;
+    }
+    char *n = realloc(o->data, cap);
+    stats_count(stats_allocations, 1);
+    if (n == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return false;
+    }
+    o->data = n;
+    o->cap = cap;
+    return true;
+}
+
+static bool write_all(output *o, struct iovec *iov, int count) {
+    if (o->codec != NULL) {
+        stats_begin(t);
+        for (int i = 0; i < count && !o->error; i++) {
+            o->error = !codec_write(o->codec, iov[i].iov_base, iov[i].iov_len);
+            o->written += iov[i].iov_len;
+            stats_count(stats_bytes_out, iov[i].iov_len);
+        }
+        stats_end(stats_write, t);
+        return !o->error;
+    }
+    while (count > 0) {
+        stats_begin(t);
+        ssize_t r = writev(o->fd, iov, count);
+        stats_end(stats_write, t);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            o->error = true;
+            return false;
+        }
+        o->written += r;
+        stats_count(stats_bytes_out, r);
+        while (count > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,140 @@
+/**
+ * @file output.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Buffered output writer shared by ld2json and json2ld.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codec.h"
+
+#define output_default_len 65536
+
+/**
+ * @brief Output buffer. Appends never write on their own, so a caller can
+ * roll back to an earlier length until it flushes. A writer with no file
+ * descriptor only collects text in memory.
+ */
+typedef struct output {
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t limit;
+    uint64_t written;       // bytes written to fd so far, before compression
+    codec *codec;
+    bool error;
+} output;
+
+/**
+ * @brief Initialize an output writer.
+ * @param o Writer to initialize.
+ * @param fd File descriptor to write to, or -1 to only buffer in memory.
+ * @param limit Number of bytes to collect before output_maybe_flush()
+ * writes them, or 0 for output_default_len.
+ */
+extern void output_open(output *o, int fd, size_t limit);
+
+/**
+ * @brief Compress everything the writer writes from now on. Compression
+ * runs on a thread of its own. codec_copy does not compress, but writes
+ * behind the caller, so flushing never waits on storage.
+ * @param o Writer with a file descriptor.
+ * @param kind codec_gzip, codec_zstd or codec_copy.
+ * @return true on success, false if the compressor could not be started.
+ */
+extern bool output_compress(output *o, codec_kind kind);
+
+/**
+ * @brief Append bytes to the buffer.
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool output_append(output *o, const char *s, size_t len);
+
+/**
+ * @brief Append one character to the buffer.
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool output_char(output *o, char c);
+
+/**
+ * @brief Append a double, formatted by number_format_double().
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool output_double(output *o, double d);
+
+/**
+ * @brief Append text with the JSON string escapes json-c uses.
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool output_escaped(output *o, const char *s, size_t len);
+
+/**
+ * @brief Append an integer, formatted by number_format_int().
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool output_int(output *o, int64_t v);
+
+/**
+ * @brief Append an LD key line: indent spaces, the key prefix, the type
+ * character, the name and a line feed.
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool output_key(output *o, size_t indent, char type, const char *name);
+
+/**
+ * @brief Append a run of spaces.
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool output_spaces(output *o, size_t n);
+
+/**
+ * @brief Append text as LD data lines of at most width characters, each
+ * starting with indent spaces. Lines are broken after white space where
+ * possible and line feeds in the text are written as \n. No line feed is
+ * added after the last line.
+ * @param o Output.
+ * @param s Text to wrap.
+ * @param len Length of the text.
+ * @param width Line width; must be greater than indent.
+ * @param indent Spaces at the start of each line.
+ * @return true on success, false if memory could not be allocated.
+ */
+extern bool output_wrapped(output *o, const char *s, size_t len, size_t width, size_t indent);
+
+/**
+ * @brief Write out the buffer and then a block of bytes with one writev().
+ * Writers without a file descriptor append the block instead.
+ * @return false if the write or the allocation failed.
+ */
+extern bool output_write(output *o, const char *s, size_t len);
+
+/**
+ * @brief Write out the buffer once it holds at least the writer's limit.
+ * @return false if the write failed.
+ */
+extern bool output_maybe_flush(output *o);
+
+/**
+ * @brief Write out the buffer.
+ * @return false if the write failed. The first failure is reported on
+ * stderr, and later output is discarded.
+ */
+extern bool output_flush(output *o);
+
+/**
+ * @brief Flush the buffer, end the compressed stream if there is one, and
+ * release its memory. The file descriptor is left open.
+ * @return false if the final write failed or an earlier one had.
+ */
+extern bool output_close(output *o);
+
+#endif // _OUTPUT_H
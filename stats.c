@@ -0,0 +1,148 @@
+/**
+ * @file stats.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Per-phase timers and counters for --stats.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#ifdef NO_STATS
+
+void stats_start(void) {
+}
+
+void stats_merge(void) {
+}
+
+void stats_print(const char *tool) {
+    fprintf(stderr, "%s was built without --stats support\n", tool);
+}
+
+#else
+
+bool stats_enabled = false;
+_Thread_local stats stats_local;
+
+static const char *phase_names[stats_phases] = {
+    "read", "lines", "values", "numbers", "parse", "tree", "serialize", "write"
+};
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats totals;
+static struct timespec start_time;
+static uint64_t start_ticks;
+
+static double elapsed(void);
+static void print_latency(void);
+
+void stats_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    start_ticks = stats_clock();
+    stats_enabled = true;
+}
+
+void stats_merge(void) {
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i < stats_phases; i++) {
+        totals.ticks[i] += stats_local.ticks[i];
+        totals.calls[i] += stats_local.calls[i];
+    }
+    for (int i = 0; i < stats_counters; i++) {
+        totals.count[i] += stats_local.count[i];
+    }
+    for (int i = 0; i < 128; i++) {
+        totals.keys[i] += stats_local.keys[i];
+    }
+    if (stats_local.max_depth > totals.max_depth) {
+        totals.max_depth = stats_local.max_depth;
+    }
+    for (int i = 0; i < stats_latency_buckets; i++) {
+        totals.latency[i] += stats_local.latency[i];
+    }
+    if (stats_local.max_latency > totals.max_latency) {
+        totals.max_latency = stats_local.max_latency;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    memset(&stats_local, 0, sizeof(stats_local));
+}
+
+void stats_print(const char *tool) {
+    double seconds = elapsed();
+    uint64_t ticks = stats_clock() - start_ticks;
+    // Phase times are summed over all threads, so with -j they can add up
+    // to more than the elapsed time.
+    double per_tick = ticks > 0 ? seconds / ticks : 0;
+    const char *sep = "";
+    stats_merge();
+    fprintf(stderr, "{\"tool\": \"%s\", \"seconds\": %.6f, \"phases\": {", tool, seconds);
+    for (int i = 0; i < stats_phases; i++) {
+        if (totals.calls[i] > 0) {
+            fprintf(stderr, "%s\"%s\": {\"seconds\": %.6f, \"calls\": %llu}", sep, phase_names[i], totals.ticks[i] * per_tick, (unsigned long long)totals.calls[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(stderr, "}, \"bytes_in\": %llu, \"bytes_out\": %llu, \"lines\": %llu, \"records\": %llu, \"keys\": {",
+        (unsigned long long)totals.count[stats_bytes_in], (unsigned long long)totals.count[stats_bytes_out],
+        (unsigned long long)totals.count[stats_lines_in], (unsigned long long)totals.count[stats_records]);
+    sep = "";
+    for (int i = ' '; i < 127; i++) {
+        if (totals.keys[i] > 0) {
+            fprintf(stderr, "%s\"%s%c\": %llu", sep, i == '"' || i == '\\' ? "\\" : "", i, (unsigned long long)totals.keys[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(stderr, "}, \"allocations\": %llu, \"max_depth\": %llu", (unsigned long long)totals.count[stats_allocations], (unsigned long long)totals.max_depth);
+    print_latency();
+    fprintf(stderr, "}\n");
+}
+
+static double elapsed(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Print the latency percentiles, if any latencies were counted. Each
+ * is the top of the bucket it falls in, so it errs on the slow side.
+ */
+static void print_latency(void) {
+    static const struct { const char *name; double part; } percentiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+    uint64_t records = 0;
+    for (int i = 0; i < stats_latency_buckets; i++) {
+        records += totals.latency[i];
+    }
+    if (records == 0) {
+        return;
+    }
+    fprintf(stderr, ", \"latency\": {\"records\": %llu", (unsigned long long)records);
+    for (size_t p = 0; p < sizeof(percentiles) / sizeof(*percentiles); p++) {
+        uint64_t want = (uint64_t)(percentiles[p].part * records);
+        uint64_t seen = 0;
+        int b = 0;
+        while (b < stats_latency_buckets - 1 && (seen += totals.latency[b]) <= want) {
+            b++;
+        }
+        uint64_t top = b;
+        if (b >= 8) {
+            int e = b / 8 + 2;
+            top = ((uint64_t)(b % 8 + 9) << (e - 3)) - 1;
+        }
+        if (top > totals.max_latency) {
+            top = totals.max_latency;
+        }
+        fprintf(stderr, ", \"%s\": %.9f", percentiles[p].name, top / 1e9);
+    }
+    fprintf(stderr, ", \"max\": %.9f}", totals.max_latency / 1e9);
+}
+
+#endif
@@ -0,0 +1,139 @@
+/**
+ * @file stats.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Per-phase timers and counters for --stats. Build with
+ * -D NO_STATS (make nostats=1) to compile them out.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * @brief Phases that are timed. Mapped input has no read phase; its page
+ * faults are counted against whichever phase touches the memory first.
+ */
+typedef enum stats_phase {
+    stats_read,             // reading blocks of input
+    stats_lines,            // splitting blocks into lines and spotting keys
+    stats_values,           // collecting data lines into values
+    stats_numbers,          // validating and converting numbers
+    stats_parse,            // json-c parsing JSON text
+    stats_tree,             // building json-c objects
+    stats_serialize,        // formatting output text
+    stats_write,            // writing output
+    stats_phases
+} stats_phase;
+
+typedef enum stats_counter {
+    stats_bytes_in,
+    stats_bytes_out,
+    stats_lines_in,
+    stats_records,
+    stats_allocations,
+    stats_counters
+} stats_counter;
+
+// Latencies are counted in buckets an eighth of a power of two wide, so
+// that a percentile is within 12.5% of the true value.
+#define stats_latency_buckets 496
+
+/**
+ * @brief Timers and counters of one thread.
+ */
+typedef struct stats {
+    uint64_t ticks[stats_phases];
+    uint64_t calls[stats_phases];
+    uint64_t count[stats_counters];
+    uint64_t keys[128];     // keys seen, by type character
+    uint64_t max_depth;
+    uint64_t latency[stats_latency_buckets]; // records by nanoseconds from input to output
+    uint64_t max_latency;
+} stats;
+
+#ifdef NO_STATS
+
+#define stats_begin(t)
+#define stats_end(phase, t)
+#define stats_count(counter, n)
+#define stats_key(type)
+#define stats_depth(d)
+#define stats_latency(ns) ((void)(ns))
+
+#else
+
+extern bool stats_enabled;
+extern _Thread_local stats stats_local;
+
+/**
+ * @brief Read the cheapest clock there is: the time stamp counter on x86,
+ * the virtual counter on ARM64, and CLOCK_MONOTONIC elsewhere.
+ */
+static inline uint64_t stats_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+#define stats_begin(t) uint64_t t = stats_enabled ? stats_clock() : 0
+#define stats_end(phase, t) do { if (stats_enabled) { stats_local.ticks[phase] += stats_clock() - (t); stats_local.calls[phase]++; } } while (0)
+#define stats_count(counter, n) (stats_local.count[counter] += (n))
+#define stats_key(type) (stats_local.keys[(type) & 127]++)
+#define stats_depth(d) do { if ((uint64_t)(d) > stats_local.max_depth) stats_local.max_depth = (d); } while (0)
+#define stats_latency(ns) stats_add_latency(ns)
+
+/**
+ * @brief Count the time a record took from being read to being written.
+ */
+static inline void stats_add_latency(uint64_t ns) {
+    int b = (int)ns;
+    if (ns >= 8) {
+        int e = 63 - __builtin_clzll(ns);
+        b = (e - 2) * 8 + (int)((ns >> (e - 3)) & 7);
+    }
+    stats_local.latency[b]++;
+    if (ns > stats_local.max_latency) {
+        stats_local.max_latency = ns;
+    }
+}
+
+#endif
+
+/**
+ * @brief Start timing. Phases are only timed after this is called; the
+ * counters always run.
+ */
+extern void stats_start(void);
+
+/**
+ * @brief Add the calling thread's figures to the totals. Worker threads
+ * call this before they exit.
+ */
+extern void stats_merge(void);
+
+/**
+ * @brief Merge the calling thread's figures and print the totals to stderr
+ * as one line of JSON.
+ * @param tool Name of the program, included in the output.
+ */
+extern void stats_print(const char *tool);
+
+#endif // _STATS_H
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# check.sh
+#
+# Checks that ld2json gives the same output and exit status with -j as it
+# does on one thread for each test/*.ld, and that each test/*.jsonl, written
+# as ld2json writes JSON, comes back unchanged through json2ld and ld2json.
+# Started by make check from the top of the tree.
+#
+
+test=test
+failed=0
+
+for file in $test/*.ld; do
+    for option in "" "-d" "-p"; do
+        serial=$(./ld2json $option $file 2>/dev/null; echo "exit $?")
+        parallel=$(./ld2json -j 4 $option $file 2>/dev/null; echo "exit $?")
+        if [ "$serial" != "$parallel" ]; then
+            echo "$file: ld2json $option differs with -j 4" >&2
+            failed=1
+        fi
+    done
+done
+for file in $test/*.jsonl; do
+    if ! ./json2ld $file | ./ld2json | cmp -s - $file; then
+        echo "$file: differs after json2ld and ld2json" >&2
+        failed=1
+    fi
+done
+if [ $failed -ne 0 ]; then
+    exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,185 @@
+/**
+ * @file uring.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Minimal io_uring ring for queueing reads and writes without
+ * liburing. Elsewhere, or when the kernel refuses, uring_new() fails and
+ * callers use threads instead.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#include <stdlib.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include) && !defined(NO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define have_uring
+#endif
+#endif
+
+#ifdef have_uring
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct uring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static bool enter(uring *u, unsigned int submit, unsigned int wait);
+static bool submit(uring *u, int op, int fd, const void *buf, size_t len, int64_t offset, uint64_t tag);
+
+uring *uring_new(unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+    uring *u = calloc(1, sizeof(*u));
+    if (u == NULL) {
+        close(fd);
+        return NULL;
+    }
+    u->fd = fd;
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_len > u->sq_ring_len) {
+            u->sq_ring_len = u->cq_ring_len;
+        }
+        u->cq_ring_len = 0;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->cq_ring = u->sq_ring;
+    if (u->sq_ring != MAP_FAILED && u->cq_ring_len > 0) {
+        u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        uring_free(u);
+        return NULL;
+    }
+    char *sq = u->sq_ring;
+    char *cq = u->cq_ring;
+    u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return u;
+}
+
+bool uring_read(uring *u, int fd, void *buf, size_t len, int64_t offset, uint64_t tag) {
+    return submit(u, IORING_OP_READ, fd, buf, len, offset, tag);
+}
+
+bool uring_write(uring *u, int fd, const void *buf, size_t len, int64_t offset, uint64_t tag) {
+    return submit(u, IORING_OP_WRITE, fd, buf, len, offset, tag);
+}
+
+bool uring_wait(uring *u, uint64_t *tag, int *res) {
+    unsigned int head = *u->cq_head;
+    while (head == load_acquire(u->cq_tail)) {
+        if (!enter(u, 0, 1)) {
+            return false;
+        }
+    }
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    *tag = cqe->user_data;
+    *res = cqe->res;
+    store_release(u->cq_head, head + 1);
+    return true;
+}
+
+void uring_free(uring *u) {
+    if (u == NULL) {
+        return;
+    }
+    if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_len);
+    }
+    if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_len);
+    }
+    if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED) {
+        munmap(u->sq_ring, u->sq_ring_len);
+    }
+    close(u->fd);
+    free(u);
+}
+
+static bool enter(uring *u, unsigned int submit, unsigned int wait) {
+    while (syscall(__NR_io_uring_enter, u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool submit(uring *u, int op, int fd, const void *buf, size_t len, int64_t offset, uint64_t tag) {
+    unsigned int tail = *u->sq_tail;
+    unsigned int i = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = tag;
+    u->sq_array[i] = i;
+    store_release(u->sq_tail, tail + 1);
+    return enter(u, 1, 0);
+}
+
+#else
+
+uring *uring_new(unsigned int entries) {
+    (void)entries;
+    return NULL;
+}
+
+bool uring_read(uring *u, int fd, void *buf, size_t len, int64_t offset, uint64_t tag) {
+    return false;
+}
+
+bool uring_write(uring *u, int fd, const void *buf, size_t len, int64_t offset, uint64_t tag) {
+    return false;
+}
+
+bool uring_wait(uring *u, uint64_t *tag, int *res) {
+    return false;
+}
+
+void uring_free(uring *u) {
+}
+
+#endif
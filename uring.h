@@ -0,0 +1,60 @@
+/**
+ * @file uring.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Minimal io_uring ring for queueing reads and writes without
+ * liburing. Elsewhere, or when the kernel refuses, uring_new() fails and
+ * callers use threads instead.
+ * @version 0.1.0
+ * @date 2024-08-02
+ * @copyright Copyright (c) 2024
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct uring uring;
+
+/**
+ * @brief Set up a ring.
+ * @param entries Most requests that will be in flight at once.
+ * @return The ring, or NULL if io_uring is not available.
+ */
+extern uring *uring_new(unsigned int entries);
+
+/**
+ * @brief Queue and submit a read.
+ * @param u Ring.
+ * @param fd File to read.
+ * @param buf Buffer to fill. It must stay valid until the read completes.
+ * @param len Bytes to read.
+ * @param offset File offset, or -1 to read at the file position.
+ * @param tag Value handed back with the completion.
+ * @return true if the request was submitted.
+ */
+extern bool uring_read(uring *u, int fd, void *buf, size_t len, int64_t offset, uint64_t tag);
+
+/**
+ * @brief Queue and submit a write. Arguments are as for uring_read().
+ */
+extern bool uring_write(uring *u, int fd, const void *buf, size_t len, int64_t offset, uint64_t tag);
+
+/**
+ * @brief Wait for the next request to complete.
+ * @param u Ring.
+ * @param tag Set to the tag of the request.
+ * @param res Set to its result: bytes transferred, or -errno.
+ * @return true on success, false if waiting failed.
+ */
+extern bool uring_wait(uring *u, uint64_t *tag, int *res);
+
+/**
+ * @brief Release a ring. Requests still in flight must have completed.
+ * @param u Ring, or NULL.
+ */
+extern void uring_free(uring *u);
+
+#endif // _URING_H